@@ -10,6 +10,7 @@
 #include <ctype.h>
 #include <limits.h>
 #include <err.h>
+#include <sys/uio.h>
 #include "lua_head.h"
 
 // Process files in 16MB clumps.
@@ -173,14 +174,329 @@ LUAFN(emit_file)
     return 1;
 }
 
+/*
+ * A cpio writer writes straight to its file.  Each record goes out in
+ * one writev(), with the header, name, padding and payload pieces as
+ * separate iovecs, so nothing is copied into Lua strings.  Unlike the
+ * emit functions above, a writer keeps its own offset and inode
+ * numbers, and stamps every entry with the same mtime, so the output
+ * is reproducible given the same options.
+ */
+#define WRITER_META "cpiofns.writer"
+#ifndef IOV_MAX
+// The least POSIX allows.
+#define IOV_MAX 16
+#endif
+#define CPIO_HEADER_SIZE 110
+#define FIRST_INO 721
+
+typedef struct {
+    int fd;
+    unsigned long long offset;
+    UINT ino;
+    long mtime;
+} cpio_writer;
+
+static const char zeros[512];
+
+// writev() the lot, coping with short writes and IOV_MAX.
+static int writev_all(int fd, struct iovec *iov, int count)
+{
+    while (count > 0) {
+	int batch = count < IOV_MAX ? count : IOV_MAX;
+	ssize_t actual = writev(fd, iov, batch);
+	if (actual < 0) {
+	    if (errno == EINTR)
+		continue;
+	    return -1;
+	}
+	while (count > 0 && actual >= (ssize_t)iov->iov_len) {
+	    actual -= iov->iov_len;
+	    iov++;
+	    count--;
+	}
+	if (count > 0) {
+	    iov->iov_base = (char *)iov->iov_base + actual;
+	    iov->iov_len -= actual;
+	}
+	// Skip any empty pieces.
+	while (count > 0 && iov->iov_len == 0) {
+	    iov++;
+	    count--;
+	}
+    }
+    return 0;
+}
+
+static cpio_writer *check_writer(lua_State *L)
+{
+    cpio_writer *writer = luaL_checkudata(L, 1, WRITER_META);
+    if (writer->fd < 0)
+	luaL_error(L, "cpio archive is closed");
+    return writer;
+}
+
+static int writer_error(lua_State *L)
+{
+    lua_pushnil(L);
+    lua_pushstring(L, strerror(errno));
+    return 2;
+}
+
+/* Write one record.  The payload is count pieces starting at iovec
+ * index 3 of iov, which has room for them plus two more.
+ */
+static int write_record(cpio_writer *writer, struct iovec *iov, int count,
+			const char *name, UINT mode, UINT nlink, UINT ino)
+{
+    char header[CPIO_HEADER_SIZE + 1];
+    size_t size = 0;
+
+    if (name[0] == '/')
+	name++;
+    size_t namesize = strlen(name) + 1;
+    for (int i = 0; i < count; i++)
+	size += iov[3 + i].iov_len;
+    if (size > 0xffffffffUL) {
+	errno = EFBIG;
+	return -1;
+    }
+    sprintf(header, "%s%08X%08X%08lX%08lX%08X%08lX"
+	    "%08lX%08X%08X%08X%08X%08X%08X",
+	    "070701",		/* magic */
+	    ino,		/* ino */
+	    mode,		/* mode */
+	    (long) 0,		/* uid */
+	    (long) 0,		/* gid */
+	    nlink,		/* nlink */
+	    writer->mtime,	/* mtime */
+	    (unsigned long)size, /* filesize */
+	    3,			/* major */
+	    1,			/* minor */
+	    0,			/* rmajor */
+	    0,			/* rminor */
+	    (UINT)namesize,	/* namesize */
+	    0);			/* chksum */
+    iov[0].iov_base = header;
+    iov[0].iov_len = CPIO_HEADER_SIZE;
+    iov[1].iov_base = (char *)name;
+    iov[1].iov_len = namesize;
+    iov[2].iov_base = (char *)zeros;
+    iov[2].iov_len = -(CPIO_HEADER_SIZE + namesize) & 3;
+    iov[3 + count].iov_base = (char *)zeros;
+    iov[3 + count].iov_len = -size & 3;
+    if (writev_all(writer->fd, iov, count + 4))
+	return -1;
+    writer->offset += CPIO_HEADER_SIZE + namesize + iov[2].iov_len +
+	size + iov[3 + count].iov_len;
+    return 0;
+}
+
+// cpiofns.open(path [, options]) returns a writer.  Options: mtime,
+// for every entry (else $SOURCE_DATE_EPOCH, else now), and ino, the
+// first inode number.
+LUAFN(open)
+{
+    const char *path = luaL_checkstring(L, 1);
+    long mtime = -1;
+    UINT ino = FIRST_INO;
+
+    if (lua_istable(L, 2)) {
+	lua_getfield(L, 2, "mtime");
+	if (!lua_isnil(L, -1))
+	    mtime = luaL_checkinteger(L, -1);
+	lua_getfield(L, 2, "ino");
+	if (!lua_isnil(L, -1))
+	    ino = luaL_checkinteger(L, -1);
+	lua_pop(L, 2);
+    }
+    if (mtime < 0) {
+	const char *epoch = getenv("SOURCE_DATE_EPOCH");
+	mtime = epoch && *epoch ? strtol(epoch, NULL, 10) : (long)time(NULL);
+    }
+
+    cpio_writer *writer = lua_newuserdata(L, sizeof(cpio_writer));
+    writer->fd = -1;
+    luaL_getmetatable(L, WRITER_META);
+    lua_setmetatable(L, -2);
+    if ((writer->fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0666)) < 0)
+	return writer_error(L);
+    writer->offset = 0;
+    writer->ino = ino;
+    writer->mtime = mtime;
+    return 1;
+}
+
+// writer:dir(name)
+LUAFN(writer_dir)
+{
+    cpio_writer *writer = check_writer(L);
+    const char *name = luaL_checkstring(L, 2);
+    struct iovec iov[4];
+
+    if (write_record(writer, iov, 0, name, 0700 | S_IFDIR, 2, writer->ino++))
+	return writer_error(L);
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+// writer:file(name, parts...) writes a file whose contents are the
+// parts, end to end.
+LUAFN(writer_file)
+{
+    cpio_writer *writer = check_writer(L);
+    const char *name = luaL_checkstring(L, 2);
+    int count = lua_gettop(L) - 2;
+    struct iovec *iov = malloc((count + 4) * sizeof(struct iovec));
+
+    if (!iov)
+	return luaL_error(L, "%s", strerror(ENOMEM));
+    for (int i = 0; i < count; i++) {
+	size_t len;
+	const char *part = lua_tolstring(L, 3 + i, &len);
+	if (!part) {
+	    free(iov);
+	    return luaL_argerror(L, 3 + i, "string expected");
+	}
+	iov[3 + i].iov_base = (char *)part;
+	iov[3 + i].iov_len = len;
+    }
+    int rc = write_record(writer, iov, count, name, 0600 | S_IFREG, 1,
+			  writer->ino++);
+    free(iov);
+    if (rc)
+	return writer_error(L);
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+/* writer:tagfile(name, tuples [, skp_if_not_add]) writes a tagfile
+ * of tag:state lines for an array of tuples, with every state but ADD
+ * written as SKP if skp_if_not_add is set.
+ */
+LUAFN(writer_tagfile)
+{
+    cpio_writer *writer = check_writer(L);
+    const char *name = luaL_checkstring(L, 2);
+    luaL_checktype(L, 3, LUA_TTABLE);
+    int skp_if_not_add = lua_toboolean(L, 4);
+    size_t count = lua_objlen(L, 3);
+    size_t len = 0, size = 4096;
+    char *body = malloc(size);
+
+    if (!body)
+	return luaL_error(L, "%s", strerror(ENOMEM));
+    for (size_t i = 1; i <= count; i++) {
+	size_t taglen, statelen;
+	lua_rawgeti(L, 3, i);
+	lua_getfield(L, -1, "tag");
+	lua_getfield(L, -2, "state");
+	const char *tag = lua_tolstring(L, -2, &taglen);
+	const char *state = lua_tolstring(L, -1, &statelen);
+	if (!tag || !state) {
+	    free(body);
+	    return luaL_error(L, "tuple %d has no tag or state", (int)i);
+	}
+	if (skp_if_not_add && strcmp(state, "ADD")) {
+	    state = "SKP";
+	    statelen = 3;
+	}
+	if (len + taglen + statelen + 2 > size) {
+	    while (len + taglen + statelen + 2 > size)
+		size *= 2;
+	    char *bigger = realloc(body, size);
+	    if (!bigger) {
+		free(body);
+		return luaL_error(L, "%s", strerror(ENOMEM));
+	    }
+	    body = bigger;
+	}
+	memcpy(body + len, tag, taglen);
+	len += taglen;
+	body[len++] = ':';
+	memcpy(body + len, state, statelen);
+	len += statelen;
+	body[len++] = '\n';
+	lua_pop(L, 3);
+    }
+
+    struct iovec iov[5];
+    iov[3].iov_base = body;
+    iov[3].iov_len = len;
+    int rc = write_record(writer, iov, 1, name, 0600 | S_IFREG, 1,
+			  writer->ino++);
+    free(body);
+    if (rc)
+	return writer_error(L);
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+// writer:close([omit_trailer]) finishes the archive.  Without the
+// trailer, the archive may be concatenated with another.
+LUAFN(writer_close)
+{
+    cpio_writer *writer = check_writer(L);
+    int rc = 0;
+
+    if (!lua_toboolean(L, 2)) {
+	struct iovec iov[5];
+	rc = write_record(writer, iov, 0, "TRAILER!!!", 0, 1, 0);
+	if (!rc && writer->offset % 512) {
+	    iov[0].iov_base = (char *)zeros;
+	    iov[0].iov_len = 512 - writer->offset % 512;
+	    rc = writev_all(writer->fd, iov, 1);
+	}
+    }
+    int saved = errno;
+    if (close(writer->fd) && !rc) {
+	rc = -1;
+	saved = errno;
+    }
+    writer->fd = -1;
+    errno = saved;
+    if (rc)
+	return writer_error(L);
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+LUAFN(writer_gc)
+{
+    cpio_writer *writer = luaL_checkudata(L, 1, WRITER_META);
+
+    if (writer->fd >= 0)
+	close(writer->fd);
+    writer->fd = -1;
+    return 0;
+}
+
 LUALIB_API int luaopen_cpiofns(lua_State *L)
 {
     static const luaL_Reg funcptrs[] = {
 	FN_ENTRY(emit_directory),
 	FN_ENTRY(emit_file),
 	FN_ENTRY(emit_trailer),
+	FN_ENTRY(open),
 	{ NULL, NULL }
     };
+
+    static const luaL_Reg writer_methods[] = {
+	{ "dir", lua_fn_writer_dir },
+	{ "file", lua_fn_writer_file },
+	{ "tagfile", lua_fn_writer_tagfile },
+	{ "close", lua_fn_writer_close },
+	{ NULL, NULL }
+    };
+
+    luaL_newmetatable(L, WRITER_META);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, lua_fn_writer_gc);
+    lua_setfield(L, -2, "__gc");
+    luaL_register(L, NULL, writer_methods);
+    lua_pop(L, 1);
+
     luaL_register(L, "cpiofns", funcptrs);
     
     return 1;
@@ -698,11 +698,93 @@ function _G.edit_tagset(tagset, installation)
       end
    end
 
+   -- A manifest being read in the background for suggestions, and
+   -- descriptions being made likewise.
+   local pending_manifest
+   local pending_descriptions = {}
+
+   -- Wake up now and then while there's background work to pick up.
+   local function set_timeout()
+      local busy = tagset:watching() or pending_manifest or
+	 #pending_descriptions > 0
+      l.timeout(busy and 500 or 100000)
+   end
+
+   local function check_descriptions()
+      for i = #pending_descriptions, 1, -1 do
+	 if pending_descriptions[i]() then
+	    table.remove(pending_descriptions, i)
+	 end
+      end
+   end
+
+   local function show_suggestions(cache, verbose)
+      add_to_reportview 'Suggestions:'
+      add_to_reportview()
+      add_to_reportview()
+      local format = '  %-24s %-24s %-24s'
+      add_to_reportview('CATEGORY / PACKAGE [-- STATE]')
+      add_to_reportview()
+      add_to_reportview(format:format('SONAME','GUESS','STEM'))
+      add_to_reportview()
+      add_to_reportview('  '..('-'):rep(54))
+      add_to_reportview()
+      local suggestions = tagset.manifest:get_suggestions(cache)
+      for _, suggestion in ipairs(suggestions) do
+	 local tuple = tagset.tags[suggestion[1]]
+	 if verbose or tuple.state ~= 'ADD' then
+	    add_to_reportview()
+	    add_to_reportview(tuple.category..' / '..suggestion[1])
+	    if tuple.state ~= 'ADD' then
+	       add_to_reportview(' -- '..tuple.state)
+	    end
+	    add_to_reportview()
+	    for _, lib in ipairs(suggestion[2]) do
+	       add_to_reportview(format:format(lib[1],lib[2],lib[3]))
+	       add_to_reportview()
+	    end
+	 end
+      end
+   end
+
+   -- Called while waiting for keys.  Once the manifest is read, its
+   -- suggestions go to the report view if that's still up.
+   local function check_manifest()
+      if not pending_manifest or not pending_manifest.manifest:ready() then
+	 return
+      end
+      local pending = pending_manifest
+      pending_manifest = nil
+      tagset.manifest = pending.manifest
+      set_timeout()
+      if reportview_lines then
+	 add_to_reportview 'Done!'
+	 add_to_reportview()
+	 add_to_reportview()
+	 show_suggestions(pending.cache, pending.verbose)
+	 l.doupdate()
+      end
+   end
+
+   -- Complaints from following the package tree go to the report
+   -- view, after whatever it's showing already.
+   local function show_messages(messages)
+      if reportview_lines then
+	 add_to_reportview()
+      else
+	 activate_reportview()
+      end
+      for _, message in ipairs(messages) do
+	 add_to_reportview(message)
+	 add_to_reportview()
+      end
+   end
+
    local function command_loop()
       repaint()
       -- If a timeout isn't given at first, then SIGINT isn't
       -- handled correctly.
-      l.timeout(100000)
+      set_timeout()
       while true do
 	 ::continue::
 	 l.doupdate()
@@ -710,6 +792,12 @@ function _G.edit_tagset(tagset, installation)
 	 while true do
 	    key, suffix = l.getch()
 	    if key >= 0 then break end
+	    local changed, messages = tagset:refresh()
+	    if changed then repaint() end
+	    if messages then show_messages(messages) end
+	    if changed or messages then l.doupdate() end
+	    check_manifest()
+	    check_descriptions()
 	    util.usleep(1000)
 	 end
 	 if key == k.resize then
@@ -855,6 +943,17 @@ function _G.edit_tagset(tagset, installation)
 		  pkg.description.text =
 		     make_package_description(tagset, pkg.tag,
 					      pkg.description.file)
+		  -- Do the rest of the list in the background, so paging
+		  -- through descriptions doesn't stall on each one.
+		  local taglist = {}
+		  for _, tuple in ipairs(package_list) do
+		     table.insert(taglist, tuple.tag)
+		  end
+		  local fill = tagset:prefetch_metadata_later(taglist)
+		  if fill then
+		     table.insert(pending_descriptions, fill)
+		     set_timeout()
+		  end
 	       end
 	       show_description(pkg.description.text)
 	       repaint()
@@ -984,15 +1083,22 @@ function _G.edit_tagset(tagset, installation)
 	       if tagset.directory then
 		  add_to_reportview()
 		  add_to_reportview()
-		  if not tagset.manifest then
+		  if pending_manifest then
+		     add_to_reportview 'Still reading the manifest...'
+		     add_to_reportview()
+		     pending_manifest.cache = cache
+		     pending_manifest.verbose = char == 'M-^N'
+		  elseif not tagset.manifest then
 		     if confirm('Read manifest for suggestions? (Y/n): ',
 				'[YyNn\n\4]', 'y') == 'y' then
+			-- Suggestions follow once it's read; meanwhile
+			-- the editor carries on.
 			add_to_reportview 'Reading manifest...'
-			l.doupdate()
-			tagset.manifest = read_manifest(tagset.directory)
-			add_to_reportview 'Done!'
-			add_to_reportview()
 			add_to_reportview()
+			pending_manifest = {
+			   manifest = read_manifest(tagset.directory, true),
+			   cache = cache, verbose = char == 'M-^N' }
+			set_timeout()
 		     else
 			add_to_reportview 'Skipping suggestions'
 			l.doupdate()
@@ -1000,37 +1106,8 @@ function _G.edit_tagset(tagset, installation)
 			deactivate_reportview()
 			repaint()
 		     end
-		  end
-		  if tagset.manifest then
-		     add_to_reportview 'Suggestions:'
-		     add_to_reportview()
-		     add_to_reportview()
-		     local format = '  %-24s %-24s %-24s'
-		     add_to_reportview('CATEGORY / PACKAGE [-- STATE]')
-		     add_to_reportview()		     
-		     add_to_reportview(format:format('SONAME','GUESS','STEM'))
-		     add_to_reportview()
-		     add_to_reportview('  '..('-'):rep(54))
-		     add_to_reportview()
-		     local suggestions = tagset.manifest:get_suggestions(cache)
-		     for _, suggestion in ipairs(suggestions) do
-			local tuple = tagset.tags[suggestion[1]]
-			if char == 'M-^N' or tuple.state ~= 'ADD' then
-			   add_to_reportview()
-			   add_to_reportview(tuple.category..' / '..
-						suggestion[1])
-			   if tuple.state ~= 'ADD' then
-			      add_to_reportview(' -- '..tuple.state)
-			   end
-			   add_to_reportview()
-			   for _, lib in ipairs(suggestion[2]) do
-			      local outstr =
-				 format:format(lib[1],lib[2],lib[3])
-			      add_to_reportview(outstr)
-			      add_to_reportview()
-			   end
-			end
-		     end
+		  else
+		     show_suggestions(cache, char == 'M-^N')
 		  end
 	       end
 	    end
@@ -1038,6 +1115,9 @@ function _G.edit_tagset(tagset, installation)
       end
    end
 
+   -- Follow the package tree while editing, unless already asked to.
+   local watched = tagset:watching()
+   if not watched then tagset:watch() end
    l.init_curses()
    l.start_color()
    l.curs_set(0)
@@ -1064,6 +1144,7 @@ function _G.edit_tagset(tagset, installation)
    l.attron(colors.main)
    l.refresh()
    local result={pcall(command_loop)}
+   if not watched then tagset:watch(true) end
    l.endwin()
    clear_constraint()
    if not result[1] and not result[2]:match ': interrupted!$' then
@@ -1073,8 +1154,5 @@ function _G.edit_tagset(tagset, installation)
       last_package = package_list[package_cursor]
    end
    tagset.last_package = last_package
-   if tagset.package_cache then
-      tagset.package_cache:cleanup()
-   end
    print 'Editor finished'
 end
@@ -1,3 +1,6 @@
+// Needed for strnlen() and friends.
+#define _POSIX_C_SOURCE 200809L
+
 #include "lua_head.h"
 #include <fcntl.h>
 #include <string.h>
@@ -5,22 +8,41 @@
 #include <stdlib.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/syscall.h>
+#include <linux/stat.h>
 #include <dirent.h>
-#include <gelf.h>
+#include <elf.h>
 #include <errno.h>
-#include <alloca.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <stdint.h>
+#include <limits.h>
+#include <stdio.h>
+#include "unpack.h"
+#include "pool.h"
 
 char *realpath(const char *path, char *resolved_path);
+long syscall(long number, ...);
 
-#define PT_INTERP       3
-#define SHT_DYNAMIC     6
+// The machine filter lives in the registry, so it belongs to the Lua
+// state rather than the process, and scans on worker threads get a
+// copy of it.
+#define MACHINE_KEY "elfutil.machine"
 
-static int architecture = 0;
+static int get_machine(lua_State *L)
+{
+    lua_getfield(L, LUA_REGISTRYINDEX, MACHINE_KEY);
+    int machine = lua_tointeger(L, -1);
+    lua_pop(L, 1);
+    return machine;
+}
 
 LUAFN(filter_on_machine)
 {
     if (lua_isnoneornil(L,1)) {
-	architecture = 0;
+	lua_pushnil(L);
+	lua_setfield(L, LUA_REGISTRYINDEX, MACHINE_KEY);
 	return 0;
     }
     int newarch = luaL_checkinteger(L, 1);
@@ -28,357 +50,4121 @@ LUAFN(filter_on_machine)
 	lua_pushstring(L, "Invalid architecture!");
 	lua_error(L);
     }
-    architecture = newarch;
+    lua_pushinteger(L, newarch);
+    lua_setfield(L, LUA_REGISTRYINDEX, MACHINE_KEY);
     return 0;
 }
 
-static int read_at(int fd, char *buffer, size_t len, size_t where)
+/* What a scan learns about an ELF object.  The strings are copied into
+ * a pool owned by the record, so the image can be released before the
+ * Lua table is built, and scans may run away from the Lua state.
+ */
+typedef struct {
+    int status;			// 1: ELF of interest, 0: not, -1: error
+    const char *errmsg;
+    int errnum;
+    int class, machine, type;
+    // Offsets into pool, or -1 if absent.
+    long interp, soname, rpath, runpath;
+    long *needed;
+    int needed_count, needed_size;
+    // Pairs of file and version required of it.
+    long *verneed;
+    int verneed_count, verneed_size;
+    // Versions defined, less the object's own name.
+    long *verdef;
+    int verdef_count, verdef_size;
+    char *pool;
+    size_t pool_used, pool_size;
+} elf_info;
+
+static void info_init(elf_info *info)
 {
-    size_t old = lseek(fd, SEEK_CUR, 0);
-    if (old == -1 ||
- 	lseek(fd, where, SEEK_SET) == -1 ||
-	read(fd, buffer, len) == -1 ||
-	lseek(fd, old, SEEK_SET) == -1)
-	return -1;
-    return 0;
+    memset(info, 0, sizeof(*info));
+    info->interp = info->soname = info->rpath = info->runpath = -1;
 }
 
-/* Note: since this function will get randoms from find, silently
- * return nil for non-elfs and wrong size/architecture.
- */
-LUAFN(scan_elf)
+static void info_free(elf_info *info)
 {
-    const char *filename = luaL_checkstring(L, 1);
-    int fd = -1;
-    Elf *handle = NULL;
-    const char *errmsg = NULL;
-    GElf_Ehdr ehdr;
-    int return_items = 0;
+    free(info->needed);
+    free(info->verneed);
+    free(info->verdef);
+    free(info->pool);
+    info_init(info);
+}
 
-    if (elf_version(EV_CURRENT) == EV_NONE)
-	goto bugout;
+// Copy a string of at most len bytes into the pool.  Returns its
+// offset, or -1 if memory ran out.
+static long info_string(elf_info *info, const char *string, size_t len)
+{
+    len = strnlen(string, len);
+    if (info->pool_used + len + 1 > info->pool_size) {
+	size_t newsize = 2 * info->pool_size + len + 256;
+	char *newpool = realloc(info->pool, newsize);
+	if (!newpool)
+	    return -1;
+	info->pool = newpool;
+	info->pool_size = newsize;
+    }
+    long offset = info->pool_used;
+    memcpy(info->pool + offset, string, len);
+    info->pool[offset + len] = 0;
+    info->pool_used += len + 1;
+    return offset;
+}
 
-    if ((fd = open(filename, O_RDONLY)) < 0) {
-	errmsg = strerror(errno);
-	goto bugout;
+// Pool the string at offset in a string table, refusing to run off
+// its end.
+static long info_strtab(elf_info *info, const char *strtab, size_t len,
+			size_t offset)
+{
+    if (offset >= len)
+	return info_string(info, "", 0);
+    return info_string(info, strtab + offset, len - offset);
+}
+
+/* The ELF image being described.  Fields are read in the object's own
+ * byte order and width, so any ELF can be described on any host.
+ */
+typedef struct {
+    const unsigned char *image;
+    size_t size;
+    int big, wide;		// Big endian, and 64 bit.
+} elf_image;
+
+// Whether len bytes at where are within the image.
+static int elf_has(const elf_image *elf, uint64_t where, uint64_t len)
+{
+    return where <= elf->size && len <= elf->size - where;
+}
+
+// Read an unsigned field of bytes at where, which must be in the image.
+static uint64_t elf_get(const elf_image *elf, uint64_t where, int bytes)
+{
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; i++) {
+	int shift = 8 * (elf->big ? bytes - 1 - i : i);
+	value |= (uint64_t)elf->image[where + i] << shift;
     }
+    return value;
+}
 
-    if ((handle = elf_begin(fd, ELF_C_READ, NULL)) == NULL)
-	goto bugout;
+// An address or offset, whose size follows the class.
+static uint64_t elf_word(const elf_image *elf, uint64_t where)
+{
+    return elf_get(elf, where, elf->wide ? 8 : 4);
+}
 
-    if (elf_kind(handle) != ELF_K_ELF)
-	goto done;
+typedef struct {
+    uint64_t offset, count, size;
+} elf_table;
 
-    lua_newtable(L);
-    lua_pushstring(L, "class");
-    switch (gelf_getclass(handle)) {
+// Find the class and byte order of an image starting with ELFMAG.
+// Returns NULL, or what's wrong.
+static const char *elf_identify(elf_image *elf)
+{
+    switch (elf->image[EI_CLASS]) {
     case ELFCLASS32:
-	lua_pushinteger(L, 32);
 	break;
     case ELFCLASS64:
-	lua_pushinteger(L, 64);
+	elf->wide = 1;
 	break;
     default:
-	errmsg = "Unknown ELF class";
-	goto bugout;
+	return "Unknown ELF class";
     }
-    lua_rawset(L, -3);
+    switch (elf->image[EI_DATA]) {
+    case ELFDATA2LSB:
+	break;
+    case ELFDATA2MSB:
+	elf->big = 1;
+	break;
+    default:
+	return "Unknown ELF byte order";
+    }
+    if (!elf_has(elf, 0, elf->wide ? 64 : 52))
+	return "Truncated ELF";
+    return NULL;
+}
+
+// Find the program header table.  Returns NULL, or what's wrong.
+static const char *elf_program_headers(const elf_image *elf,
+				       elf_table *phdrs)
+{
+    phdrs->offset = elf_word(elf, elf->wide ? 32 : 28);
+    phdrs->size = elf_get(elf, elf->wide ? 54 : 42, 2);
+    phdrs->count = elf_get(elf, elf->wide ? 56 : 44, 2);
+    if (phdrs->count == PN_XNUM) {
+	// The real count is in the first section header's sh_info.
+	uint64_t shoff = elf_word(elf, elf->wide ? 40 : 32);
+	uint64_t info_at = shoff + (elf->wide ? 44 : 28);
+	if (!elf_has(elf, info_at, 4))
+	    return "Truncated ELF";
+	phdrs->count = elf_get(elf, info_at, 4);
+    }
+    if (phdrs->size < (elf->wide ? 56 : 32) ||
+	phdrs->count > elf->size / phdrs->size ||
+	!elf_has(elf, phdrs->offset, phdrs->count * phdrs->size))
+	return "Truncated ELF";
+    return NULL;
+}
+
+// Translate a virtual address to a file offset through the PT_LOAD
+// segments, or return ~0 if no segment holds it.
+static uint64_t elf_offset(const elf_image *elf, const elf_table *phdrs,
+			   uint64_t vaddr)
+{
+    for (uint64_t i = 0; i < phdrs->count; i++) {
+	uint64_t phdr = phdrs->offset + i * phdrs->size;
+	if (elf_get(elf, phdr, 4) != PT_LOAD)
+	    continue;
+	uint64_t offset = elf_word(elf, phdr + (elf->wide ? 8 : 4));
+	uint64_t start = elf_word(elf, phdr + (elf->wide ? 16 : 8));
+	uint64_t filesz = elf_word(elf, phdr + (elf->wide ? 32 : 16));
+	if (vaddr >= start && vaddr - start < filesz)
+	    return offset + (vaddr - start);
+    }
+    return ~(uint64_t)0;
+}
+
+static int info_add(long **array, int *count, int *size, long value)
+{
+    if (*count == *size) {
+	int newsize = 2 * *size + 8;
+	long *newarray = realloc(*array, newsize * sizeof(long));
+	if (!newarray)
+	    return -1;
+	*array = newarray;
+	*size = newsize;
+    }
+    (*array)[(*count)++] = value;
+    return 0;
+}
+
+// What the dynamic section says, as file offsets where that applies.
+typedef struct {
+    uint64_t strtab, strsz;
+    uint64_t verneed, verneednum, verdef, verdefnum;
+    int has_strtab;
+} elf_dynamic;
+
+// Version requirements: for each file, the versions wanted of it.
+static int scan_verneed(const elf_image *elf, const elf_dynamic *dyn,
+			const char *strtab, elf_info *info)
+{
+    uint64_t entry = dyn->verneed;
+
+    for (uint64_t i = 0; i < dyn->verneednum && i < 4096; i++) {
+	if (!elf_has(elf, entry, 16))
+	    return 1;
+	uint64_t count = elf_get(elf, entry + 2, 2);
+	long file = info_strtab(info, strtab, dyn->strsz,
+				elf_get(elf, entry + 4, 4));
+	if (file < 0)
+	    return -1;
+	uint64_t aux = entry + elf_get(elf, entry + 8, 4);
+	for (uint64_t j = 0; j < count; j++) {
+	    if (!elf_has(elf, aux, 16))
+		return 1;
+	    long name = info_strtab(info, strtab, dyn->strsz,
+				    elf_get(elf, aux + 8, 4));
+	    if (name < 0 ||
+		info_add(&info->verneed, &info->verneed_count,
+			 &info->verneed_size, file) ||
+		info_add(&info->verneed, &info->verneed_count,
+			 &info->verneed_size, name))
+		return -1;
+	    uint64_t next = elf_get(elf, aux + 12, 4);
+	    if (!next)
+		break;
+	    aux += next;
+	}
+	uint64_t next = elf_get(elf, entry + 12, 4);
+	if (!next)
+	    break;
+	entry += next;
+    }
+    return 0;
+}
+
+// Versions defined.  The base definition is the object's own name.
+static int scan_verdef(const elf_image *elf, const elf_dynamic *dyn,
+		       const char *strtab, elf_info *info)
+{
+    uint64_t entry = dyn->verdef;
+
+    for (uint64_t i = 0; i < dyn->verdefnum && i < 4096; i++) {
+	if (!elf_has(elf, entry, 20))
+	    return 1;
+	uint64_t aux = entry + elf_get(elf, entry + 12, 4);
+	if (!(elf_get(elf, entry + 2, 2) & VER_FLG_BASE) &&
+	    elf_get(elf, entry + 6, 2) > 0) {
+	    if (!elf_has(elf, aux, 8))
+		return 1;
+	    long name = info_strtab(info, strtab, dyn->strsz,
+				    elf_get(elf, aux, 4));
+	    if (name < 0 ||
+		info_add(&info->verdef, &info->verdef_count,
+			 &info->verdef_size, name))
+		return -1;
+	}
+	uint64_t next = elf_get(elf, entry + 16, 4);
+	if (!next)
+	    break;
+	entry += next;
+    }
+    return 0;
+}
+
+/* Describe the ELF object held in image.  This touches neither the Lua
+ * state nor any globals, so may run on any thread.  Unless the
+ * machine is zero, objects for other machines are not of interest.
+ *
+ * Only the ELF header and program headers are read.  Strings are found
+ * through DT_STRTAB, so objects stripped of their section headers are
+ * described as well as any.
+ */
+static void scan_image(const char *image, size_t size, int machine,
+		       elf_info *info)
+{
+    elf_image elf = { (const unsigned char *)image, size, 0, 0 };
 
-    if (gelf_getehdr(handle, &ehdr) == NULL)
+    info_init(info);
+    if (size < EI_NIDENT || memcmp(image, ELFMAG, SELFMAG))
+	return;
+
+    if ((info->errmsg = elf_identify(&elf)))
 	goto bugout;
+    info->class = elf.wide ? 64 : 32;
 
     // The caller specified an architecture, but we don't match,
     // then skip this.
-    if (architecture && ehdr.e_machine != architecture)
-	goto done;
-    
-    lua_pushstring(L, "machine");
-    lua_pushinteger(L, ehdr.e_machine);
-    lua_rawset(L, -3);    
-
-    lua_pushstring(L, "type");
-    switch (ehdr.e_type) {
-    case 2:
-	lua_pushstring(L, "executable");
-	break;
-    case 3:
-	lua_pushstring(L, "shared library");
+    int e_machine = elf_get(&elf, 18, 2);
+    if (machine && e_machine != machine)
+	goto skip;
+    info->machine = e_machine;
+
+    int e_type = elf_get(&elf, 16, 2);
+    switch (e_type) {
+    case ET_EXEC:
+    case ET_DYN:
+	info->type = e_type;
 	break;
     default:
-	errmsg = "Unexpected elf type";
+	info->errmsg = "Unexpected elf type";
 	goto bugout;
     }
-    lua_rawset(L, -3);
 
-    // Find the interpreter (loader)
-    size_t n;
-    if (elf_getphdrnum(handle, &n))
+    elf_table phdrs;
+    if ((info->errmsg = elf_program_headers(&elf, &phdrs)))
 	goto bugout;
 
-    GElf_Phdr phdr;
-    for (size_t i=0; i < n; i++) {
-	if (gelf_getphdr(handle, i, &phdr) != &phdr)
-	    goto bugout;
-	if (phdr.p_type == PT_INTERP) {
-	    char *tempbuf = alloca(phdr.p_filesz);
-	    if (read_at(fd, tempbuf, phdr.p_filesz, phdr.p_offset)) {
-		errmsg = strerror(errno);
-		goto bugout;
-	    }
-	    lua_pushstring(L, "interp");
-	    lua_pushstring(L, tempbuf);
-	    lua_rawset(L, -3);
-	    break;
+    // Find the interpreter (loader) and the dynamic section.
+    uint64_t dynamic = 0, dynamic_size = 0;
+    int has_dynamic = 0;
+    for (uint64_t i = 0; i < phdrs.count; i++) {
+	uint64_t phdr = phdrs.offset + i * phdrs.size;
+	uint32_t type = elf_get(&elf, phdr, 4);
+	uint64_t offset = elf_word(&elf, phdr + (elf.wide ? 8 : 4));
+	uint64_t filesz = elf_word(&elf, phdr + (elf.wide ? 32 : 16));
+	if (type == PT_INTERP && info->interp < 0) {
+	    if (!elf_has(&elf, offset, filesz))
+		goto truncated;
+	    if ((info->interp =
+		 info_string(info, image + offset, filesz)) < 0)
+		goto nomem;
+	} else if (type == PT_DYNAMIC && !has_dynamic) {
+	    if (!elf_has(&elf, offset, filesz))
+		goto truncated;
+	    dynamic = offset;
+	    dynamic_size = filesz;
+	    has_dynamic = 1;
 	}
     }
+    // No dynamic section?  No worries.
+    if (!has_dynamic)
+	goto skip;
 
-    size_t shstrndx;
-    
-    if (elf_getshdrstrndx(handle, &shstrndx))
-	goto bugout;
-
-    char *name;
-    Elf_Scn *scn = NULL;
-    char *strtab = NULL;
-    Elf_Data *edata = NULL;
-    int strtablen;
-    while ((scn = elf_nextscn(handle, scn)) != NULL) {
-	static GElf_Shdr shdr;
-	if (gelf_getshdr(scn, &shdr) != &shdr)
-	    goto bugout;
-	if (shdr.sh_type == SHT_STRTAB) {
-	    if (!(name = elf_strptr(handle, shstrndx, shdr.sh_name )))
-		goto bugout;
-	    if (strcmp(name, ".dynstr"))
-		continue;
-	    strtab = alloca(shdr.sh_size);
-	    read_at(fd, strtab, strtablen = shdr.sh_size, shdr.sh_offset);
-	}
-	if (shdr.sh_type == SHT_DYNAMIC) {
-	    if (!(name = elf_strptr(handle, shstrndx, shdr.sh_name )))
-		goto bugout;
-	    if (strcmp(name, ".dynamic"))
-		continue;
-	    if (!(edata = elf_getdata(scn, NULL)))
-		goto bugout;
+    // First find the string table, since entries may come before it.
+    size_t dyn_size = elf.wide ? 16 : 8;
+    uint64_t dyn_count = dynamic_size / dyn_size;
+    elf_dynamic dyn = { 0 };
+    for (uint64_t i = 0; i < dyn_count; i++) {
+	uint64_t entry = dynamic + i * dyn_size;
+	uint64_t tag = elf_word(&elf, entry);
+	uint64_t value = elf_word(&elf, entry + dyn_size / 2);
+	if (tag == DT_NULL)
+	    break;
+	switch (tag) {
+	case DT_STRTAB:
+	    dyn.strtab = elf_offset(&elf, &phdrs, value);
+	    dyn.has_strtab = 1;
+	    break;
+	case DT_STRSZ:
+	    dyn.strsz = value;
+	    break;
+	case DT_VERNEED:
+	    dyn.verneed = elf_offset(&elf, &phdrs, value);
+	    break;
+	case DT_VERNEEDNUM:
+	    dyn.verneednum = value;
+	    break;
+	case DT_VERDEF:
+	    dyn.verdef = elf_offset(&elf, &phdrs, value);
+	    break;
+	case DT_VERDEFNUM:
+	    dyn.verdefnum = value;
+	    break;
 	}
     }
-    // No dynamic section?  No worries.
-    if (!edata)
-	goto done;
-    GElf_Dyn gdyn;
-    lua_pushstring(L, "needed");
-    lua_newtable(L);
-    int libnum = 1;
-    for (int i = 0; gelf_getdyn(edata, i, &gdyn) == &gdyn; i++) {
-	switch(gdyn.d_tag) {
+    if (!dyn.has_strtab)
+	goto skip;
+    if (!elf_has(&elf, dyn.strtab, dyn.strsz))
+	goto truncated;
+    const char *strtab = image + dyn.strtab;
+
+    for (uint64_t i = 0; i < dyn_count; i++) {
+	uint64_t entry = dynamic + i * dyn_size;
+	uint64_t tag = elf_word(&elf, entry);
+	uint64_t value = elf_word(&elf, entry + dyn_size / 2);
+	long *field;
+	if (tag == DT_NULL)
+	    break;
+	switch (tag) {
 	case DT_NEEDED:
-	    lua_pushstring(L, strtab + gdyn.d_un.d_val);
-	    // STACK: dt_value needed_table "needed" elf_table
-	    lua_rawseti(L, -2, libnum++);
-	    continue;
+	    if (info->needed_count == info->needed_size) {
+		int newsize = 2 * info->needed_size + 8;
+		long *newneeded =
+		    realloc(info->needed, newsize * sizeof(long));
+		if (!newneeded)
+		    goto nomem;
+		info->needed = newneeded;
+		info->needed_size = newsize;
+	    }
+	    field = &info->needed[info->needed_count++];
+	    break;
 	case DT_SONAME:
-	    lua_pushstring(L, "soname");
-	    lua_pushstring(L, strtab + gdyn.d_un.d_val);
-	    // STACK: dt_value dt_name needed_table "needed" elf_table
-	    lua_rawset(L, -5);
-	    continue;
+	    field = &info->soname;
+	    break;
 	case DT_RPATH:
-	    lua_pushstring(L, "rpath");
+	    field = &info->rpath;
 	    break;
 	case DT_RUNPATH:
-	    lua_pushstring(L, "runpath");
+	    field = &info->runpath;
 	    break;
 	default:
 	    continue;
 	}
-	lua_newtable(L);
-	char *pathptr = strtab + gdyn.d_un.d_val;
-	char *next;
-	int i;  // Shadows loopvar.
-	for (i = 1;
-	     next = strchr(pathptr, ':');
-	     i++, pathptr = next+1) {
-	    lua_pushlstring(L, pathptr, next - pathptr);
-	    lua_rawseti(L, -2, i);
-	} 
-	lua_pushstring(L, pathptr);
-	lua_rawseti(L, -2, i);
-
-	lua_rawset(L, -5);
+	if ((*field = info_strtab(info, strtab, dyn.strsz, value)) < 0)
+	    goto nomem;
     }
-    lua_rawset(L, -3);
-    return_items = 1;
-    
-done:
-    elf_end(handle);
-    close(fd);
-    return return_items;
 
+    // Version tables that can't be read are left out, not fatal.
+    if (dyn.verneednum && scan_verneed(&elf, &dyn, strtab, info) < 0)
+	goto nomem;
+    if (dyn.verdefnum && scan_verdef(&elf, &dyn, strtab, info) < 0)
+	goto nomem;
+    info->status = 1;
+    return;
+
+skip:
+    info_free(info);
+    return;
+
+truncated:
+    info->errmsg = "Truncated ELF";
+    goto bugout;
+nomem:
+    info->errnum = ENOMEM;
 bugout:
-    if (!errmsg)
-	errmsg = elf_errmsg(-1);
-    if (handle)
-	elf_end(handle);
-    if (fd >= 0)
+    ;
+    const char *errmsg = info->errmsg;
+    int errnum = info->errnum;
+    info_free(info);
+    info->status = -1;
+    info->errmsg = errmsg;
+    info->errnum = errnum;
+}
+
+// Scan the file at path.  Like scan_image, this is thread safe.
+static void scan_file(const char *path, int machine, elf_info *info)
+{
+    struct stat statb;
+    void *map;
+    int fd;
+
+    info_init(info);
+    if ((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &statb)) {
+	info->errnum = errno;
+	info->status = -1;
+	if (fd >= 0)
+	    close(fd);
+	return;
+    }
+    // Empty files and the like can't be ELF.
+    if (!S_ISREG(statb.st_mode) || statb.st_size < SELFMAG) {
 	close(fd);
-    lua_pushnil(L);
-    lua_pushstring(L, errmsg);
-    return 2;
+	return;
+    }
+    map = mmap(NULL, statb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+	info->errnum = errno;
+	info->status = -1;
+	return;
+    }
+    scan_image(map, statb.st_size, machine, info);
+    munmap(map, statb.st_size);
 }
 
-#define DT_REG 8
-#define DT_LNK 10
+static const char *info_error(elf_info *info)
+{
+    return info->errnum ? strerror(info->errnum) : info->errmsg;
+}
 
-static void inode_in_table(lua_State *L, int dev, int inode)
+// Push a DT_RPATH/DT_RUNPATH as a table of its directories.
+static void push_path_list(lua_State *L, const char *pathptr)
 {
-    char buf[128];
-    sprintf(buf, "%d,%d", dev, inode);
+    const char *next;
+    int i;
+
     lua_newtable(L);
-    lua_pushstring(L, buf);
-    lua_rawseti(L, -2, 1);
-    return;
+    for (i = 1; next = strchr(pathptr, ':'); i++, pathptr = next+1) {
+	lua_pushlstring(L, pathptr, next - pathptr);
+	lua_rawseti(L, -2, i);
+    }
+    lua_pushstring(L, pathptr);
+    lua_rawseti(L, -2, i);
 }
 
-// candidate_table, prefix
-LUAFN(get_candidates)
+// Add version to the list for file in the verneed table on top.
+static void push_version(lua_State *L, const char *file,
+			 const char *version)
 {
-    char *curdir = NULL;
-
-    if (lua_isnoneornil(L, 1) ||
-	!(curdir = getcwd(NULL, 0)) ||
-	chdir(lua_toboolean(L, 2) ? luaL_checkstring(L, 2) : "/") == -1) {
-	free(curdir);
+    lua_getfield(L, -1, file);
+    if (lua_isnil(L, -1)) {
+	lua_pop(L, 1);
 	lua_newtable(L);
-	return 1;
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -3, file);
     }
+    lua_pushstring(L, version);
+    lua_rawseti(L, -2, lua_objlen(L, -2) + 1);
+    lua_pop(L, 1);
+}
 
-    // Single value becomes a one-entry table.
-    if (lua_istable(L, 1))
-	lua_pushvalue(L,1);
-    else {
+// Push the table for a successful scan.
+static void push_info(lua_State *L, elf_info *info)
+{
+    lua_newtable(L);
+    AT_NAME_PUT_INT(class, info->class);
+    AT_NAME_PUT_INT(machine, info->machine);
+    AT_NAME_PUT(type, info->type == 2 ? "executable" : "shared library",
+		string);
+    if (info->interp >= 0) {
+	AT_NAME_PUT(interp, info->pool + info->interp, string);
+    }
+    if (info->soname >= 0) {
+	AT_NAME_PUT(soname, info->pool + info->soname, string);
+    }
+    lua_pushstring(L, "needed");
+    lua_newtable(L);
+    for (int i = 0; i < info->needed_count; i++) {
+	lua_pushstring(L, info->pool + info->needed[i]);
+	lua_rawseti(L, -2, i + 1);
+    }
+    lua_rawset(L, -3);
+    if (info->rpath >= 0) {
+	lua_pushstring(L, "rpath");
+	push_path_list(L, info->pool + info->rpath);
+	lua_rawset(L, -3);
+    }
+    if (info->runpath >= 0) {
+	lua_pushstring(L, "runpath");
+	push_path_list(L, info->pool + info->runpath);
+	lua_rawset(L, -3);
+    }
+    // verneed maps each file to the versions wanted of it.
+    if (info->verneed_count) {
 	lua_newtable(L);
-	lua_pushvalue(L,1);
-	lua_rawseti(L,-2,1);
+	for (int i = 0; i < info->verneed_count; i += 2) {
+	    push_version(L, info->pool + info->verneed[i],
+			 info->pool + info->verneed[i + 1]);
+	}
+	lua_setfield(L, -2, "verneed");
     }
+    if (info->verdef_count) {
+	lua_newtable(L);
+	for (int i = 0; i < info->verdef_count; i++) {
+	    lua_pushstring(L, info->pool + info->verdef[i]);
+	    lua_rawseti(L, -2, i + 1);
+	}
+	lua_setfield(L, -2, "verdef");
+    }
+}
 
-    // Stat results go here.
-    lua_newtable(L);
-	
-    lua_pushnil(L);
-    int place = 1;
-    while (lua_next(L, -3)) {
-	struct stat statb;
-	const char *name = lua_tostring(L, -1);
+// Push the results of a single scan in the manner of scan_elf, and
+// release them.  Returns the count of values pushed.
+static int push_result(lua_State *L, elf_info *info)
+{
+    int results = 0;
 
-	if (*name != '/' || stat(&name[1], &statb) == -1)
-	    goto done;
+    if (info->status > 0) {
+	push_info(L, info);
+	results = 1;
+    } else if (info->status < 0) {
+	lua_pushnil(L);
+	lua_pushstring(L, info_error(info));
+	results = 2;
+    }
+    info_free(info);
+    return results;
+}
 
-	if (S_ISREG(statb.st_mode)) {
-	    inode_in_table(L, statb.st_dev, statb.st_ino);
-	    lua_pushstring(L, name);
-	    lua_rawseti(L, -2, 2);
-	    lua_rawseti(L, -4, place++);
-	    goto done;
-	}
-	
-	if (S_ISDIR(statb.st_mode)) {
-	    DIR *dirp;
-	    char *olddir = getcwd(NULL, 0);
-	    if (chdir(&name[1]) == 0 && (dirp = opendir("."))) {
-		struct dirent *dent;
-		while (dent = readdir(dirp)) {
-		    // Exclude some obviously wrong files.
-		    if (dent->d_type != DT_REG && dent->d_type != DT_LNK)
-			continue;
-		    char *ext=strrchr(dent->d_name, '.');
-		    if (ext && (!strcmp(ext, ".a") || !strcmp(ext, ".la")))
-			continue;
-		    if (stat(dent->d_name, &statb) == -1 ||
-			!S_ISREG(statb.st_mode))
-			continue;
-		    inode_in_table(L, statb.st_dev, statb.st_ino);
-		    lua_pushfstring(L, "%s/%s", name, dent->d_name);
-		    lua_rawseti(L, -2, 2);
-		    lua_rawseti(L, -4, place++);
-		}
-		closedir(dirp);
-	    }
-	    if (olddir)
-		chdir(olddir);
-	    free(olddir);
-	}
+/* Note: since this function will get randoms from find, silently
+ * return nil for non-elfs and wrong size/architecture.
+ */
+LUAFN(scan_elf)
+{
+    const char *filename = luaL_checkstring(L, 1);
+    elf_info info;
 
-    done:
-	lua_pop(L, 1);
+    scan_file(filename, get_machine(L), &info);
+    return push_result(L, &info);
+}
+
+// Scan an ELF object already in memory: either a string, or a light
+// userdata pointer and a length.  Like scan_elf, this returns nothing
+// for objects not of interest.
+LUAFN(scan_elf_buffer)
+{
+    const char *image;
+    size_t size;
+    elf_info info;
+
+    if (lua_islightuserdata(L, 1)) {
+	image = lua_touserdata(L, 1);
+	size = luaL_checkinteger(L, 2);
+    } else {
+	image = luaL_checklstring(L, 1, &size);
+	size_t len = luaL_optinteger(L, 2, size);
+	luaL_argcheck(L, len <= size, 2, "length exceeds string");
+	size = len;
     }
-    
-    chdir(curdir);
-    free(curdir);
-    return 1;
-	
+
+    scan_image(image, size, get_machine(L), &info);
+    return push_result(L, &info);
 }
 
-// Look through a table of synonyms for a given file and yield the directories
-// for which the synonym with an absolute path is a hardlink.
-LUAFN(get_origins)
+struct scan_batch {
+    const char **paths;
+    elf_info *infos;
+    int machine;
+};
+
+static void scan_batch_item(void *context, size_t index)
 {
-    char *curdir = NULL;
-    if (!(curdir = getcwd(NULL, 0)) ||
-	chdir(lua_toboolean(L, 2) ? luaL_checkstring(L, 2) : "/") == -1) {
-	free(curdir);
-	lua_newtable(L);
-	return 1;
+    struct scan_batch *batch = context;
+
+    scan_file(batch->paths[index], batch->machine, &batch->infos[index]);
+}
+
+/* Scan a table of paths on worker threads.  Returns a table holding,
+ * for each path, its scan_elf style table or false, and a table of
+ * error messages for those paths that couldn't be scanned.
+ * Options: threads (defaults to one per CPU).
+ */
+LUAFN(scan_many)
+{
+    luaL_checktype(L, 1, LUA_TTABLE);
+    int threads = 0;
+    if (lua_istable(L, 2)) {
+	lua_getfield(L, 2, "threads");
+	threads = lua_tointeger(L, -1);
+	lua_pop(L, 1);
     }
-    lua_newtable(L);
-    lua_pushnil(L);
-    while (lua_next(L, 1)) {
-	struct stat statb;
-	const char *filename = lua_tostring(L, -2);
+    size_t count = lua_objlen(L, 1);
+    struct scan_batch batch = { .machine = get_machine(L) };
+
+    // The path strings stay anchored by the argument table.
+    batch.paths = malloc((count + 1) * sizeof(char *));
+    batch.infos = malloc((count + 1) * sizeof(elf_info));
+    if (!batch.paths || !batch.infos) {
+	free(batch.paths);
+	free(batch.infos);
+	lua_pushnil(L);
+	lua_pushstring(L, strerror(ENOMEM));
+	return 2;
+    }
+    for (size_t i = 0; i < count; i++) {
+	lua_rawgeti(L, 1, i + 1);
+	batch.paths[i] = lua_tostring(L, -1);
 	lua_pop(L, 1);
-		
-	if (*filename != '/' || lstat(&filename[1], &statb) != 0 ||
-	    !S_ISREG(statb.st_mode)) {
-	    continue;
+	if (!batch.paths[i]) {
+	    free(batch.paths);
+	    free(batch.infos);
+	    return luaL_argerror(L, 1, "paths must be strings");
 	}
+    }
 
-	char *dirend = strrchr(filename, '/');
-	if (dirend) {
-	    int len = dirend - filename;
-	    lua_pushlstring(L, filename, len > 0 ? len : 1);
-	} else
-	    lua_pushstring(L, filename);
-	lua_pushboolean(L, 1);
-	lua_rawset(L, -4);
+    if (pool_run(count, threads, scan_batch_item, &batch)) {
+	free(batch.paths);
+	free(batch.infos);
+	lua_pushnil(L);
+	lua_pushstring(L, "Can't start scanning threads");
+	return 2;
     }
-    chdir(curdir);
-    free(curdir);
-    return 1;
+
+    lua_createtable(L, count, 0);
+    lua_newtable(L);
+    for (size_t i = 0; i < count; i++) {
+	elf_info *info = &batch.infos[i];
+	if (info->status > 0)
+	    push_info(L, info);
+	else
+	    lua_pushboolean(L, 0);
+	lua_rawseti(L, -3, i + 1);
+	if (info->status < 0) {
+	    lua_pushstring(L, info_error(info));
+	    lua_rawseti(L, -2, i + 1);
+	}
+	info_free(info);
+    }
+    free(batch.paths);
+    free(batch.infos);
+    return 2;
 }
 
-LUAFN(canonicalize)
+// Tar members are laid out in blocks of this size.
+#define TAR_BLOCK 512
+#define MAX_LINK_HOPS 40
+
+// Lexically resolve path relative to the directory dir, giving an
+// absolute name with no "." or ".." components.  Returns 0, or -1 if
+// the result won't fit.
+static int normalize_path(const char *dir, const char *path,
+			  char *out, size_t outlen)
 {
-    char *path = realpath(lua_tostring(L, 1), NULL);
+    size_t len = 0;
+    const char *parts[2] = { *path == '/' ? "" : dir, path };
 
-    if (path) {
-        lua_pushstring(L, path);
-        free(path);
-    } else
-        lua_pushnil(L);
+    for (int part = 0; part < 2; part++) {
+	const char *cursor = parts[part];
+	while (*cursor) {
+	    while (*cursor == '/')
+		cursor++;
+	    const char *end = cursor + strcspn(cursor, "/");
+	    size_t complen = end - cursor;
+	    if (complen == 0 || (complen == 1 && *cursor == '.'))
+		;
+	    else if (complen == 2 && cursor[0] == '.' && cursor[1] == '.') {
+		while (len > 0 && out[--len] != '/')
+		    ;
+	    } else {
+		if (len + complen + 2 > outlen)
+		    return -1;
+		out[len++] = '/';
+		memcpy(out + len, cursor, complen);
+		len += complen;
+	    }
+	    cursor = end;
+	}
+    }
+    if (len == 0)
+	out[len++] = '/';
+    out[len] = 0;
+    return 0;
+}
 
-    return 1;
+static uint64_t tar_number(const unsigned char *field, size_t len)
+{
+    uint64_t value = 0;
+
+    // GNU base-256 for big sizes.
+    if (*field & 0x80) {
+	value = *field & 0x3f;
+	for (size_t i = 1; i < len; i++)
+	    value = value << 8 | field[i];
+	return value;
+    }
+    for (size_t i = 0; i < len && field[i]; i++)
+	if (field[i] >= '0' && field[i] <= '7')
+	    value = value << 3 | (field[i] - '0');
+    return value;
 }
 
-typedef struct { const char *name; int value; } intconst;
+static int tar_checksum_ok(const unsigned char *header)
+{
+    unsigned sum = 0;
 
-LUALIB_API int luaopen_elfutil(lua_State *L)
+    for (int i = 0; i < TAR_BLOCK; i++)
+	sum += i >= 148 && i < 156 ? ' ' : header[i];
+    return sum == tar_number(header + 148, 8);
+}
+
+// Read the whole of a tar member's data into a fresh buffer, consuming
+// the block padding.
+static char *read_member(unpack *stream, uint64_t size)
 {
-    static const luaL_Reg funcptrs[] = {
+    char *data = malloc(size + 1);
+
+    if (!data)
+	return NULL;
+    if (unpack_read(stream, data, size) != size ||
+	unpack_skip(stream, -size & (TAR_BLOCK - 1))) {
+	free(data);
+	return NULL;
+    }
+    data[size] = 0;
+    return data;
+}
+
+/* What an archive holds of interest: its ELF objects with their paths,
+ * and its hard and symbolic links.  It's gathered away from the Lua
+ * state, so archives may be read on worker threads.
+ */
+typedef struct {
+    elf_info *infos;
+    char **paths;
+    size_t count, size;
+    // Pairs of link name and target.
+    char **links;
+    size_t link_count, link_size;
+    char errmsg[128];
+} archive_contents;
+
+static void archive_init(archive_contents *contents)
+{
+    memset(contents, 0, sizeof(*contents));
+}
+
+static void archive_free(archive_contents *contents)
+{
+    for (size_t i = 0; i < contents->count; i++) {
+	info_free(&contents->infos[i]);
+	free(contents->paths[i]);
+    }
+    for (size_t i = 0; i < 2 * contents->link_count; i++)
+	free(contents->links[i]);
+    free(contents->infos);
+    free(contents->paths);
+    free(contents->links);
+    archive_init(contents);
+}
+
+// Take over info as the ELF object at path.  Returns 0, or -1 if
+// memory ran out, in which case info is freed.
+static int archive_add_elf(archive_contents *contents, elf_info *info,
+			   const char *path)
+{
+    if (contents->count == contents->size) {
+	size_t newsize = 2 * contents->size + 16;
+	elf_info *newinfos =
+	    realloc(contents->infos, newsize * sizeof(elf_info));
+	if (newinfos)
+	    contents->infos = newinfos;
+	char **newpaths =
+	    realloc(contents->paths, newsize * sizeof(char *));
+	if (newpaths)
+	    contents->paths = newpaths;
+	if (!newinfos || !newpaths) {
+	    info_free(info);
+	    return -1;
+	}
+	contents->size = newsize;
+    }
+    char *copy = strdup(path);
+    if (!copy) {
+	info_free(info);
+	return -1;
+    }
+    contents->infos[contents->count] = *info;
+    contents->paths[contents->count++] = copy;
+    return 0;
+}
+
+// Record that name, relative to dir, links to target.  Links which
+// can't be named are ignored.  Returns 0, or -1 if memory ran out.
+static int add_link(archive_contents *contents, const char *dir,
+		    const char *name, const char *target)
+{
+    char namebuf[PATH_MAX], targetbuf[PATH_MAX];
+
+    if (normalize_path(dir, name, namebuf, sizeof(namebuf)) ||
+	normalize_path(dir, target, targetbuf, sizeof(targetbuf)))
+	return 0;
+    if (contents->link_count == contents->link_size) {
+	size_t newsize = 2 * contents->link_size + 16;
+	char **newlinks =
+	    realloc(contents->links, 2 * newsize * sizeof(char *));
+	if (!newlinks)
+	    return -1;
+	contents->links = newlinks;
+	contents->link_size = newsize;
+    }
+    char *namecopy = strdup(namebuf), *targetcopy = strdup(targetbuf);
+    if (!namecopy || !targetcopy) {
+	free(namecopy);
+	free(targetcopy);
+	return -1;
+    }
+    contents->links[2 * contents->link_count] = namecopy;
+    contents->links[2 * contents->link_count++ + 1] = targetcopy;
+    return 0;
+}
+
+// Slackware packages carry their symlinks as lines of the form
+//   ( cd usr/lib64 ; ln -sf libfoo.so.1.2 libfoo.so.1 )
+// in install/doinst.sh rather than in the tar stream itself.
+static int scan_doinst(archive_contents *contents, const char *script)
+{
+    char dir[PATH_MAX], target[PATH_MAX], name[PATH_MAX];
+
+    for (const char *line = script; *line; line += strcspn(line, "\n")) {
+	if (*line == '\n')
+	    line++;
+	if (sscanf(line, "( cd %4095s ; ln -sf %4095s %4095s )",
+		   dir, target, name) == 3) {
+	    char absdir[PATH_MAX];
+	    if (!normalize_path("/", dir, absdir, sizeof(absdir)) &&
+		add_link(contents, absdir, name, target))
+		return -1;
+	}
+    }
+    return 0;
+}
+
+/* Read the ELF objects and links in a package archive without
+ * extracting it.  Thread safe.  Returns 0, or -1 with the reason in
+ * contents->errmsg.  Either way, contents must be freed.
+ */
+static int read_archive_contents(const char *archive, int machine,
+				 archive_contents *contents)
+{
+    const char *errmsg = NULL;
+    unpack *stream;
+    unsigned char header[TAR_BLOCK];
+    char *longname = NULL, *longlink = NULL, *doinst = NULL;
+
+    archive_init(contents);
+    if (!(stream = unpack_open(archive, &errmsg))) {
+	snprintf(contents->errmsg, sizeof(contents->errmsg), "%s", errmsg);
+	return -1;
+    }
+
+    for (;;) {
+	ssize_t actual = unpack_read(stream, header, TAR_BLOCK);
+	if (actual < 0)
+	    goto bugout;
+	// A zero block (or plain end of data) ends the archive.
+	if (actual < TAR_BLOCK || !header[0])
+	    break;
+	if (!tar_checksum_ok(header)) {
+	    errmsg = "Not a tar archive";
+	    goto bugout;
+	}
+
+	uint64_t size = tar_number(header + 124, 12);
+	// What remains of the member's data, padding included.
+	uint64_t left = (size + TAR_BLOCK - 1) & -TAR_BLOCK;
+	char type = header[156];
+	char name[PATH_MAX], linkname[PATH_MAX];
+	char *data;
+
+	// Long names arrive as pseudo-members ahead of the real one.
+	if (type == 'L' || type == 'K' || type == 'x') {
+	    if (size >= PATH_MAX * 4) {
+		errmsg = "Corrupt tar header";
+		goto bugout;
+	    }
+	    if (!(data = read_member(stream, size)))
+		goto bugout;
+	    if (type == 'L') {
+		free(longname);
+		longname = data;
+	    } else if (type == 'K') {
+		free(longlink);
+		longlink = data;
+	    } else {
+		// Extended pax header records are "LEN KEY=VALUE\n".
+		for (char *record = data; record < data + size; ) {
+		    char *key, *end;
+		    size_t reclen = strtoul(record, &key, 10);
+		    if (!reclen || record + reclen > data + size)
+			break;
+		    end = record + reclen - 1;
+		    *end = 0;
+		    if (!strncmp(key, " path=", 6)) {
+			free(longname);
+			longname = strdup(key + 6);
+		    } else if (!strncmp(key, " linkpath=", 10)) {
+			free(longlink);
+			longlink = strdup(key + 10);
+		    }
+		    record += reclen;
+		}
+		free(data);
+	    }
+	    continue;
+	}
+
+	if (longname)
+	    snprintf(name, sizeof(name), "%s", longname);
+	else if (!memcmp(header + 257, "ustar\0", 6) && header[345])
+	    snprintf(name, sizeof(name), "%.155s/%.100s",
+		     header + 345, header);
+	else
+	    snprintf(name, sizeof(name), "%.100s", header);
+	snprintf(linkname, sizeof(linkname), "%.100s",
+		 longlink ? longlink : (char *)header + 157);
+	free(longname);
+	free(longlink);
+	longname = longlink = NULL;
+
+	char path[PATH_MAX];
+	int failed = 0;
+	if (normalize_path("/", name, path, sizeof(path)))
+	    type = 'X';
+	switch (type) {
+	case '1':
+	    failed = add_link(contents, "/", path, linkname);
+	    break;
+	case '2': {
+	    char *slash = strrchr(path, '/');
+	    *slash = 0;
+	    failed = add_link(contents, *path ? path : "/", slash + 1,
+			      linkname);
+	    *slash = '/';
+	    break;
+	}
+	case '0':
+	case '7':
+	case '\0':
+	    if (!strcmp(path, "/install/doinst.sh")) {
+		free(doinst);
+		if (size >= 64 * 1024 * 1024 ||
+		    !(doinst = read_member(stream, size)))
+		    goto bugout;
+		left = 0;
+		break;
+	    }
+	    unsigned char magic[SELFMAG];
+	    if (size < SELFMAG)
+		break;
+	    if (unpack_read(stream, magic, SELFMAG) != SELFMAG)
+		goto bugout;
+	    size -= SELFMAG;
+	    left -= SELFMAG;
+	    if (memcmp(magic, ELFMAG, SELFMAG))
+		break;
+
+	    char *image = malloc(size + SELFMAG);
+	    if (!image) {
+		errmsg = strerror(ENOMEM);
+		goto bugout;
+	    }
+	    memcpy(image, magic, SELFMAG);
+	    if (unpack_read(stream, image + SELFMAG, size) != size) {
+		free(image);
+		goto bugout;
+	    }
+	    left -= size;
+	    elf_info info;
+	    scan_image(image, size + SELFMAG, machine, &info);
+	    free(image);
+	    if (info.status > 0)
+		failed = archive_add_elf(contents, &info, path);
+	    else
+		info_free(&info);
+	    break;
+	}
+	if (failed) {
+	    errmsg = strerror(ENOMEM);
+	    goto bugout;
+	}
+	if (unpack_skip(stream, left))
+	    goto bugout;
+    }
+    unpack_close(stream);
+    free(longname);
+    free(longlink);
+
+    int rc = 0;
+    if (doinst) {
+	if ((rc = scan_doinst(contents, doinst)))
+	    snprintf(contents->errmsg, sizeof(contents->errmsg), "%s",
+		     strerror(ENOMEM));
+	free(doinst);
+    }
+    return rc;
+
+bugout:
+    if (!errmsg)
+	errmsg = unpack_error(stream);
+    snprintf(contents->errmsg, sizeof(contents->errmsg), "%s", errmsg);
+    unpack_close(stream);
+    free(longname);
+    free(longlink);
+    free(doinst);
+    return -1;
+}
+
+// Push an array of scan_elf style tables for the ELF objects in an
+// archive, each with its path in the package, and a table mapping the
+// links which lead to those objects onto the objects' own paths.
+static void push_archive(lua_State *L, archive_contents *contents)
+{
+    int base = lua_gettop(L);
+
+    luaL_checkstack(L, 8, "archive too deep");
+    lua_createtable(L, contents->count, 0);	// base+1: ELF tables
+    lua_newtable(L);		// base+2: ELF tables by path
+    lua_newtable(L);		// base+3: links to their targets
+    for (size_t i = 0; i < contents->count; i++) {
+	push_info(L, &contents->infos[i]);
+	lua_pushstring(L, "path");
+	lua_pushstring(L, contents->paths[i]);
+	lua_rawset(L, -3);
+	lua_pushstring(L, contents->paths[i]);
+	lua_pushvalue(L, -2);
+	lua_rawset(L, base + 2);
+	lua_rawseti(L, base + 1, i + 1);
+    }
+    for (size_t i = 0; i < contents->link_count; i++) {
+	lua_pushstring(L, contents->links[2 * i]);
+	lua_pushstring(L, contents->links[2 * i + 1]);
+	lua_rawset(L, base + 3);
+    }
+
+    // Follow each link to an ELF object, giving up on loops.
+    lua_newtable(L);		// base+4: aliases
+    lua_pushnil(L);
+    while (lua_next(L, base + 3)) {
+	int hops;
+	for (hops = 0; hops < MAX_LINK_HOPS; hops++) {
+	    lua_pushvalue(L, -1);
+	    lua_rawget(L, base + 2);
+	    int found = !lua_isnil(L, -1);
+	    lua_pop(L, 1);
+	    if (found)
+		break;
+	    lua_rawget(L, base + 3);
+	    if (lua_isnil(L, -1))
+		break;
+	}
+	if (lua_isnil(L, -1) || hops == MAX_LINK_HOPS) {
+	    lua_pop(L, 1);
+	    continue;
+	}
+	// STACK: elf_path link_name aliases
+	lua_pushvalue(L, -2);
+	lua_insert(L, -2);
+	lua_rawset(L, base + 4);
+    }
+    lua_replace(L, base + 2);
+    lua_settop(L, base + 2);
+}
+
+// Scan the ELF objects in a package archive without extracting it.
+// Returns an array of scan_elf style tables, each with its path in
+// the package, and a table mapping the hard and symbolic links which
+// lead to those objects onto the paths of the objects themselves.
+LUAFN(scan_archive)
+{
+    const char *archive = luaL_checkstring(L, 1);
+    archive_contents contents;
+
+    if (read_archive_contents(archive, get_machine(L), &contents)) {
+	lua_pushnil(L);
+	lua_pushstring(L, contents.errmsg);
+	archive_free(&contents);
+	return 2;
+    }
+    push_archive(L, &contents);
+    archive_free(&contents);
+    return 2;
+}
+
+struct archive_batch {
+    const char **paths;
+    archive_contents *contents;
+    int *status;
+    int machine;
+};
+
+static void archive_batch_item(void *context, size_t index)
+{
+    struct archive_batch *batch = context;
+
+    batch->status[index] =
+	read_archive_contents(batch->paths[index], batch->machine,
+			      &batch->contents[index]);
+}
+
+/* Scan a table of package archives on worker threads.  Returns a table
+ * holding, for each archive, its ELF tables as scan_archive would give
+ * them or false, a table of its aliases likewise, and a table of error
+ * messages for the archives that couldn't be read.
+ * Options: threads (defaults to one per CPU).
+ */
+LUAFN(scan_archives)
+{
+    luaL_checktype(L, 1, LUA_TTABLE);
+    int threads = 0;
+    if (lua_istable(L, 2)) {
+	lua_getfield(L, 2, "threads");
+	threads = lua_tointeger(L, -1);
+	lua_pop(L, 1);
+    }
+    size_t count = lua_objlen(L, 1);
+    struct archive_batch batch = { .machine = get_machine(L) };
+
+    // The path strings stay anchored by the argument table.
+    batch.paths = malloc((count + 1) * sizeof(char *));
+    batch.contents = malloc((count + 1) * sizeof(archive_contents));
+    batch.status = malloc((count + 1) * sizeof(int));
+    if (!batch.paths || !batch.contents || !batch.status) {
+	free(batch.paths);
+	free(batch.contents);
+	free(batch.status);
+	lua_pushnil(L);
+	lua_pushstring(L, strerror(ENOMEM));
+	return 2;
+    }
+    for (size_t i = 0; i < count; i++) {
+	lua_rawgeti(L, 1, i + 1);
+	batch.paths[i] = lua_tostring(L, -1);
+	lua_pop(L, 1);
+	if (!batch.paths[i]) {
+	    free(batch.paths);
+	    free(batch.contents);
+	    free(batch.status);
+	    return luaL_argerror(L, 1, "paths must be strings");
+	}
+    }
+
+    if (pool_run(count, threads, archive_batch_item, &batch)) {
+	free(batch.paths);
+	free(batch.contents);
+	free(batch.status);
+	lua_pushnil(L);
+	lua_pushstring(L, "Can't start scanning threads");
+	return 2;
+    }
+
+    lua_settop(L, 1);
+    lua_createtable(L, count, 0);	// 2: ELF tables
+    lua_createtable(L, count, 0);	// 3: aliases
+    lua_newtable(L);			// 4: errors
+    for (size_t i = 0; i < count; i++) {
+	archive_contents *contents = &batch.contents[i];
+	if (batch.status[i]) {
+	    lua_pushboolean(L, 0);
+	    lua_pushboolean(L, 0);
+	    lua_pushstring(L, contents->errmsg);
+	    lua_rawseti(L, 4, i + 1);
+	} else
+	    push_archive(L, contents);
+	lua_rawseti(L, 3, i + 1);
+	lua_rawseti(L, 2, i + 1);
+	archive_free(contents);
+    }
+    free(batch.paths);
+    free(batch.contents);
+    free(batch.status);
+    return 3;
+}
+
+/* The ELF cache is a file of scan_archive results, keyed by the
+ * caller (usually by archive checksum).  It's only appended to, under
+ * an exclusive flock, and readers take a shared one to map and index
+ * what's new, so any number of sessions may share it.  Each record is
+ * framed as
+ *
+ *   u32 magic, u32 payload length, u32 payload checksum, u32 zero,
+ *   payload, zero padding to a multiple of eight bytes.
+ *
+ * The payload is the key, the ELF tables and the aliases, all as u32
+ * counts and length prefixed strings.  A length of ~0 is a missing
+ * string.  A record which fails to check out (as one torn by a crash
+ * would) ends the usable part of the file, and the next store cuts it
+ * off before appending.  Nobody reads past the records indexed, so
+ * that can't pull pages from under another session's mapping.
+ */
+#define CACHE_FORMAT "2"
+#define CACHE_HEADER "TFTELFC" CACHE_FORMAT
+#define CACHE_HEADER_SIZE 8
+#define RECORD_MAGIC 0x52464c45
+#define RECORD_HEADER_SIZE 16
+#define NO_STRING 0xffffffff
+#define CACHE_META "elfutil.cache"
+
+typedef struct {
+    int fd;
+    char *map;
+    size_t mapped;
+    // Records before this offset are in the index.
+    size_t indexed;
+} elfcache;
+
+typedef struct {
+    char *data;
+    size_t len, size;
+    int failed;
+} wbuf;
+
+static void put_bytes(wbuf *buf, const void *bytes, size_t len)
+{
+    if (buf->failed)
+	return;
+    if (buf->len + len > buf->size) {
+	size_t newsize = 2 * buf->size + len + 4096;
+	char *newdata = realloc(buf->data, newsize);
+	if (!newdata) {
+	    buf->failed = 1;
+	    return;
+	}
+	buf->data = newdata;
+	buf->size = newsize;
+    }
+    memcpy(buf->data + buf->len, bytes, len);
+    buf->len += len;
+}
+
+static void put_u32(wbuf *buf, uint32_t value)
+{
+    put_bytes(buf, &value, sizeof(value));
+}
+
+static void put_str(wbuf *buf, const char *string, size_t len)
+{
+    if (!string)
+	put_u32(buf, NO_STRING);
+    else {
+	put_u32(buf, len);
+	put_bytes(buf, string, len);
+    }
+}
+
+// Put the string field name of the table on top of the stack.
+static void put_field(lua_State *L, wbuf *buf, const char *name)
+{
+    size_t len;
+    lua_getfield(L, -1, name);
+    const char *string = lua_tolstring(L, -1, &len);
+    put_str(buf, string, len);
+    lua_pop(L, 1);
+}
+
+// Put an rpath style list field, joined back up with colons.
+static void put_path_list(lua_State *L, wbuf *buf, const char *name)
+{
+    lua_getfield(L, -1, name);
+    if (!lua_istable(L, -1))
+	put_str(buf, NULL, 0);
+    else {
+	int list = lua_gettop(L);
+	int count = lua_objlen(L, list);
+	luaL_checkstack(L, 2 * count, "path list too long");
+	for (int i = 1; i <= count; i++) {
+	    lua_rawgeti(L, list, i);
+	    lua_pushstring(L, ":");
+	}
+	lua_pop(L, count > 0);
+	lua_concat(L, count > 0 ? 2 * count - 1 : 0);
+	size_t len;
+	const char *joined = lua_tolstring(L, -1, &len);
+	put_str(buf, joined, len);
+	lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+}
+
+static uint32_t checksum(const char *data, size_t len)
+{
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++)
+	hash = (hash ^ (unsigned char)data[i]) * 16777619u;
+    return hash;
+}
+
+typedef struct {
+    const char *cursor, *end;
+    int failed;
+} rbuf;
+
+static uint32_t get_u32(rbuf *buf)
+{
+    uint32_t value;
+    if (buf->failed || buf->end - buf->cursor < sizeof(value)) {
+	buf->failed = 1;
+	return 0;
+    }
+    memcpy(&value, buf->cursor, sizeof(value));
+    buf->cursor += sizeof(value);
+    return value;
+}
+
+// Push the next string, or nil if it's missing.
+static void push_str(lua_State *L, rbuf *buf)
+{
+    uint32_t len = get_u32(buf);
+    if (buf->failed || len == NO_STRING || buf->end - buf->cursor < len) {
+	if (len != NO_STRING)
+	    buf->failed = 1;
+	lua_pushnil(L);
+	return;
+    }
+    lua_pushlstring(L, buf->cursor, len);
+    buf->cursor += len;
+}
+
+// Set field name of the table below the top to the next string.
+static void get_field(lua_State *L, rbuf *buf, const char *name)
+{
+    push_str(L, buf);
+    lua_setfield(L, -2, name);
+}
+
+static void get_path_list(lua_State *L, rbuf *buf, const char *name)
+{
+    push_str(L, buf);
+    if (lua_isnil(L, -1))
+	lua_pop(L, 1);
+    else {
+	const char *joined = lua_tostring(L, -1);
+	push_path_list(L, joined);
+	lua_setfield(L, -3, name);
+	lua_pop(L, 1);
+    }
+}
+
+// Push the ELF tables and aliases held in a record's payload, just as
+// scan_archive would have.  Returns 0, or -1 if the payload is bad.
+static int push_payload(lua_State *L, const char *payload, size_t len)
+{
+    rbuf buf = { payload, payload + len, 0 };
+    int top = lua_gettop(L);
+
+    push_str(L, &buf);
+    lua_pop(L, 1);
+    uint32_t count = get_u32(&buf);
+    lua_createtable(L, count < 65536 ? count : 0, 0);
+    for (uint32_t i = 1; i <= count && !buf.failed; i++) {
+	lua_newtable(L);
+	AT_NAME_PUT_INT(class, get_u32(&buf));
+	AT_NAME_PUT_INT(machine, get_u32(&buf));
+	AT_NAME_PUT(type, get_u32(&buf) == 2 ? "executable" :
+		    "shared library", string);
+	get_field(L, &buf, "path");
+	get_field(L, &buf, "interp");
+	get_field(L, &buf, "soname");
+	get_path_list(L, &buf, "rpath");
+	get_path_list(L, &buf, "runpath");
+	uint32_t needed = get_u32(&buf);
+	lua_newtable(L);
+	for (uint32_t j = 1; j <= needed && !buf.failed; j++) {
+	    push_str(L, &buf);
+	    lua_rawseti(L, -2, j);
+	}
+	lua_setfield(L, -2, "needed");
+	uint32_t versions = get_u32(&buf);
+	if (versions && !buf.failed) {
+	    lua_newtable(L);
+	    for (uint32_t j = 0; j < versions && !buf.failed; j++) {
+		push_str(L, &buf);
+		push_str(L, &buf);
+		if (lua_isnil(L, -1) || lua_isnil(L, -2))
+		    buf.failed = 1;
+		else {
+		    lua_pushvalue(L, -3);
+		    push_version(L, lua_tostring(L, -3),
+				 lua_tostring(L, -2));
+		    lua_pop(L, 1);
+		}
+		lua_pop(L, 2);
+	    }
+	    lua_setfield(L, -2, "verneed");
+	}
+	versions = get_u32(&buf);
+	if (versions && !buf.failed) {
+	    lua_newtable(L);
+	    for (uint32_t j = 1; j <= versions && !buf.failed; j++) {
+		push_str(L, &buf);
+		lua_rawseti(L, -2, j);
+	    }
+	    lua_setfield(L, -2, "verdef");
+	}
+	lua_rawseti(L, -2, i);
+    }
+    count = get_u32(&buf);
+    lua_newtable(L);
+    for (uint32_t i = 0; i < count && !buf.failed; i++) {
+	push_str(L, &buf);
+	push_str(L, &buf);
+	if (lua_isnil(L, -2)) {
+	    buf.failed = 1;
+	    lua_pop(L, 2);
+	} else
+	    lua_rawset(L, -3);
+    }
+    if (buf.failed) {
+	lua_settop(L, top);
+	return -1;
+    }
+    return 0;
+}
+
+static elfcache *check_cache(lua_State *L)
+{
+    elfcache *cache = luaL_checkudata(L, 1, CACHE_META);
+    if (cache->fd < 0)
+	luaL_error(L, "ELF cache is closed");
+    return cache;
+}
+
+// Bring the mapping up to date with the file, and index any records
+// which have arrived since last time.  The index is the userdata's
+// environment table.  The caller holds the lock.
+static void cache_refresh(lua_State *L, elfcache *cache)
+{
+    struct stat statb;
+
+    if (fstat(cache->fd, &statb) || statb.st_size == cache->mapped ||
+	statb.st_size < cache->indexed)
+	return;
+    if (cache->map)
+	munmap(cache->map, cache->mapped);
+    cache->mapped = 0;
+    cache->map = mmap(NULL, statb.st_size, PROT_READ, MAP_SHARED,
+		      cache->fd, 0);
+    if (cache->map == MAP_FAILED) {
+	cache->map = NULL;
+	return;
+    }
+    cache->mapped = statb.st_size;
+    if (cache->indexed == 0) {
+	if (memcmp(cache->map, CACHE_HEADER, CACHE_HEADER_SIZE))
+	    return;
+	cache->indexed = CACHE_HEADER_SIZE;
+    }
+
+    lua_getfenv(L, 1);
+    while (cache->mapped - cache->indexed >= RECORD_HEADER_SIZE) {
+	uint32_t header[4];
+	memcpy(header, cache->map + cache->indexed, sizeof(header));
+	const char *payload = cache->map + cache->indexed + sizeof(header);
+	size_t total = (RECORD_HEADER_SIZE + header[1] + 7) & -8;
+	if (header[0] != RECORD_MAGIC ||
+	    total > cache->mapped - cache->indexed ||
+	    checksum(payload, header[1]) != header[2])
+	    break;
+	rbuf key = { payload, payload + header[1], 0 };
+	push_str(L, &key);
+	if (!lua_isnil(L, -1)) {
+	    lua_pushvalue(L, -1);
+	    lua_rawget(L, -3);
+	    // First come, first served.
+	    if (lua_isnil(L, -1)) {
+		lua_pop(L, 1);
+		lua_pushnumber(L, cache->indexed);
+		lua_rawset(L, -3);
+	    } else
+		lua_pop(L, 2);
+	} else
+	    lua_pop(L, 1);
+	cache->indexed += total;
+    }
+    lua_pop(L, 1);
+}
+
+// The key as stored includes the machine filter, since the results
+// depend on it.
+static void push_cache_key(lua_State *L)
+{
+    lua_pushfstring(L, "%s/%d", luaL_checkstring(L, 2), get_machine(L));
+}
+
+// Open (creating if need be) the ELF cache in the given directory.
+LUAFN(open_cache)
+{
+    const char *directory = luaL_checkstring(L, 1);
+    const char *path =
+	lua_pushfstring(L, "%s/elfcache-%s", directory, CACHE_FORMAT);
+    int fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644);
+
+    if (fd < 0) {
+	lua_pushnil(L);
+	lua_pushstring(L, strerror(errno));
+	return 2;
+    }
+    // A new cache gets its header under the lock.
+    struct stat statb;
+    if (flock(fd, LOCK_EX) == 0) {
+	if (fstat(fd, &statb) == 0 && statb.st_size == 0)
+	    write(fd, CACHE_HEADER, CACHE_HEADER_SIZE);
+	flock(fd, LOCK_UN);
+    }
+    char header[CACHE_HEADER_SIZE];
+    if (pread(fd, header, sizeof(header), 0) != sizeof(header) ||
+	memcmp(header, CACHE_HEADER, CACHE_HEADER_SIZE)) {
+	close(fd);
+	lua_pushnil(L);
+	lua_pushfstring(L, "%s isn't an ELF cache", path);
+	return 2;
+    }
+
+    elfcache *cache = lua_newuserdata(L, sizeof(elfcache));
+    cache->fd = fd;
+    cache->map = NULL;
+    cache->mapped = cache->indexed = 0;
+    luaL_getmetatable(L, CACHE_META);
+    lua_setmetatable(L, -2);
+    lua_newtable(L);
+    lua_setfenv(L, -2);
+    return 1;
+}
+
+// Find the record stored under the key given as the second argument.
+// Returns its offset, or 0 if it isn't there.
+static size_t cache_find(lua_State *L, elfcache *cache)
+{
+    size_t offset = 0;
+
+    push_cache_key(L);
+    for (int pass = 0; pass < 2 && !offset; pass++) {
+	lua_getfenv(L, 1);
+	lua_pushvalue(L, -2);
+	lua_rawget(L, -2);
+	if (lua_isnumber(L, -1) && cache->map)
+	    offset = lua_tonumber(L, -1);
+	lua_pop(L, 2);
+	// Someone else may have added it since we last looked.
+	if (pass == 0 && !offset && !flock(cache->fd, LOCK_SH)) {
+	    cache_refresh(L, cache);
+	    flock(cache->fd, LOCK_UN);
+	}
+    }
+    lua_pop(L, 1);
+    return offset;
+}
+
+// cache:lookup(key) returns the ELF tables and aliases stored under
+// key, or nothing if they aren't there.
+LUAFN(cache_lookup)
+{
+    elfcache *cache = check_cache(L);
+    size_t offset = cache_find(L, cache);
+
+    if (offset) {
+	uint32_t header[4];
+	memcpy(header, cache->map + offset, sizeof(header));
+	if (push_payload(L, cache->map + offset + sizeof(header),
+			 header[1]) == 0)
+	    return 2;
+    }
+    return 0;
+}
+
+// cache:has(key) says whether anything is stored under key, without
+// the cost of unpacking it.
+LUAFN(cache_has)
+{
+    elfcache *cache = check_cache(L);
+
+    lua_pushboolean(L, cache_find(L, cache) != 0);
+    return 1;
+}
+
+// Put the verneed table of the ELF table on top as a count of pairs of
+// file and version.
+static void put_verneed(lua_State *L, wbuf *buf)
+{
+    size_t count_at = buf->len;
+    uint32_t count = 0;
+
+    put_u32(buf, 0);
+    lua_getfield(L, -1, "verneed");
+    if (lua_istable(L, -1)) {
+	lua_pushnil(L);
+	while (lua_next(L, -2)) {
+	    if (lua_type(L, -2) == LUA_TSTRING && lua_istable(L, -1)) {
+		size_t filelen;
+		const char *file = lua_tolstring(L, -2, &filelen);
+		int versions = lua_objlen(L, -1);
+		for (int i = 1; i <= versions; i++) {
+		    size_t len;
+		    lua_rawgeti(L, -1, i);
+		    const char *version = lua_tolstring(L, -1, &len);
+		    if (version) {
+			put_str(buf, file, filelen);
+			put_str(buf, version, len);
+			count++;
+		    }
+		    lua_pop(L, 1);
+		}
+	    }
+	    lua_pop(L, 1);
+	}
+    }
+    lua_pop(L, 1);
+    if (!buf->failed)
+	memcpy(buf->data + count_at, &count, sizeof(count));
+}
+
+// cache:store(key, elfs, aliases) appends the results of scan_archive.
+LUAFN(cache_store)
+{
+    elfcache *cache = check_cache(L);
+    luaL_checktype(L, 3, LUA_TTABLE);
+    luaL_checktype(L, 4, LUA_TTABLE);
+    wbuf buf = { NULL, 0, 0, 0 };
+    uint32_t header[4] = { RECORD_MAGIC, 0, 0, 0 };
+
+    lua_settop(L, 4);
+    push_cache_key(L);
+    put_bytes(&buf, header, sizeof(header));
+    size_t keylen;
+    const char *key = lua_tolstring(L, 5, &keylen);
+    put_str(&buf, key, keylen);
+    int count = lua_objlen(L, 3);
+    put_u32(&buf, count);
+    for (int i = 1; i <= count; i++) {
+	lua_rawgeti(L, 3, i);
+	if (!lua_istable(L, -1)) {
+	    free(buf.data);
+	    return luaL_argerror(L, 3, "ELF tables expected");
+	}
+	lua_getfield(L, -1, "class");
+	put_u32(&buf, lua_tointeger(L, -1));
+	lua_getfield(L, -2, "machine");
+	put_u32(&buf, lua_tointeger(L, -1));
+	lua_getfield(L, -3, "type");
+	const char *type = lua_tostring(L, -1);
+	put_u32(&buf, type && !strcmp(type, "executable") ? 2 : 3);
+	lua_pop(L, 3);
+	put_field(L, &buf, "path");
+	put_field(L, &buf, "interp");
+	put_field(L, &buf, "soname");
+	put_path_list(L, &buf, "rpath");
+	put_path_list(L, &buf, "runpath");
+	lua_getfield(L, -1, "needed");
+	int needed = lua_istable(L, -1) ? lua_objlen(L, -1) : 0;
+	put_u32(&buf, needed);
+	for (int j = 1; j <= needed; j++) {
+	    size_t len;
+	    lua_rawgeti(L, -1, j);
+	    const char *name = lua_tolstring(L, -1, &len);
+	    put_str(&buf, name ? name : "", name ? len : 0);
+	    lua_pop(L, 1);
+	}
+	lua_pop(L, 1);
+	put_verneed(L, &buf);
+	lua_getfield(L, -1, "verdef");
+	int verdefs = lua_istable(L, -1) ? lua_objlen(L, -1) : 0;
+	put_u32(&buf, verdefs);
+	for (int j = 1; j <= verdefs; j++) {
+	    size_t len;
+	    lua_rawgeti(L, -1, j);
+	    const char *name = lua_tolstring(L, -1, &len);
+	    put_str(&buf, name ? name : "", name ? len : 0);
+	    lua_pop(L, 1);
+	}
+	lua_pop(L, 2);
+    }
+    size_t alias_count_at = buf.len;
+    uint32_t alias_count = 0;
+    put_u32(&buf, 0);
+    lua_pushnil(L);
+    while (lua_next(L, 4)) {
+	if (lua_type(L, -2) == LUA_TSTRING &&
+	    lua_type(L, -1) == LUA_TSTRING) {
+	    size_t len;
+	    const char *string = lua_tolstring(L, -2, &len);
+	    put_str(&buf, string, len);
+	    string = lua_tolstring(L, -1, &len);
+	    put_str(&buf, string, len);
+	    alias_count++;
+	}
+	lua_pop(L, 1);
+    }
+    header[1] = buf.len - sizeof(header);
+    put_bytes(&buf, "\0\0\0\0\0\0\0", -buf.len & 7);
+    if (buf.failed) {
+	free(buf.data);
+	lua_pushnil(L);
+	lua_pushstring(L, strerror(ENOMEM));
+	return 2;
+    }
+    memcpy(buf.data + alias_count_at, &alias_count, sizeof(alias_count));
+    header[2] = checksum(buf.data + sizeof(header), header[1]);
+    memcpy(buf.data, header, sizeof(header));
+
+    const char *errmsg = NULL;
+    if (flock(cache->fd, LOCK_EX))
+	errmsg = strerror(errno);
+    else {
+	// Don't bother if another session got there first.
+	lua_settop(L, 5);
+	cache_refresh(L, cache);
+	lua_getfenv(L, 1);
+	lua_pushvalue(L, 5);
+	lua_rawget(L, -2);
+	// Anything past the records indexed is torn, and would hide
+	// whatever came after it.
+	struct stat statb;
+	if (lua_isnil(L, -1) && cache->indexed >= CACHE_HEADER_SIZE &&
+	    (fstat(cache->fd, &statb) ||
+	     (statb.st_size > cache->indexed &&
+	      ftruncate(cache->fd, cache->indexed))))
+	    errmsg = strerror(errno);
+	else if (lua_isnil(L, -1)) {
+	    ssize_t written = write(cache->fd, buf.data, buf.len);
+	    if (written != buf.len) {
+		errmsg = written < 0 ? strerror(errno) : "Short write";
+		// Keep later records readable.
+		if (written > 0)
+		    ftruncate(cache->fd, cache->indexed);
+	    }
+	}
+	flock(cache->fd, LOCK_UN);
+    }
+    free(buf.data);
+    if (errmsg) {
+	lua_pushnil(L);
+	lua_pushstring(L, errmsg);
+	return 2;
+    }
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+LUAFN(cache_close)
+{
+    elfcache *cache = luaL_checkudata(L, 1, CACHE_META);
+    if (cache->map)
+	munmap(cache->map, cache->mapped);
+    if (cache->fd >= 0)
+	close(cache->fd);
+    cache->map = NULL;
+    cache->mapped = 0;
+    cache->fd = -1;
+    return 0;
+}
+
+#define DT_UNKNOWN 0
+#define DT_DIR 4
+#define DT_REG 8
+#define DT_LNK 10
+
+#ifndef AT_STATX_DONT_SYNC
+#define AT_STATX_DONT_SYNC 0x4000
+#endif
+
+typedef struct {
+    uint64_t dev, ino;
+    mode_t mode;
+} file_identity;
+
+/* Stat path relative to dirfd for no more than tells one file from
+ * another.  Where the kernel has statx, only those fields are asked
+ * for, and network filesystems needn't go back to the server for them.
+ * Thread safe, unlike anything using chdir().
+ */
+static int stat_identity(int dirfd, const char *path, int flags,
+			 file_identity *id)
+{
+#ifdef SYS_statx
+    static volatile int no_statx;
+    if (!no_statx) {
+	struct statx stx;
+	if (!syscall(SYS_statx, dirfd, path, flags | AT_STATX_DONT_SYNC,
+		     STATX_TYPE | STATX_INO, &stx)) {
+	    id->dev = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+	    id->ino = stx.stx_ino;
+	    id->mode = stx.stx_mode;
+	    return 0;
+	}
+	if (errno != ENOSYS)
+	    return -1;
+	no_statx = 1;
+    }
+#endif
+    struct stat statb;
+    if (fstatat(dirfd, path, &statb, flags))
+	return -1;
+    id->dev = statb.st_dev;
+    id->ino = statb.st_ino;
+    id->mode = statb.st_mode;
+    return 0;
+}
+
+// Push { "dev,ino", path } into the array at index results.
+static void push_candidate(lua_State *L, int results, int *place,
+			   const file_identity *id, const char *dir,
+			   const char *name)
+{
+    char buf[64];
+    snprintf(buf, sizeof(buf), "%llu,%llu", (unsigned long long)id->dev,
+	     (unsigned long long)id->ino);
+    lua_createtable(L, 2, 0);
+    lua_pushstring(L, buf);
+    lua_rawseti(L, -2, 1);
+    if (name)
+	lua_pushfstring(L, "%s/%s", dir, name);
+    else
+	lua_pushstring(L, dir);
+    lua_rawseti(L, -2, 2);
+    lua_rawseti(L, results, (*place)++);
+}
+
+// Open the root given as argument index, or /.
+static int open_root(lua_State *L, int index)
+{
+    const char *root = lua_toboolean(L, index) ?
+	luaL_checkstring(L, index) : "/";
+    return open(*root ? root : "/", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+}
+
+/* get_candidates(names, root) stats each absolute name under root, or
+ * each file in it if it's a directory, and returns an array of
+ * { "dev,ino", path } for the regular files.  Everything is looked up
+ * relative to a descriptor for root, so nothing depends on, or changes,
+ * the current directory.
+ */
+LUAFN(get_candidates)
+{
+    int rootfd;
+
+    if (lua_isnoneornil(L, 1) || (rootfd = open_root(L, 2)) < 0) {
+	lua_newtable(L);
+	return 1;
+    }
+
+    // Single value becomes a one-entry table.
+    if (lua_istable(L, 1))
+	lua_pushvalue(L,1);
+    else {
+	lua_newtable(L);
+	lua_pushvalue(L,1);
+	lua_rawseti(L,-2,1);
+    }
+    int names = lua_gettop(L);
+
+    // Stat results go here.
+    lua_newtable(L);
+    int results = lua_gettop(L);
+
+    lua_pushnil(L);
+    int place = 1;
+    while (lua_next(L, names)) {
+	file_identity id;
+	const char *name = lua_tostring(L, -1);
+
+	if (!name || *name != '/' ||
+	    stat_identity(rootfd, name[1] ? &name[1] : ".", 0, &id))
+	    goto done;
+
+	if (S_ISREG(id.mode)) {
+	    push_candidate(L, results, &place, &id, name, NULL);
+	    goto done;
+	}
+
+	int dirfd;
+	DIR *dirp;
+	if (!S_ISDIR(id.mode) ||
+	    (dirfd = openat(rootfd, name[1] ? &name[1] : ".",
+			    O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+	    goto done;
+	// readdir() fetches entries with getdents64 many at a time.
+	if (!(dirp = fdopendir(dirfd))) {
+	    close(dirfd);
+	    goto done;
+	}
+	struct dirent *dent;
+	while ((dent = readdir(dirp))) {
+	    // Exclude some obviously wrong files.
+	    if (dent->d_type != DT_REG && dent->d_type != DT_LNK &&
+		dent->d_type != DT_UNKNOWN)
+		continue;
+	    char *ext = strrchr(dent->d_name, '.');
+	    if (ext && (!strcmp(ext, ".a") || !strcmp(ext, ".la")))
+		continue;
+	    if (stat_identity(dirfd, dent->d_name, 0, &id) ||
+		!S_ISREG(id.mode))
+		continue;
+	    push_candidate(L, results, &place, &id, name, dent->d_name);
+	}
+	closedir(dirp);
+
+    done:
+	lua_pop(L, 1);
+    }
+
+    close(rootfd);
+    return 1;
+}
+
+// Look through a table of synonyms for a given file and yield the directories
+// for which the synonym with an absolute path is a hardlink.
+LUAFN(get_origins)
+{
+    int rootfd;
+
+    luaL_checktype(L, 1, LUA_TTABLE);
+    lua_newtable(L);
+    if ((rootfd = open_root(L, 2)) < 0)
+	return 1;
+    lua_pushnil(L);
+    while (lua_next(L, 1)) {
+	file_identity id;
+	const char *filename = lua_tostring(L, -2);
+	lua_pop(L, 1);
+
+	if (!filename || *filename != '/' || !filename[1] ||
+	    stat_identity(rootfd, &filename[1], AT_SYMLINK_NOFOLLOW, &id) ||
+	    !S_ISREG(id.mode)) {
+	    continue;
+	}
+
+	char *dirend = strrchr(filename, '/');
+	int len = dirend - filename;
+	lua_pushlstring(L, filename, len > 0 ? len : 1);
+	lua_pushboolean(L, 1);
+	lua_rawset(L, -4);
+    }
+    close(rootfd);
+    return 1;
+}
+
+/* A walker goes through directory trees as find -L would, following
+ * links and stopping only at a directory that is its own ancestor.
+ * Each file is identified by device and inode in a hash set, so one
+ * reached by several names is looked at once, and only its first four
+ * bytes are read to pass over anything that isn't ELF before it is
+ * mapped.  Results come back a batch at a time.
+ */
+#define WALK_META "elfutil.walker"
+#define WALK_MAX_DEPTH 64
+#define NOT_ELF 0xffffffff
+
+typedef struct {
+    DIR *dir;
+    size_t len;			// Of the directory's path.
+    uint64_t dev, ino;
+} walk_level;
+
+typedef struct {
+    uint64_t dev, ino;
+    uint32_t path;		// Offset of the first name, or NOT_ELF.
+    int used;
+} walk_file;
+
+typedef struct {
+    char path[PATH_MAX];
+    walk_level levels[WALK_MAX_DEPTH];
+    int depth;
+    walk_file *files;
+    size_t slots, count;
+    char *names;
+    size_t names_used, names_size;
+} elf_walker;
+
+// The slot for a file: its own, or the empty one it would take.
+static walk_file *walk_slot(elf_walker *w, uint64_t dev, uint64_t ino)
+{
+    uint64_t hash = (dev * 0x9e3779b97f4a7c15ull) ^ ino;
+    size_t slot = (hash ^ hash >> 29) & (w->slots - 1);
+
+    while (w->files[slot].used &&
+	   (w->files[slot].dev != dev || w->files[slot].ino != ino))
+	slot = (slot + 1) & (w->slots - 1);
+    return &w->files[slot];
+}
+
+static int walk_grow(elf_walker *w)
+{
+    size_t old_slots = w->slots;
+    walk_file *old = w->files;
+
+    w->slots = old_slots ? 2 * old_slots : 16384;
+    if (!(w->files = calloc(w->slots, sizeof(walk_file)))) {
+	w->files = old;
+	w->slots = old_slots;
+	return -1;
+    }
+    for (size_t i = 0; i < old_slots; i++)
+	if (old[i].used)
+	    *walk_slot(w, old[i].dev, old[i].ino) = old[i];
+    free(old);
+    return 0;
+}
+
+static uint32_t walk_name(elf_walker *w, const char *path, size_t len)
+{
+    if (w->names_used + len + 1 > w->names_size) {
+	size_t size = w->names_size ? 2 * w->names_size : 65536;
+	while (w->names_used + len + 1 > size)
+	    size *= 2;
+	char *names = size < NOT_ELF ? realloc(w->names, size) : NULL;
+	if (!names)
+	    return NOT_ELF;
+	w->names = names;
+	w->names_size = size;
+    }
+    uint32_t offset = w->names_used;
+    memcpy(w->names + offset, path, len + 1);
+    w->names_used += len + 1;
+    return offset;
+}
+
+static int is_elf_at(int dirfd, const char *name)
+{
+    unsigned char magic[SELFMAG];
+    int fd = openat(dirfd, name, O_RDONLY | O_CLOEXEC | O_NOCTTY);
+    ssize_t got;
+
+    if (fd < 0)
+	return 0;
+    while ((got = read(fd, magic, SELFMAG)) < 0 && errno == EINTR)
+	;
+    close(fd);
+    return got == SELFMAG && !memcmp(magic, ELFMAG, SELFMAG);
+}
+
+static void walk_pop(elf_walker *w)
+{
+    closedir(w->levels[--w->depth].dir);
+    if (w->depth > 0)
+	w->path[w->levels[w->depth - 1].len] = 0;
+}
+
+// Descend into the directory at w->path, of length len.
+static void walk_push(elf_walker *w, int dirfd, const char *name,
+		      size_t len, const file_identity *id)
+{
+    if (w->depth == WALK_MAX_DEPTH)
+	return;
+    for (int i = 0; i < w->depth; i++)
+	if (w->levels[i].dev == id->dev && w->levels[i].ino == id->ino)
+	    return;
+    int fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    DIR *dir = fd >= 0 ? fdopendir(fd) : NULL;
+    if (!dir) {
+	if (fd >= 0)
+	    close(fd);
+	return;
+    }
+    walk_level *level = &w->levels[w->depth++];
+    level->dir = dir;
+    level->len = len;
+    level->dev = id->dev;
+    level->ino = id->ino;
+}
+
+// walk_elfs(directories) returns a walker over the trees.
+LUAFN(walk_elfs)
+{
+    luaL_checktype(L, 1, LUA_TTABLE);
+    elf_walker *w = lua_newuserdata(L, sizeof(elf_walker));
+
+    memset(w, 0, sizeof(elf_walker));
+    luaL_getmetatable(L, WALK_META);
+    lua_setmetatable(L, -2);
+    // The directories yet to walk stay in the environment.
+    lua_newtable(L);
+    for (int i = lua_objlen(L, 1); i > 0; i--) {
+	lua_rawgeti(L, 1, i);
+	lua_rawseti(L, -2, lua_objlen(L, -2) + 1);
+    }
+    lua_setfenv(L, -2);
+    if (walk_grow(w))
+	return luaL_error(L, "%s", strerror(ENOMEM));
+    return 1;
+}
+
+/* walker:next([count]) returns an array of up to count paths of ELF
+ * objects not seen before, and a table mapping other names found for
+ * ones seen before onto their first.  Returns nil when the walk is
+ * done.
+ */
+LUAFN(walker_next)
+{
+    elf_walker *w = luaL_checkudata(L, 1, WALK_META);
+    int want = luaL_optinteger(L, 2, 1024);
+    int found = 0, any = 0;
+
+    lua_settop(L, 2);
+    lua_getfenv(L, 1);
+    lua_newtable(L);
+    lua_newtable(L);
+    while (found < want) {
+	if (w->depth == 0) {
+	    // On to the next tree.
+	    size_t left = lua_objlen(L, 3);
+	    if (!left)
+		break;
+	    lua_rawgeti(L, 3, left);
+	    lua_pushnil(L);
+	    lua_rawseti(L, 3, left);
+	    const char *top = lua_tostring(L, -1);
+	    file_identity id;
+	    size_t len = top ? strlen(top) : 0;
+	    if (top && len < sizeof(w->path) &&
+		!stat_identity(AT_FDCWD, top, 0, &id) && S_ISDIR(id.mode)) {
+		memcpy(w->path, top, len + 1);
+		walk_push(w, AT_FDCWD, top, len, &id);
+	    }
+	    lua_pop(L, 1);
+	    any = 1;
+	    continue;
+	}
+	any = 1;
+	walk_level *level = &w->levels[w->depth - 1];
+	struct dirent *dent = readdir(level->dir);
+	if (!dent) {
+	    walk_pop(w);
+	    continue;
+	}
+	const char *name = dent->d_name;
+	if (name[0] == '.' && (!name[1] || name[1] == '.' && !name[2]))
+	    continue;
+	size_t namelen = strlen(name);
+	if (level->len + 1 + namelen >= sizeof(w->path))
+	    continue;
+	file_identity id;
+	int fd = dirfd(level->dir);
+	if (stat_identity(fd, name, 0, &id))
+	    continue;
+	w->path[level->len] = '/';
+	memcpy(w->path + level->len + 1, name, namelen + 1);
+	size_t len = level->len + 1 + namelen;
+	if (S_ISDIR(id.mode)) {
+	    walk_push(w, fd, name, len, &id);
+	    continue;
+	}
+	if (!S_ISREG(id.mode)) {
+	    w->path[level->len] = 0;
+	    continue;
+	}
+	walk_file *file = walk_slot(w, id.dev, id.ino);
+	if (!file->used) {
+	    if (2 * (w->count + 1) > w->slots) {
+		if (walk_grow(w))
+		    return luaL_error(L, "%s", strerror(ENOMEM));
+		file = walk_slot(w, id.dev, id.ino);
+	    }
+	    file->used = 1;
+	    file->dev = id.dev;
+	    file->ino = id.ino;
+	    file->path = NOT_ELF;
+	    w->count++;
+	    if (is_elf_at(fd, name)) {
+		if ((file->path = walk_name(w, w->path, len)) == NOT_ELF)
+		    return luaL_error(L, "%s", strerror(ENOMEM));
+		lua_pushlstring(L, w->path, len);
+		lua_rawseti(L, 4, ++found);
+	    }
+	} else if (file->path != NOT_ELF) {
+	    lua_pushlstring(L, w->path, len);
+	    lua_pushstring(L, w->names + file->path);
+	    lua_rawset(L, 5);
+	}
+	w->path[level->len] = 0;
+    }
+    if (!any && !found) {
+	lua_pushnil(L);
+	return 1;
+    }
+    return 2;
+}
+
+LUAFN(walker_gc)
+{
+    elf_walker *w = luaL_checkudata(L, 1, WALK_META);
+
+    while (w->depth > 0)
+	walk_pop(w);
+    free(w->files);
+    free(w->names);
+    w->files = NULL;
+    w->names = NULL;
+    w->slots = 0;
+    return 0;
+}
+
+LUAFN(canonicalize)
+{
+    char *path = realpath(lua_tostring(L, 1), NULL);
+
+    if (path) {
+        lua_pushstring(L, path);
+        free(path);
+    } else
+        lua_pushnil(L);
+
+    return 1;
+}
+
+/* The loader's view of the libraries under a root: the entries of
+ * ld.so.cache, then whatever is in the trusted directories, which the
+ * loader searches when the cache has nothing.  Without a usable cache,
+ * the directories of ld.so.conf are read instead, each just once.
+ * Every name found heads a list of the paths it may be had at, in the
+ * order the loader would try them.
+ */
+#define SEARCH_META "elfutil.library_search"
+#define OLD_CACHE_MAGIC "ld.so-1.7.0"
+#define NEW_CACHE_MAGIC "glibc-ld.so.cache1.1"
+#define OLD_CACHE_HEADER 16
+#define OLD_CACHE_ENTRY 12
+#define NEW_CACHE_HEADER 48
+#define NEW_CACHE_ENTRY 24
+#define CACHE_FLAG_REQUIRED 0xff00
+#define NO_ENTRY 0xffffffff
+
+typedef struct {
+    uint32_t name, path, next;
+    int class;			// 32, 64, or zero if not known.
+} search_entry;
+
+typedef struct {
+    char *pool;
+    size_t used, size;
+    search_entry *entries;
+    size_t count, room;
+    uint32_t *heads, *tails;	// Per slot, an entry index or NO_ENTRY.
+    size_t slots;
+    int cached;
+} library_search;
+
+static uint32_t search_hash(const char *name, size_t len)
+{
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++)
+	hash = (hash ^ (unsigned char)name[i]) * 16777619u;
+    return hash;
+}
+
+static uint32_t search_string(library_search *s, const char *str, size_t len)
+{
+    if (s->used + len + 1 > s->size) {
+	size_t size = s->size ? s->size : 65536;
+	while (s->used + len + 1 > size)
+	    size *= 2;
+	char *pool = realloc(s->pool, size);
+	if (!pool || size >= NO_ENTRY)
+	    return NO_ENTRY;
+	s->pool = pool;
+	s->size = size;
+    }
+    uint32_t offset = s->used;
+    memcpy(s->pool + offset, str, len);
+    s->pool[offset + len] = 0;
+    s->used += len + 1;
+    return offset;
+}
+
+// The slot for name: either its own, or the empty one it would take.
+static size_t search_slot(library_search *s, const char *name, size_t len)
+{
+    size_t slot = search_hash(name, len) & (s->slots - 1);
+
+    while (s->heads[slot] != NO_ENTRY) {
+	const char *other = s->pool + s->entries[s->heads[slot]].name;
+	if (!strncmp(other, name, len) && !other[len])
+	    break;
+	slot = (slot + 1) & (s->slots - 1);
+    }
+    return slot;
+}
+
+static int search_grow(library_search *s)
+{
+    size_t slots = s->slots ? 2 * s->slots : 4096;
+    uint32_t *heads = malloc(slots * sizeof(uint32_t));
+    uint32_t *tails = malloc(slots * sizeof(uint32_t));
+
+    if (!heads || !tails) {
+	free(heads);
+	free(tails);
+	return -1;
+    }
+    memset(heads, 0xff, slots * sizeof(uint32_t));
+    uint32_t *old_heads = s->heads, *old_tails = s->tails;
+    size_t old_slots = s->slots;
+    s->heads = heads;
+    s->tails = tails;
+    s->slots = slots;
+    for (size_t i = 0; i < old_slots; i++) {
+	if (old_heads[i] == NO_ENTRY)
+	    continue;
+	const char *name = s->pool + s->entries[old_heads[i]].name;
+	size_t slot = search_slot(s, name, strlen(name));
+	heads[slot] = old_heads[i];
+	tails[slot] = old_tails[i];
+    }
+    free(old_heads);
+    free(old_tails);
+    return 0;
+}
+
+// Add path as a place to find name.  Returns 0, or -1 if out of memory.
+static int search_add(library_search *s, const char *name, size_t namelen,
+		      const char *path, size_t pathlen, int class)
+{
+    if (2 * (s->count + 1) > s->slots && search_grow(s))
+	return -1;
+    if (s->count == s->room) {
+	size_t room = s->room ? 2 * s->room : 4096;
+	search_entry *entries = realloc(s->entries, room * sizeof(*entries));
+	if (!entries)
+	    return -1;
+	s->entries = entries;
+	s->room = room;
+    }
+    size_t slot = search_slot(s, name, namelen);
+    search_entry *entry = &s->entries[s->count];
+    entry->class = class;
+    entry->next = NO_ENTRY;
+    if (s->heads[slot] == NO_ENTRY) {
+	if ((entry->name = search_string(s, name, namelen)) == NO_ENTRY)
+	    return -1;
+	s->heads[slot] = s->count;
+    } else {
+	entry->name = s->entries[s->heads[slot]].name;
+	s->entries[s->tails[slot]].next = s->count;
+    }
+    if ((entry->path = search_string(s, path, pathlen)) == NO_ENTRY)
+	return -1;
+    s->tails[slot] = s->count++;
+    return 0;
+}
+
+/* The ELF class of a cache entry, by the ABI ldconfig flagged it with,
+ * or zero if the flag isn't one of glibc's known here.  Unflagged
+ * entries are the 32-bit libraries of a multilib x86-64 system, since
+ * every 64-bit ABI Slackware runs on is flagged.
+ */
+static int cache_class(int32_t flags)
+{
+    switch (flags & CACHE_FLAG_REQUIRED) {
+    case 0x0000:		// i386 and the like
+    case 0x0600:		// MIPS n32
+    case 0x0800:		// x32
+    case 0x0900:		// ARM hard float
+    case 0x0b00:		// ARM soft float
+    case 0x0c00:		// MIPS o32, nan2008
+    case 0x0d00:		// MIPS n32, nan2008
+	return 32;
+    case 0x0100:		// SPARC
+    case 0x0200:		// IA-64
+    case 0x0300:		// x86-64
+    case 0x0400:		// S/390
+    case 0x0500:		// PowerPC
+    case 0x0700:		// MIPS n64
+    case 0x0a00:		// AArch64
+    case 0x0e00:		// MIPS n64, nan2008
+    case 0x1100:		// LoongArch soft float
+    case 0x1200:		// LoongArch double float
+	return 64;
+    default:			// RISC-V's flags don't give the width.
+	return 0;
+    }
+}
+
+// A string of the cache, or NULL if it runs off the end.
+static const char *cache_string(const char *image, size_t size,
+				size_t base, uint32_t offset, size_t *len)
+{
+    if (base + offset >= size)
+	return NULL;
+    const char *str = image + base + offset;
+    *len = strnlen(str, size - base - offset);
+    return base + offset + *len < size ? str : NULL;
+}
+
+/* Read the entries of ld.so.cache.  Caches come in the old format, the
+ * new, or the old with the new after it, where the new entries are
+ * preferred and every string is relative to the new header.  Returns
+ * 1 if the cache was read, 0 if it's unusable, -1 if out of memory.
+ */
+static int read_ld_cache(library_search *s, const char *image, size_t size)
+{
+    size_t header = 0, base = 0;
+    uint32_t nlibs;
+
+    if (size >= OLD_CACHE_HEADER &&
+	!memcmp(image, OLD_CACHE_MAGIC, strlen(OLD_CACHE_MAGIC))) {
+	memcpy(&nlibs, image + 12, sizeof(nlibs));
+	size_t old_end = OLD_CACHE_HEADER + (size_t)nlibs * OLD_CACHE_ENTRY;
+	if (old_end > size)
+	    return 0;
+	header = (old_end + 7) & ~(size_t)7;
+	if (header + NEW_CACHE_HEADER > size ||
+	    memcmp(image + header, NEW_CACHE_MAGIC,
+		   strlen(NEW_CACHE_MAGIC))) {
+	    // Old format alone.  Its strings follow the entries.
+	    for (uint32_t i = 0; i < nlibs; i++) {
+		const char *entry = image + OLD_CACHE_HEADER +
+		    (size_t)i * OLD_CACHE_ENTRY;
+		int32_t flags;
+		uint32_t key, value;
+		size_t keylen, valuelen;
+		memcpy(&flags, entry, 4);
+		memcpy(&key, entry + 4, 4);
+		memcpy(&value, entry + 8, 4);
+		const char *name =
+		    cache_string(image, size, old_end, key, &keylen);
+		const char *path =
+		    cache_string(image, size, old_end, value, &valuelen);
+		if (name && path &&
+		    search_add(s, name, keylen, path, valuelen,
+			       cache_class(flags)))
+		    return -1;
+	    }
+	    return 1;
+	}
+    } else if (size < NEW_CACHE_HEADER ||
+	       memcmp(image, NEW_CACHE_MAGIC, strlen(NEW_CACHE_MAGIC)))
+	return 0;
+
+    base = header;
+    memcpy(&nlibs, image + header + 20, sizeof(nlibs));
+    if (header + NEW_CACHE_HEADER + (size_t)nlibs * NEW_CACHE_ENTRY > size)
+	return 0;
+    for (uint32_t i = 0; i < nlibs; i++) {
+	const char *entry = image + header + NEW_CACHE_HEADER +
+	    (size_t)i * NEW_CACHE_ENTRY;
+	int32_t flags;
+	uint32_t key, value;
+	size_t keylen, valuelen;
+	memcpy(&flags, entry, 4);
+	memcpy(&key, entry + 4, 4);
+	memcpy(&value, entry + 8, 4);
+	const char *name = cache_string(image, size, base, key, &keylen);
+	const char *path = cache_string(image, size, base, value, &valuelen);
+	if (name && path &&
+	    search_add(s, name, keylen, path, valuelen, cache_class(flags)))
+	    return -1;
+    }
+    return 1;
+}
+
+static int search_read_cache(library_search *s, const char *root)
+{
+    char path[PATH_MAX];
+    struct stat statb;
+    int rc = 0;
+
+    if (snprintf(path, sizeof(path), "%s/etc/ld.so.cache", root) >=
+	sizeof(path))
+	return 0;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+	return 0;
+    if (!fstat(fd, &statb) && statb.st_size > 0) {
+	void *map = mmap(NULL, statb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map != MAP_FAILED) {
+	    rc = read_ld_cache(s, map, statb.st_size);
+	    munmap(map, statb.st_size);
+	}
+    }
+    close(fd);
+    return rc;
+}
+
+// Add the libraries in a directory, given relative to root.
+static int search_read_directory(library_search *s, const char *root,
+				 const char *dir)
+{
+    char path[PATH_MAX];
+    size_t dirlen = strlen(dir);
+    DIR *dirp;
+    struct dirent *dent;
+
+    if (snprintf(path, sizeof(path), "%s%s", root, dir) >= sizeof(path) ||
+	!(dirp = opendir(path)))
+	return 0;
+    while ((dent = readdir(dirp))) {
+	const char *name = dent->d_name;
+	if (name[0] == '.' || dent->d_type == DT_DIR)
+	    continue;
+	const char *ext = strrchr(name, '.');
+	if (ext && (!strcmp(ext, ".a") || !strcmp(ext, ".la")))
+	    continue;
+	size_t namelen = strlen(name);
+	if (dirlen + 1 + namelen >= sizeof(path))
+	    continue;
+	memcpy(path, dir, dirlen);
+	path[dirlen] = '/';
+	memcpy(path + dirlen + 1, name, namelen + 1);
+	if (search_add(s, name, namelen, path, dirlen + 1 + namelen, 0)) {
+	    closedir(dirp);
+	    return -1;
+	}
+    }
+    closedir(dirp);
+    return 0;
+}
+
+static int compare_backwards(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)b, *(char *const *)a);
+}
+
+/* The glibc-hwcaps subdirectories of a directory come before it, the
+ * newest level first.  Which the CPU supports can't be known for a
+ * root that may be bound for another machine, so all are taken.
+ */
+static int search_read_hwcaps(library_search *s, const char *root,
+			      const char *dir)
+{
+    char path[PATH_MAX];
+    char *names[64];
+    int count = 0, rc = 0;
+    DIR *dirp;
+    struct dirent *dent;
+
+    if (snprintf(path, sizeof(path), "%s%s/glibc-hwcaps", root, dir) >=
+	sizeof(path) || !(dirp = opendir(path)))
+	return 0;
+    while (count < 64 && (dent = readdir(dirp))) {
+	if (dent->d_name[0] == '.')
+	    continue;
+	if (!(names[count] = strdup(dent->d_name))) {
+	    rc = -1;
+	    break;
+	}
+	count++;
+    }
+    closedir(dirp);
+    qsort(names, count, sizeof(char *), compare_backwards);
+    for (int i = 0; i < count; i++) {
+	if (!rc && snprintf(path, sizeof(path), "%s/glibc-hwcaps/%s",
+			    dir, names[i]) < sizeof(path))
+	    rc = search_read_directory(s, root, path);
+	free(names[i]);
+    }
+    return rc;
+}
+
+static int search_read_directories(lua_State *L, library_search *s,
+				   const char *root, int list)
+{
+    if (!lua_istable(L, list))
+	return 0;
+    for (int i = 1; ; i++) {
+	lua_rawgeti(L, list, i);
+	const char *dir = lua_tostring(L, -1);
+	int rc = dir ? search_read_hwcaps(s, root, dir) : 0;
+	if (!rc && dir)
+	    rc = search_read_directory(s, root, dir);
+	lua_pop(L, 1);
+	if (!dir || rc)
+	    return rc;
+    }
+}
+
+static void search_free(library_search *s)
+{
+    free(s->pool);
+    free(s->entries);
+    free(s->heads);
+    free(s->tails);
+    memset(s, 0, sizeof(*s));
+}
+
+/* library_search(root, configured, trusted) models the loader for the
+ * root, which is '' for /.  configured are the directories of
+ * ld.so.conf, which are only read if there's no usable ld.so.cache;
+ * trusted are the default directories searched after the cache.  Both
+ * are relative to root.
+ */
+LUAFN(library_search)
+{
+    const char *root = luaL_checkstring(L, 1);
+    library_search *s = lua_newuserdata(L, sizeof(library_search));
+
+    memset(s, 0, sizeof(*s));
+    luaL_getmetatable(L, SEARCH_META);
+    lua_setmetatable(L, -2);
+    int rc = search_grow(s);
+    if (!rc && (rc = search_read_cache(s, root)) > 0) {
+	s->cached = 1;
+	rc = 0;
+    } else if (!rc)
+	rc = search_read_directories(L, s, root, 2);
+    if (!rc)
+	rc = search_read_directories(L, s, root, 3);
+    if (rc)
+	return luaL_error(L, "%s", strerror(ENOMEM));
+    return 1;
+}
+
+static library_search *check_search(lua_State *L)
+{
+    library_search *s = luaL_checkudata(L, 1, SEARCH_META);
+    if (!s->slots)
+	luaL_error(L, "Library search is closed");
+    return s;
+}
+
+// search:lookup(name[, class]) returns an array of the paths name may be
+// found at, best first.  Given a class, those known to be of another
+// are left out.
+LUAFN(search_lookup)
+{
+    library_search *s = check_search(L);
+    size_t len;
+    const char *name = luaL_checklstring(L, 2, &len);
+    int class = luaL_optinteger(L, 3, 0);
+    size_t slot = search_slot(s, name, len);
+    int count = 0;
+
+    lua_newtable(L);
+    for (uint32_t i = s->heads[slot]; i != NO_ENTRY; i = s->entries[i].next) {
+	const search_entry *entry = &s->entries[i];
+	if (class && entry->class && entry->class != class)
+	    continue;
+	const char *path = s->pool + entry->path;
+	// The cache and a trusted directory may both have it.
+	int seen = 0;
+	for (uint32_t j = s->heads[slot]; j != i; j = s->entries[j].next)
+	    if (!strcmp(s->pool + s->entries[j].path, path)) {
+		seen = 1;
+		break;
+	    }
+	if (seen)
+	    continue;
+	lua_pushstring(L, path);
+	lua_rawseti(L, -2, ++count);
+    }
+    return 1;
+}
+
+// search:cached() says whether ld.so.cache was used.
+LUAFN(search_cached)
+{
+    lua_pushboolean(L, check_search(L)->cached);
+    return 1;
+}
+
+LUAFN(search_close)
+{
+    search_free(luaL_checkudata(L, 1, SEARCH_META));
+    return 0;
+}
+
+/* Symbol tables check the undefined symbols of objects against the
+ * objects they'd be bound to.  Each object's dynamic symbols are read on
+ * worker threads, then their names are interned, so that each is held
+ * once however many objects use it and names compare as numbers.  A
+ * lookup goes through the provider's .gnu.hash just as the loader's
+ * does: the bloom filter turns most misses away and the hash chain finds
+ * the rest.  Objects with only a DT_HASH get a sorted array instead.
+ */
+#define SYMBOLS_META "elfutil.symbols"
+#define NO_SYMBOL 0xffffffff
+
+typedef struct {
+    int status;			// 1: read, 0: no symbols, -1: error
+    const char *errmsg;
+    int errnum;
+    // The .gnu.hash in host order, or nbuckets zero if there's none.
+    uint32_t nbuckets, symoffset, bloom_size, bloom_shift;
+    int bloom_bits;
+    uint64_t *bloom;
+    uint32_t *buckets, *chain, chained;
+    // For each chain entry, its name, or NO_SYMBOL if it isn't defined.
+    uint32_t *hashed;
+    // Sorted names defined, when there's no .gnu.hash.
+    uint32_t *defined;
+    size_t defined_count, defined_room;
+    // Names of undefined strong symbols.
+    uint32_t *undefined;
+    size_t undefined_count, undefined_room;
+    // Names as read, until they're interned.
+    char *pool;
+    size_t pool_used, pool_size;
+} symbol_object;
+
+typedef struct {
+    uint32_t name, hash;
+} symbol_name;
+
+typedef struct {
+    symbol_object *objects;
+    size_t count;
+    char *pool;
+    size_t used, size;
+    symbol_name *names;
+    size_t name_count, name_room;
+    uint32_t *slots;		// Per slot, a name index or NO_SYMBOL.
+    size_t slot_count;
+} symbol_tables;
+
+static uint32_t gnu_hash(const char *name)
+{
+    uint32_t hash = 5381;
+    for (const unsigned char *c = (const unsigned char *)name; *c; c++)
+	hash = hash * 33 + *c;
+    return hash;
+}
+
+static int symbol_add(uint32_t **array, size_t *count, size_t *room,
+		      uint32_t value)
+{
+    if (*count == *room) {
+	size_t newroom = 2 * *room + 64;
+	uint32_t *newarray = realloc(*array, newroom * sizeof(uint32_t));
+	if (!newarray)
+	    return -1;
+	*array = newarray;
+	*room = newroom;
+    }
+    (*array)[(*count)++] = value;
+    return 0;
+}
+
+// Pool the name at offset in the string table.  Returns its offset in
+// the pool, or NO_SYMBOL if memory ran out.
+static uint32_t object_name(symbol_object *o, const char *strtab,
+			    size_t strsz, uint64_t offset)
+{
+    const char *name = offset < strsz ? strtab + offset : "";
+    size_t len = offset < strsz ? strnlen(name, strsz - offset) : 0;
+
+    if (o->pool_used + len + 1 > o->pool_size) {
+	size_t newsize = 2 * o->pool_size + len + 4096;
+	char *newpool = realloc(o->pool, newsize);
+	if (!newpool || newsize >= NO_SYMBOL)
+	    return NO_SYMBOL;
+	o->pool = newpool;
+	o->pool_size = newsize;
+    }
+    uint32_t at = o->pool_used;
+    memcpy(o->pool + at, name, len);
+    o->pool[at + len] = 0;
+    o->pool_used += len + 1;
+    return at;
+}
+
+static void object_free(symbol_object *o)
+{
+    free(o->bloom);
+    free(o->buckets);
+    free(o->hashed);
+    free(o->defined);
+    free(o->undefined);
+    free(o->pool);
+    memset(o, 0, sizeof(*o));
+}
+
+// Copy the .gnu.hash at offset into host order, and count the symbols
+// it covers.  Returns 0, 1 if it's malformed, or -1 if out of memory.
+static int read_gnu_hash(const elf_image *elf, uint64_t offset,
+			 symbol_object *o, uint64_t *symbols)
+{
+    if (!elf_has(elf, offset, 16))
+	return 1;
+    o->nbuckets = elf_get(elf, offset, 4);
+    o->symoffset = elf_get(elf, offset + 4, 4);
+    o->bloom_size = elf_get(elf, offset + 8, 4);
+    o->bloom_shift = elf_get(elf, offset + 12, 4);
+    o->bloom_bits = elf->wide ? 64 : 32;
+    int word = o->bloom_bits / 8;
+    uint64_t bloom = offset + 16;
+    uint64_t buckets = bloom + (uint64_t)o->bloom_size * word;
+    uint64_t chain = buckets + 4 * (uint64_t)o->nbuckets;
+    if (!o->nbuckets || !o->bloom_size ||
+	(o->bloom_size & (o->bloom_size - 1)) ||
+	!elf_has(elf, bloom, chain - bloom))
+	return 1;
+
+    // The chain runs from symoffset to the end of the last bucket's.
+    uint32_t last = 0;
+    for (uint32_t i = 0; i < o->nbuckets; i++) {
+	uint32_t start = elf_get(elf, buckets + 4 * i, 4);
+	if (start > last)
+	    last = start;
+    }
+    uint64_t count = 0;
+    if (last >= o->symoffset) {
+	for (;;) {
+	    uint64_t at = chain + 4 * (last - o->symoffset + count);
+	    if (!elf_has(elf, at, 4))
+		return 1;
+	    count++;
+	    if (elf_get(elf, at, 4) & 1)
+		break;
+	}
+    }
+    o->chained = last >= o->symoffset ? last - o->symoffset + count : 0;
+    o->bloom = malloc(o->bloom_size * sizeof(uint64_t));
+    o->buckets = malloc(((uint64_t)o->nbuckets + o->chained + 1) *
+			sizeof(uint32_t));
+    if (!o->bloom || !o->buckets)
+	return -1;
+    for (uint32_t i = 0; i < o->bloom_size; i++)
+	o->bloom[i] = elf_get(elf, bloom + i * word, word);
+    o->chain = o->buckets + o->nbuckets;
+    for (uint64_t i = 0; i < o->nbuckets + o->chained; i++)
+	o->buckets[i] = elf_get(elf, buckets + 4 * i, 4);
+    *symbols = o->symoffset + o->chained;
+    if (!(o->hashed = malloc((o->chained + 1) * sizeof(uint32_t))))
+	return -1;
+    for (uint32_t i = 0; i < o->chained; i++)
+	o->hashed[i] = NO_SYMBOL;
+    return 0;
+}
+
+/* Read the dynamic symbols of an image.  Strong undefined symbols are
+ * wanted, as weak ones may go unresolved.  Defined symbols are found
+ * through the .gnu.hash, when there's one.  Thread safe.
+ */
+static void read_object(const char *image, size_t size, symbol_object *o)
+{
+    elf_image elf = { (const unsigned char *)image, size, 0, 0 };
+    elf_table phdrs;
+
+    memset(o, 0, sizeof(*o));
+    if (size < EI_NIDENT || memcmp(image, ELFMAG, SELFMAG))
+	return;
+    if ((o->errmsg = elf_identify(&elf)) ||
+	(o->errmsg = elf_program_headers(&elf, &phdrs)))
+	goto bugout;
+
+    uint64_t dynamic = 0, dynamic_size = 0;
+    for (uint64_t i = 0; i < phdrs.count; i++) {
+	uint64_t phdr = phdrs.offset + i * phdrs.size;
+	if (elf_get(&elf, phdr, 4) == PT_DYNAMIC) {
+	    dynamic = elf_word(&elf, phdr + (elf.wide ? 8 : 4));
+	    dynamic_size = elf_word(&elf, phdr + (elf.wide ? 32 : 16));
+	    break;
+	}
+    }
+    if (!elf_has(&elf, dynamic, dynamic_size))
+	goto truncated;
+
+    size_t dyn_size = elf.wide ? 16 : 8;
+    uint64_t none = ~(uint64_t)0;
+    uint64_t strtab = none, strsz = 0, symtab = none, gnu_hash = none;
+    uint64_t hash = none, syment = elf.wide ? 24 : 16;
+    for (uint64_t i = 0; i < dynamic_size / dyn_size; i++) {
+	uint64_t entry = dynamic + i * dyn_size;
+	uint64_t tag = elf_word(&elf, entry);
+	uint64_t value = elf_word(&elf, entry + dyn_size / 2);
+	if (tag == DT_NULL)
+	    break;
+	switch (tag) {
+	case DT_STRTAB:
+	    strtab = elf_offset(&elf, &phdrs, value);
+	    break;
+	case DT_STRSZ:
+	    strsz = value;
+	    break;
+	case DT_SYMTAB:
+	    symtab = elf_offset(&elf, &phdrs, value);
+	    break;
+	case DT_SYMENT:
+	    syment = value;
+	    break;
+	case DT_HASH:
+	    hash = elf_offset(&elf, &phdrs, value);
+	    break;
+	case DT_GNU_HASH:
+	    gnu_hash = elf_offset(&elf, &phdrs, value);
+	    break;
+	}
+    }
+    if (strtab == none || symtab == none)
+	return;
+    if (!elf_has(&elf, strtab, strsz) || syment < (elf.wide ? 24 : 16))
+	goto truncated;
+
+    uint64_t symbols = 0;
+    int rc;
+    if (gnu_hash != none) {
+	if ((rc = read_gnu_hash(&elf, gnu_hash, o, &symbols)) < 0)
+	    goto nomem;
+	if (rc)
+	    goto truncated;
+    } else if (hash != none) {
+	// nchain is the count of symbols.
+	if (!elf_has(&elf, hash, 8))
+	    goto truncated;
+	symbols = elf_get(&elf, hash + 4, 4);
+    } else
+	return;
+    if (symbols > size / syment || !elf_has(&elf, symtab, symbols * syment))
+	goto truncated;
+
+    const char *names = image + strtab;
+    for (uint64_t i = 1; i < symbols; i++) {
+	uint64_t sym = symtab + i * syment;
+	uint32_t name = elf_get(&elf, sym, 4);
+	int info = elf.image[sym + (elf.wide ? 4 : 12)];
+	int other = elf.image[sym + (elf.wide ? 5 : 13)];
+	int shndx = elf_get(&elf, sym + (elf.wide ? 6 : 14), 2);
+	int bind = ELF64_ST_BIND(info);
+	int visible = ELF64_ST_VISIBILITY(other) == STV_DEFAULT ||
+	    ELF64_ST_VISIBILITY(other) == STV_PROTECTED;
+	uint32_t at;
+	if (!name)
+	    continue;
+	if (shndx == SHN_UNDEF) {
+	    if (bind != STB_GLOBAL)
+		continue;
+	    if ((at = object_name(o, names, strsz, name)) == NO_SYMBOL ||
+		symbol_add(&o->undefined, &o->undefined_count,
+			   &o->undefined_room, at))
+		goto nomem;
+	} else if (!visible || (bind != STB_GLOBAL && bind != STB_WEAK &&
+				bind != STB_GNU_UNIQUE))
+	    continue;
+	else if (o->nbuckets) {
+	    if (i < o->symoffset)
+		continue;
+	    if ((at = object_name(o, names, strsz, name)) == NO_SYMBOL)
+		goto nomem;
+	    o->hashed[i - o->symoffset] = at;
+	} else if ((at = object_name(o, names, strsz, name)) == NO_SYMBOL ||
+		   symbol_add(&o->defined, &o->defined_count,
+			      &o->defined_room, at))
+	    goto nomem;
+    }
+    o->status = 1;
+    return;
+
+truncated:
+    o->errmsg = "Truncated ELF";
+    goto bugout;
+nomem:
+    o->errnum = ENOMEM;
+bugout:
+    ;
+    const char *errmsg = o->errmsg;
+    int errnum = o->errnum;
+    object_free(o);
+    o->status = -1;
+    o->errmsg = errmsg;
+    o->errnum = errnum;
+}
+
+static void read_object_file(const char *path, symbol_object *o)
+{
+    struct stat statb;
+    void *map;
+    int fd;
+
+    memset(o, 0, sizeof(*o));
+    if ((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &statb)) {
+	o->errnum = errno;
+	o->status = -1;
+	if (fd >= 0)
+	    close(fd);
+	return;
+    }
+    if (!S_ISREG(statb.st_mode) || statb.st_size < SELFMAG) {
+	close(fd);
+	return;
+    }
+    map = mmap(NULL, statb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+	o->errnum = errno;
+	o->status = -1;
+	return;
+    }
+    read_object(map, statb.st_size, o);
+    munmap(map, statb.st_size);
+}
+
+// The slot for a name: either its own, or the empty one it would take.
+static size_t symbol_slot(symbol_tables *t, const char *name, uint32_t hash)
+{
+    size_t slot = hash & (t->slot_count - 1);
+
+    while (t->slots[slot] != NO_SYMBOL) {
+	const symbol_name *other = &t->names[t->slots[slot]];
+	if (other->hash == hash && !strcmp(t->pool + other->name, name))
+	    break;
+	slot = (slot + 1) & (t->slot_count - 1);
+    }
+    return slot;
+}
+
+static int symbol_grow(symbol_tables *t)
+{
+    size_t count = t->slot_count ? 2 * t->slot_count : 65536;
+    uint32_t *slots = malloc(count * sizeof(uint32_t));
+
+    if (!slots)
+	return -1;
+    memset(slots, 0xff, count * sizeof(uint32_t));
+    free(t->slots);
+    t->slots = slots;
+    t->slot_count = count;
+    for (size_t i = 0; i < t->name_count; i++) {
+	const symbol_name *name = &t->names[i];
+	t->slots[symbol_slot(t, t->pool + name->name, name->hash)] = i;
+    }
+    return 0;
+}
+
+// The number for a name, or NO_SYMBOL if memory ran out.
+static uint32_t symbol_intern(symbol_tables *t, const char *name)
+{
+    uint32_t hash = gnu_hash(name);
+    size_t slot = symbol_slot(t, name, hash);
+
+    if (t->slots[slot] != NO_SYMBOL)
+	return t->slots[slot];
+    if (2 * (t->name_count + 1) > t->slot_count) {
+	if (symbol_grow(t))
+	    return NO_SYMBOL;
+	slot = symbol_slot(t, name, hash);
+    }
+    if (t->name_count == t->name_room) {
+	size_t room = 2 * t->name_room + 65536;
+	symbol_name *names = realloc(t->names, room * sizeof(symbol_name));
+	if (!names || room >= NO_SYMBOL)
+	    return NO_SYMBOL;
+	t->names = names;
+	t->name_room = room;
+    }
+    size_t len = strlen(name);
+    if (t->used + len + 1 > t->size) {
+	size_t size = t->size ? t->size : 1 << 20;
+	while (t->used + len + 1 > size)
+	    size *= 2;
+	char *pool = realloc(t->pool, size);
+	if (!pool || size >= NO_SYMBOL)
+	    return NO_SYMBOL;
+	t->pool = pool;
+	t->size = size;
+    }
+    memcpy(t->pool + t->used, name, len + 1);
+    t->names[t->name_count] = (symbol_name) { t->used, hash };
+    t->used += len + 1;
+    t->slots[slot] = t->name_count;
+    return t->name_count++;
+}
+
+static int compare_names(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Replace the pool offsets of an object's names with their numbers.
+// Returns 0, or -1 if memory ran out.
+static int intern_object(symbol_tables *t, symbol_object *o)
+{
+    for (uint32_t i = 0; i < o->chained; i++)
+	if (o->hashed[i] != NO_SYMBOL &&
+	    (o->hashed[i] = symbol_intern(t, o->pool + o->hashed[i]))
+	    == NO_SYMBOL)
+	    return -1;
+    for (size_t i = 0; i < o->defined_count; i++)
+	if ((o->defined[i] = symbol_intern(t, o->pool + o->defined[i]))
+	    == NO_SYMBOL)
+	    return -1;
+    qsort(o->defined, o->defined_count, sizeof(uint32_t), compare_names);
+    for (size_t i = 0; i < o->undefined_count; i++)
+	if ((o->undefined[i] = symbol_intern(t, o->pool + o->undefined[i]))
+	    == NO_SYMBOL)
+	    return -1;
+    free(o->pool);
+    o->pool = NULL;
+    o->pool_used = o->pool_size = 0;
+    return 0;
+}
+
+// Whether the object defines the name, going by its .gnu.hash as
+// the loader would.
+static int symbol_defined(const symbol_tables *t, const symbol_object *o,
+			  uint32_t name)
+{
+    if (!o->nbuckets)
+	return bsearch(&name, o->defined, o->defined_count, sizeof(uint32_t),
+		       compare_names) != NULL;
+
+    uint32_t hash = t->names[name].hash;
+    uint32_t bits = o->bloom_bits;
+    uint64_t word = o->bloom[(hash / bits) & (o->bloom_size - 1)];
+    uint64_t mask = (uint64_t)1 << (hash % bits) |
+	(uint64_t)1 << ((hash >> o->bloom_shift) % bits);
+    if ((word & mask) != mask)
+	return 0;
+    uint32_t i = o->buckets[hash % o->nbuckets];
+    if (i < o->symoffset)
+	return 0;
+    for (i -= o->symoffset;; i++) {
+	uint32_t chain = o->chain[i];
+	if ((chain | 1) == (hash | 1) && o->hashed[i] == name)
+	    return 1;
+	if (chain & 1)
+	    return 0;
+    }
+}
+
+static void tables_free(symbol_tables *t)
+{
+    for (size_t i = 0; i < t->count; i++)
+	object_free(&t->objects[i]);
+    free(t->objects);
+    free(t->pool);
+    free(t->names);
+    free(t->slots);
+    memset(t, 0, sizeof(*t));
+}
+
+struct symbol_batch {
+    const char **paths;
+    symbol_object *objects;
+};
+
+static void symbol_batch_item(void *context, size_t index)
+{
+    struct symbol_batch *batch = context;
+
+    read_object_file(batch->paths[index], &batch->objects[index]);
+}
+
+/* read_symbols(paths[, options]) reads the dynamic symbols of each path
+ * on worker threads, as scan_many does.  Returns the symbol tables, and
+ * a table of error messages for the paths that couldn't be read.
+ */
+LUAFN(read_symbols)
+{
+    luaL_checktype(L, 1, LUA_TTABLE);
+    int threads = 0;
+    if (lua_istable(L, 2)) {
+	lua_getfield(L, 2, "threads");
+	threads = lua_tointeger(L, -1);
+	lua_pop(L, 1);
+    }
+    size_t count = lua_objlen(L, 1);
+    symbol_tables *t = lua_newuserdata(L, sizeof(symbol_tables));
+    memset(t, 0, sizeof(*t));
+    luaL_getmetatable(L, SYMBOLS_META);
+    lua_setmetatable(L, -2);
+
+    struct symbol_batch batch;
+    batch.paths = malloc((count + 1) * sizeof(char *));
+    t->objects = calloc(count + 1, sizeof(symbol_object));
+    if (!batch.paths || !t->objects) {
+	free(batch.paths);
+	return luaL_error(L, "%s", strerror(ENOMEM));
+    }
+    t->count = count;
+    batch.objects = t->objects;
+    for (size_t i = 0; i < count; i++) {
+	lua_rawgeti(L, 1, i + 1);
+	batch.paths[i] = lua_tostring(L, -1);
+	lua_pop(L, 1);
+	if (!batch.paths[i]) {
+	    free(batch.paths);
+	    return luaL_argerror(L, 1, "paths must be strings");
+	}
+    }
+    int rc = pool_run(count, threads, symbol_batch_item, &batch);
+    free(batch.paths);
+    if (rc) {
+	lua_pushnil(L);
+	lua_pushstring(L, "Can't start symbol reading threads");
+	return 2;
+    }
+
+    if (symbol_grow(t))
+	return luaL_error(L, "%s", strerror(ENOMEM));
+    lua_newtable(L);
+    for (size_t i = 0; i < count; i++) {
+	symbol_object *o = &t->objects[i];
+	if (o->status > 0 && intern_object(t, o))
+	    return luaL_error(L, "%s", strerror(ENOMEM));
+	if (o->status < 0) {
+	    lua_pushstring(L, o->errmsg ? o->errmsg : strerror(o->errnum));
+	    lua_rawseti(L, -2, i + 1);
+	}
+    }
+    return 2;
+}
+
+static symbol_tables *check_symbols(lua_State *L)
+{
+    symbol_tables *t = luaL_checkudata(L, 1, SYMBOLS_META);
+    if (!t->slots)
+	luaL_error(L, "Symbol tables are closed");
+    return t;
+}
+
+static const symbol_object *check_object(lua_State *L, symbol_tables *t,
+					 int index, int arg)
+{
+    if (index < 1 || index > t->count)
+	luaL_argerror(L, arg, "no such object");
+    return &t->objects[index - 1];
+}
+
+/* symbols:unresolved(object, scope) gives the names of the undefined
+ * symbols of the object, numbered as in read_symbols' paths, which no
+ * object in the scope defines.  The scope is an array of object numbers
+ * in the order the loader searches them.
+ */
+LUAFN(symbols_unresolved)
+{
+    symbol_tables *t = check_symbols(L);
+    const symbol_object *o = check_object(L, t, luaL_checkinteger(L, 2), 2);
+    luaL_checktype(L, 3, LUA_TTABLE);
+    size_t scope_count = lua_objlen(L, 3);
+    const symbol_object **scope =
+	lua_newuserdata(L, (scope_count + 1) * sizeof(symbol_object *));
+
+    for (size_t i = 0; i < scope_count; i++) {
+	lua_rawgeti(L, 3, i + 1);
+	scope[i] = check_object(L, t, lua_tointeger(L, -1), 3);
+	lua_pop(L, 1);
+    }
+    lua_newtable(L);
+    int results = 0;
+    for (size_t i = 0; i < o->undefined_count; i++) {
+	uint32_t name = o->undefined[i];
+	size_t j;
+	for (j = 0; j < scope_count; j++)
+	    if (symbol_defined(t, scope[j], name))
+		break;
+	if (j == scope_count) {
+	    lua_pushstring(L, t->pool + t->names[name].name);
+	    lua_rawseti(L, -2, ++results);
+	}
+    }
+    return 1;
+}
+
+// symbols:count() gives the count of objects and of distinct names.
+LUAFN(symbols_count)
+{
+    symbol_tables *t = check_symbols(L);
+    lua_pushinteger(L, t->count);
+    lua_pushinteger(L, t->name_count);
+    return 2;
+}
+
+LUAFN(symbols_close)
+{
+    tables_free(luaL_checkudata(L, 1, SYMBOLS_META));
+    return 0;
+}
+
+/* An archive core keeps track of the needs of an archive set's ELF
+ * objects that nothing in the set satisfies, as packages come and go.
+ * Sonames and paths are interned as keys, and each need is worked out
+ * once, when its object arrives, as the keys that would satisfy it: the
+ * bare name (a soname in a standard directory), and the name in each
+ * RUNPATH or RPATH directory with $ORIGIN expanded, and in each standard
+ * directory.  Each key counts its providers and lists the needs waiting
+ * on it, so adding or removing a package only touches what it provides
+ * and needs, however large the set.  The object tables are kept in the
+ * userdata's environment, by object number.
+ */
+#define CORE_META "elfutil.archive_core"
+#define NEED_UNRESOLVED 1
+#define NEED_EXTERNAL 2
+#define NEED_GONE 4
+
+typedef struct {
+    void *data;
+    size_t count, room;
+} vec;
+
+// Append a zeroed element of size bytes, or return NULL if out of memory.
+static void *vec_push(vec *v, size_t size)
+{
+    if (v->count == v->room) {
+	size_t room = 2 * v->room + 64;
+	void *data = realloc(v->data, room * size);
+	if (!data)
+	    return NULL;
+	v->data = data;
+	v->room = room;
+    }
+    void *element = (char *)v->data + v->count++ * size;
+    memset(element, 0, size);
+    return element;
+}
+
+static int vec_copy(vec *to, const vec *from, size_t size)
+{
+    to->count = to->room = 0;
+    if (!(to->data = malloc((from->room + 1) * size)))
+	return -1;
+    memcpy(to->data, from->data, from->count * size);
+    to->count = from->count;
+    to->room = from->room;
+    return 0;
+}
+
+#define VEC_AT(v, type, i) (((type *)(v).data)[i])
+
+typedef struct {
+    uint32_t name, hash;	// Name is an offset into the pool.
+    uint32_t providers;
+    uint32_t waiting;		// An entry, or NO_ENTRY.
+} core_key;
+
+// A need waiting on a key.
+typedef struct {
+    uint32_t need, key, next;
+} core_entry;
+
+typedef struct {
+    uint32_t object, name;	// Object number, and key of the name.
+    uint32_t satisfied;		// Count of keys with providers.
+    uint32_t flags;
+    uint32_t first_entry, entries;
+} core_need;
+
+typedef struct {
+    uint32_t first_object, objects;
+    uint32_t first_need, needs;
+    uint32_t first_provide, provides;
+    int gone;
+} core_package;
+
+typedef struct {
+    char *pool;
+    size_t used, size;
+    vec keys, entries, needs, packages, provides, standard;
+    uint32_t objects;
+    size_t gone;		// Needs of packages removed.
+    uint32_t *slots;		// Per slot, a key or NO_ENTRY.
+    size_t slot_count;
+} archive_core;
+
+static size_t core_slot(archive_core *c, const char *name, size_t len,
+			uint32_t hash)
+{
+    size_t slot = hash & (c->slot_count - 1);
+
+    while (c->slots[slot] != NO_ENTRY) {
+	const core_key *key = &VEC_AT(c->keys, core_key, c->slots[slot]);
+	const char *other = c->pool + key->name;
+	if (key->hash == hash && !strncmp(other, name, len) && !other[len])
+	    break;
+	slot = (slot + 1) & (c->slot_count - 1);
+    }
+    return slot;
+}
+
+static int core_grow(archive_core *c)
+{
+    size_t count = c->slot_count ? 2 * c->slot_count : 4096;
+    uint32_t *slots = malloc(count * sizeof(uint32_t));
+
+    if (!slots)
+	return -1;
+    memset(slots, 0xff, count * sizeof(uint32_t));
+    free(c->slots);
+    c->slots = slots;
+    c->slot_count = count;
+    for (size_t i = 0; i < c->keys.count; i++) {
+	const core_key *key = &VEC_AT(c->keys, core_key, i);
+	const char *name = c->pool + key->name;
+	c->slots[core_slot(c, name, strlen(name), key->hash)] = i;
+    }
+    return 0;
+}
+
+// The key for a name, added if need be.  Returns NO_ENTRY if memory
+// ran out.
+static uint32_t core_intern(archive_core *c, const char *name, size_t len)
+{
+    uint32_t hash = search_hash(name, len);
+    size_t slot = core_slot(c, name, len, hash);
+
+    if (c->slots[slot] != NO_ENTRY)
+	return c->slots[slot];
+    if (2 * (c->keys.count + 1) > c->slot_count) {
+	if (core_grow(c))
+	    return NO_ENTRY;
+	slot = core_slot(c, name, len, hash);
+    }
+    if (c->used + len + 1 > c->size) {
+	size_t size = c->size ? c->size : 65536;
+	while (c->used + len + 1 > size)
+	    size *= 2;
+	char *pool = realloc(c->pool, size);
+	if (!pool || size >= NO_ENTRY)
+	    return NO_ENTRY;
+	c->pool = pool;
+	c->size = size;
+    }
+    core_key *key = vec_push(&c->keys, sizeof(core_key));
+    if (!key)
+	return NO_ENTRY;
+    memcpy(c->pool + c->used, name, len);
+    c->pool[c->used + len] = 0;
+    key->name = c->used;
+    key->hash = hash;
+    key->waiting = NO_ENTRY;
+    c->used += len + 1;
+    c->slots[slot] = c->keys.count - 1;
+    return c->slots[slot];
+}
+
+// Add { object, name, unresolved } to the changes.  The core's
+// environment is at index env, and the changes table just above it.
+static void core_change(lua_State *L, archive_core *c, int env,
+			const core_need *need, int unresolved)
+{
+    lua_createtable(L, 3, 0);
+    lua_rawgeti(L, env, need->object);
+    lua_rawseti(L, -2, 1);
+    lua_pushstring(L, c->pool + VEC_AT(c->keys, core_key, need->name).name);
+    lua_rawseti(L, -2, 2);
+    lua_pushboolean(L, unresolved);
+    lua_rawseti(L, -2, 3);
+    lua_rawseti(L, env + 1, lua_objlen(L, env + 1) + 1);
+}
+
+/* Count a provider of key.  The needs waiting on a key that had none
+ * become satisfied.  Needs of objects gone are dropped from the list on
+ * the way past.
+ */
+static void core_provide(lua_State *L, archive_core *c, int env,
+			 uint32_t k, int delta)
+{
+    core_key *key = &VEC_AT(c->keys, core_key, k);
+
+    key->providers += delta;
+    if (key->providers != (delta > 0 ? 1 : 0))
+	return;
+    uint32_t *link = &key->waiting;
+    while (*link != NO_ENTRY) {
+	core_entry *entry = &VEC_AT(c->entries, core_entry, *link);
+	core_need *need = &VEC_AT(c->needs, core_need, entry->need);
+	if (need->flags & NEED_GONE) {
+	    *link = entry->next;
+	    continue;
+	}
+	link = &entry->next;
+	need->satisfied += delta;
+	if (need->flags & NEED_EXTERNAL)
+	    continue;
+	if (delta > 0 && need->satisfied == 1 &&
+	    (need->flags & NEED_UNRESOLVED)) {
+	    need->flags &= ~NEED_UNRESOLVED;
+	    core_change(L, c, env, need, 0);
+	} else if (delta < 0 && need->satisfied == 0) {
+	    need->flags |= NEED_UNRESOLVED;
+	    core_change(L, c, env, need, 1);
+	}
+    }
+}
+
+static void core_nomem(lua_State *L)
+{
+    luaL_error(L, "%s", strerror(ENOMEM));
+}
+
+// Record that the package provides name, and count it.
+static void core_add_provide(lua_State *L, archive_core *c, int env,
+			     core_package *package, const char *name,
+			     size_t len)
+{
+    uint32_t k = core_intern(c, name, len);
+    uint32_t *provide = vec_push(&c->provides, sizeof(uint32_t));
+
+    if (k == NO_ENTRY || !provide)
+	core_nomem(L);
+    *provide = k;
+    package->provides++;
+    core_provide(L, c, env, k, 1);
+}
+
+// Add key to the need, unless it's there already.
+static void core_need_key(lua_State *L, archive_core *c, uint32_t n,
+			  const char *name, size_t len)
+{
+    uint32_t k = core_intern(c, name, len);
+    if (k == NO_ENTRY)
+	core_nomem(L);
+    core_key *key = &VEC_AT(c->keys, core_key, k);
+    // A need's keys are added together, so a repeat would be first.
+    if (key->waiting != NO_ENTRY &&
+	VEC_AT(c->entries, core_entry, key->waiting).need == n)
+	return;
+    core_entry *entry = vec_push(&c->entries, sizeof(core_entry));
+    if (!entry)
+	core_nomem(L);
+    entry->need = n;
+    entry->key = k;
+    entry->next = key->waiting;
+    key->waiting = c->entries.count - 1;
+    core_need *need = &VEC_AT(c->needs, core_need, n);
+    need->entries++;
+    if (key->providers)
+	need->satisfied++;
+}
+
+// Expand $ORIGIN and $LIB in a search directory, and make it absolute.
+// Returns 0, or -1 if it won't fit or can't be made absolute.
+static int core_expand(const char *dir, const char *origin, int class,
+		       char *out, size_t outlen)
+{
+    char expanded[PATH_MAX];
+    size_t len = 0;
+
+    while (*dir) {
+	const char *value = NULL;
+	size_t skip = 0;
+	if (!strncmp(dir, "$ORIGIN", 7) || !strncmp(dir, "${ORIGIN}", 9)) {
+	    value = origin;
+	    skip = dir[1] == '{' ? 9 : 7;
+	} else if (!strncmp(dir, "$LIB", 4) || !strncmp(dir, "${LIB}", 6)) {
+	    value = class == 32 ? "lib" : "lib64";
+	    skip = dir[1] == '{' ? 6 : 4;
+	}
+	if (value) {
+	    size_t valuelen = strlen(value);
+	    if (len + valuelen >= sizeof(expanded))
+		return -1;
+	    memcpy(expanded + len, value, valuelen);
+	    len += valuelen;
+	    dir += skip;
+	} else {
+	    if (len + 1 >= sizeof(expanded))
+		return -1;
+	    expanded[len++] = *dir++;
+	}
+    }
+    expanded[len] = 0;
+    // Relative directories depend on where the program is run from.
+    if (*expanded != '/')
+	return -1;
+    return normalize_path("/", expanded, out, outlen);
+}
+
+// Add the needs of the object table on top, numbered object.
+static void core_add_needs(lua_State *L, archive_core *c, int env,
+			   core_package *package, uint32_t object)
+{
+    char origin[PATH_MAX], dir[PATH_MAX], path[PATH_MAX];
+
+    lua_getfield(L, -1, "path");
+    const char *elfpath = lua_tostring(L, -1);
+    snprintf(origin, sizeof(origin), "%s", elfpath ? elfpath : "/");
+    char *slash = strrchr(origin, '/');
+    if (slash)
+	*slash = 0;
+    lua_pop(L, 1);
+    lua_getfield(L, -1, "class");
+    int class = lua_tointeger(L, -1);
+    lua_pop(L, 1);
+    // RUNPATH, if there is one, hides RPATH.
+    lua_getfield(L, -1, "runpath");
+    if (!lua_istable(L, -1)) {
+	lua_pop(L, 1);
+	lua_getfield(L, -1, "rpath");
+    }
+    int searched = lua_gettop(L);
+    lua_getfield(L, -2, "needed");
+    int needed = lua_gettop(L);
+    int count = lua_istable(L, needed) ? lua_objlen(L, needed) : 0;
+
+    for (int i = 1; i <= count; i++) {
+	lua_rawgeti(L, needed, i);
+	size_t namelen;
+	const char *name = lua_tolstring(L, -1, &namelen);
+	if (!name) {
+	    lua_pop(L, 1);
+	    continue;
+	}
+	core_need *need = vec_push(&c->needs, sizeof(core_need));
+	if (!need || (need->name = core_intern(c, name, namelen)) == NO_ENTRY)
+	    core_nomem(L);
+	need->object = object;
+	need->first_entry = c->entries.count;
+	package->needs++;
+	uint32_t n = c->needs.count - 1;
+	if (strchr(name, '/')) {
+	    // A path, which is all that's tried.
+	    if (*name == '/' &&
+		!normalize_path("/", name, path, sizeof(path)))
+		core_need_key(L, c, n, path, strlen(path));
+	} else {
+	    core_need_key(L, c, n, name, namelen);
+	    int dirs = lua_istable(L, searched) ? lua_objlen(L, searched) : 0;
+	    for (int j = 1; j <= dirs; j++) {
+		lua_rawgeti(L, searched, j);
+		const char *entry = lua_tostring(L, -1);
+		if (entry &&
+		    !core_expand(entry, origin, class, dir, sizeof(dir)) &&
+		    snprintf(path, sizeof(path), "%s/%s",
+			     strcmp(dir, "/") ? dir : "", name) <
+		    sizeof(path))
+		    core_need_key(L, c, n, path, strlen(path));
+		lua_pop(L, 1);
+	    }
+	    for (size_t j = 0; j < c->standard.count; j++) {
+		uint32_t k = VEC_AT(c->standard, uint32_t, j);
+		const char *std = c->pool + VEC_AT(c->keys, core_key, k).name;
+		if (snprintf(path, sizeof(path), "%s/%s", std, name) <
+		    sizeof(path))
+		    core_need_key(L, c, n, path, strlen(path));
+	    }
+	}
+	need = &VEC_AT(c->needs, core_need, n);
+	if (!need->satisfied) {
+	    need->flags |= NEED_UNRESOLVED;
+	    core_change(L, c, env, need, 1);
+	}
+	lua_pop(L, 1);
+    }
+    lua_settop(L, searched - 1);
+}
+
+// Whether the directory of path is a standard one.
+static int core_standard(archive_core *c, const char *path)
+{
+    const char *slash = strrchr(path, '/');
+    if (!slash)
+	return 0;
+    size_t len = slash - path;
+    for (size_t i = 0; i < c->standard.count; i++) {
+	uint32_t k = VEC_AT(c->standard, uint32_t, i);
+	const char *std = c->pool + VEC_AT(c->keys, core_key, k).name;
+	if (!strncmp(std, path, len) && !std[len])
+	    return 1;
+    }
+    return 0;
+}
+
+/* Drop the needs and provides of the packages removed, the entries of
+ * those needs, and the keys nothing refers to any more.  The lists of
+ * needs waiting on each key keep their order.  Returns 0, or -1 if
+ * memory ran out, leaving the core as it was.
+ */
+static int core_compact(archive_core *c)
+{
+    uint32_t *key_map = malloc((c->keys.count + 1) * sizeof(uint32_t));
+    uint32_t *need_map = malloc((c->needs.count + 1) * sizeof(uint32_t));
+    uint32_t *entry_map = malloc((c->entries.count + 1) * sizeof(uint32_t));
+    core_key *keys = malloc((c->keys.count + 1) * sizeof(core_key));
+    core_need *needs = malloc((c->needs.count + 1) * sizeof(core_need));
+    core_entry *entries =
+	malloc((c->entries.count + 1) * sizeof(core_entry));
+    uint32_t *provides = malloc((c->provides.count + 1) * sizeof(uint32_t));
+    char *pool = malloc(c->used + 1);
+
+    if (!key_map || !need_map || !entry_map || !keys || !needs ||
+	!entries || !provides || !pool) {
+	free(key_map);
+	free(need_map);
+	free(entry_map);
+	free(keys);
+	free(needs);
+	free(entries);
+	free(provides);
+	free(pool);
+	return -1;
+    }
+    memset(key_map, 0xff, c->keys.count * sizeof(uint32_t));
+    memset(need_map, 0xff, c->needs.count * sizeof(uint32_t));
+    memset(entry_map, 0xff, c->entries.count * sizeof(uint32_t));
+
+    // Mark the keys still referred to, then number them afresh.
+    for (size_t i = 0; i < c->standard.count; i++)
+	key_map[VEC_AT(c->standard, uint32_t, i)] = 0;
+    for (size_t i = 0; i < c->packages.count; i++) {
+	const core_package *package =
+	    &VEC_AT(c->packages, core_package, i);
+	for (uint32_t j = 0; !package->gone && j < package->provides; j++)
+	    key_map[VEC_AT(c->provides, uint32_t,
+			   package->first_provide + j)] = 0;
+    }
+    for (size_t i = 0; i < c->needs.count; i++) {
+	const core_need *need = &VEC_AT(c->needs, core_need, i);
+	if (need->flags & NEED_GONE)
+	    continue;
+	key_map[need->name] = 0;
+	for (uint32_t j = 0; j < need->entries; j++)
+	    key_map[VEC_AT(c->entries, core_entry,
+			   need->first_entry + j).key] = 0;
+    }
+    size_t key_count = 0, used = 0;
+    for (size_t i = 0; i < c->keys.count; i++) {
+	if (key_map[i] == NO_ENTRY)
+	    continue;
+	const core_key *key = &VEC_AT(c->keys, core_key, i);
+	size_t len = strlen(c->pool + key->name);
+	memcpy(pool + used, c->pool + key->name, len + 1);
+	keys[key_count] = *key;
+	keys[key_count].name = used;
+	keys[key_count].waiting = NO_ENTRY;
+	key_map[i] = key_count++;
+	used += len + 1;
+    }
+
+    // The needs left, each with its entries together as before.
+    size_t need_count = 0, entry_count = 0;
+    for (size_t i = 0; i < c->needs.count; i++) {
+	const core_need *need = &VEC_AT(c->needs, core_need, i);
+	if (need->flags & NEED_GONE)
+	    continue;
+	need_map[i] = need_count;
+	needs[need_count] = *need;
+	needs[need_count].name = key_map[need->name];
+	needs[need_count].first_entry = entry_count;
+	for (uint32_t j = 0; j < need->entries; j++) {
+	    const core_entry *entry =
+		&VEC_AT(c->entries, core_entry, need->first_entry + j);
+	    entry_map[need->first_entry + j] = entry_count;
+	    entries[entry_count].need = need_count;
+	    entries[entry_count].key = key_map[entry->key];
+	    entries[entry_count++].next = NO_ENTRY;
+	}
+	need_count++;
+    }
+    for (size_t i = 0; i < c->keys.count; i++) {
+	if (key_map[i] == NO_ENTRY)
+	    continue;
+	uint32_t *link = &keys[key_map[i]].waiting;
+	for (uint32_t e = VEC_AT(c->keys, core_key, i).waiting;
+	     e != NO_ENTRY; e = VEC_AT(c->entries, core_entry, e).next) {
+	    if (entry_map[e] == NO_ENTRY)
+		continue;
+	    *link = entry_map[e];
+	    link = &entries[entry_map[e]].next;
+	}
+    }
+
+    // Nothing can fail from here on.
+    size_t provide_count = 0;
+    for (size_t i = 0; i < c->packages.count; i++) {
+	core_package *package = &VEC_AT(c->packages, core_package, i);
+	if (package->gone) {
+	    package->first_need = package->needs = 0;
+	    package->first_provide = package->provides = 0;
+	    continue;
+	}
+	if (package->needs)
+	    package->first_need = need_map[package->first_need];
+	for (uint32_t j = 0; j < package->provides; j++)
+	    provides[provide_count + j] =
+		key_map[VEC_AT(c->provides, uint32_t,
+			       package->first_provide + j)];
+	package->first_provide = provide_count;
+	provide_count += package->provides;
+    }
+    for (size_t i = 0; i < c->standard.count; i++)
+	VEC_AT(c->standard, uint32_t, i) =
+	    key_map[VEC_AT(c->standard, uint32_t, i)];
+    free(c->keys.data);
+    free(c->needs.data);
+    free(c->entries.data);
+    free(c->provides.data);
+    free(c->pool);
+    c->keys = (vec){ keys, key_count, c->keys.count + 1 };
+    c->needs = (vec){ needs, need_count, c->needs.count + 1 };
+    c->entries = (vec){ entries, entry_count, c->entries.count + 1 };
+    c->provides = (vec){ provides, provide_count, c->provides.count + 1 };
+    c->size = c->used + 1;
+    c->pool = pool;
+    c->used = used;
+    c->gone = 0;
+    memset(c->slots, 0xff, c->slot_count * sizeof(uint32_t));
+    for (size_t i = 0; i < key_count; i++)
+	c->slots[core_slot(c, pool + keys[i].name, strlen(pool + keys[i].name),
+			   keys[i].hash)] = i;
+    free(key_map);
+    free(need_map);
+    free(entry_map);
+    return 0;
+}
+
+static void core_free(archive_core *c)
+{
+    free(c->pool);
+    free(c->keys.data);
+    free(c->entries.data);
+    free(c->needs.data);
+    free(c->packages.data);
+    free(c->provides.data);
+    free(c->standard.data);
+    free(c->slots);
+    memset(c, 0, sizeof(*c));
+}
+
+static archive_core *new_core(lua_State *L)
+{
+    archive_core *c = lua_newuserdata(L, sizeof(archive_core));
+    memset(c, 0, sizeof(*c));
+    luaL_getmetatable(L, CORE_META);
+    lua_setmetatable(L, -2);
+    lua_newtable(L);
+    lua_setfenv(L, -2);
+    return c;
+}
+
+/* archive_core(directories) makes an empty core, for which directories
+ * are the standard places the loader looks.
+ */
+LUAFN(archive_core)
+{
+    luaL_checktype(L, 1, LUA_TTABLE);
+    archive_core *c = new_core(L);
+    int count = lua_objlen(L, 1);
+
+    if (core_grow(c))
+	core_nomem(L);
+    for (int i = 1; i <= count; i++) {
+	size_t len;
+	lua_rawgeti(L, 1, i);
+	const char *dir = lua_tolstring(L, -1, &len);
+	if (!dir)
+	    return luaL_argerror(L, 1, "directories must be strings");
+	uint32_t *k = vec_push(&c->standard, sizeof(uint32_t));
+	if (!k || (*k = core_intern(c, dir, len)) == NO_ENTRY)
+	    core_nomem(L);
+	lua_pop(L, 1);
+    }
+    return 1;
+}
+
+static archive_core *check_core(lua_State *L)
+{
+    archive_core *c = luaL_checkudata(L, 1, CORE_META);
+    if (!c->slots)
+	luaL_error(L, "Archive core is closed");
+    return c;
+}
+
+/* core:add(elfs, aliases) adds a package's object tables, as from
+ * scan_archive, with its links to them.  Returns a package number for
+ * remove, and the changes: an array of { object, name, unresolved },
+ * where unresolved says whether the object's need of name now is.
+ */
+LUAFN(core_add)
+{
+    archive_core *c = check_core(L);
+    luaL_checktype(L, 2, LUA_TTABLE);
+    luaL_checktype(L, 3, LUA_TTABLE);
+    lua_settop(L, 3);
+    lua_getfenv(L, 1);
+    int env = lua_gettop(L);
+    lua_newtable(L);
+
+    core_package *package = vec_push(&c->packages, sizeof(core_package));
+    if (!package)
+	core_nomem(L);
+    uint32_t number = c->packages.count - 1;
+    int count = lua_objlen(L, 2);
+    package->first_object = c->objects + 1;
+    package->objects = count;
+    package->first_need = c->needs.count;
+    package->first_provide = c->provides.count;
+
+    // What's provided comes first, so new needs see all of it.
+    for (int i = 1; i <= count; i++) {
+	lua_rawgeti(L, 2, i);
+	if (!lua_istable(L, -1))
+	    return luaL_argerror(L, 2, "ELF tables expected");
+	lua_pushvalue(L, -1);
+	lua_rawseti(L, env, package->first_object + i - 1);
+	size_t len;
+	lua_getfield(L, -1, "path");
+	const char *path = lua_tolstring(L, -1, &len);
+	if (path) {
+	    core_add_provide(L, c, env, package, path, len);
+	    lua_getfield(L, -2, "soname");
+	    const char *soname = lua_tolstring(L, -1, &len);
+	    if (soname && core_standard(c, path))
+		core_add_provide(L, c, env, package, soname, len);
+	    lua_pop(L, 1);
+	}
+	lua_pop(L, 2);
+    }
+    c->objects += count;
+    lua_pushnil(L);
+    while (lua_next(L, 3)) {
+	size_t len;
+	if (lua_type(L, -2) == LUA_TSTRING) {
+	    const char *alias = lua_tolstring(L, -2, &len);
+	    core_add_provide(L, c, env, package, alias, len);
+	}
+	lua_pop(L, 1);
+    }
+    for (int i = 1; i <= count; i++) {
+	lua_rawgeti(L, 2, i);
+	core_add_needs(L, c, env, package, package->first_object + i - 1);
+	lua_pop(L, 1);
+    }
+    lua_pushinteger(L, number + 1);
+    lua_insert(L, -2);
+    return 2;
+}
+
+// core:remove(package) takes a package out again.  Returns the changes,
+// as add does.
+LUAFN(core_remove)
+{
+    archive_core *c = check_core(L);
+    uint32_t number = luaL_checkinteger(L, 2) - 1;
+    luaL_argcheck(L, number < c->packages.count, 2, "no such package");
+    core_package *package = &VEC_AT(c->packages, core_package, number);
+    luaL_argcheck(L, !package->gone, 2, "package already removed");
+    lua_settop(L, 2);
+    lua_getfenv(L, 1);
+    int env = lua_gettop(L);
+    lua_newtable(L);
+
+    package->gone = 1;
+    for (uint32_t i = 0; i < package->needs; i++) {
+	core_need *need =
+	    &VEC_AT(c->needs, core_need, package->first_need + i);
+	if (need->flags & NEED_UNRESOLVED)
+	    core_change(L, c, env, need, 0);
+	need->flags = NEED_GONE;
+    }
+    for (uint32_t i = 0; i < package->provides; i++)
+	core_provide(L, c, env, VEC_AT(c->provides, uint32_t,
+				       package->first_provide + i), -1);
+    for (uint32_t i = 0; i < package->objects; i++) {
+	lua_pushnil(L);
+	lua_rawseti(L, env, package->first_object + i);
+    }
+    // Once most needs are of packages removed, make room.  If memory is
+    // short, the core is just left as it is.
+    c->gone += package->needs;
+    if (c->gone >= 4096 && 2 * c->gone > c->needs.count)
+	core_compact(c);
+    return 1;
+}
+
+// core:satisfy(name) counts the unresolved needs of name as satisfied
+// from outside the set, as by the system.  Returns the changes.
+LUAFN(core_satisfy)
+{
+    archive_core *c = check_core(L);
+    size_t len;
+    const char *name = luaL_checklstring(L, 2, &len);
+    lua_settop(L, 2);
+    lua_getfenv(L, 1);
+    int env = lua_gettop(L);
+    lua_newtable(L);
+
+    size_t slot = core_slot(c, name, len, search_hash(name, len));
+    uint32_t k = c->slots[slot];
+    if (k == NO_ENTRY)
+	return 1;
+    for (uint32_t e = VEC_AT(c->keys, core_key, k).waiting; e != NO_ENTRY;
+	 e = VEC_AT(c->entries, core_entry, e).next) {
+	core_need *need =
+	    &VEC_AT(c->needs, core_need, VEC_AT(c->entries, core_entry, e).need);
+	if (need->name == k && (need->flags & NEED_UNRESOLVED)) {
+	    need->flags = NEED_EXTERNAL;
+	    core_change(L, c, env, need, 0);
+	}
+    }
+    return 1;
+}
+
+/* core:unresolved() lists the needs nothing satisfies, each as
+ * { object, name, keys }, where keys are the sonames and paths which
+ * would satisfy it.
+ */
+LUAFN(core_unresolved)
+{
+    archive_core *c = check_core(L);
+    int count = 0;
+
+    lua_settop(L, 1);
+    lua_getfenv(L, 1);
+    lua_newtable(L);
+    for (size_t i = 0; i < c->needs.count; i++) {
+	const core_need *need = &VEC_AT(c->needs, core_need, i);
+	if (!(need->flags & NEED_UNRESOLVED))
+	    continue;
+	lua_createtable(L, 3, 0);
+	lua_rawgeti(L, 2, need->object);
+	lua_rawseti(L, -2, 1);
+	lua_pushstring(L, c->pool + VEC_AT(c->keys, core_key, need->name).name);
+	lua_rawseti(L, -2, 2);
+	lua_createtable(L, need->entries, 0);
+	for (uint32_t j = 0; j < need->entries; j++) {
+	    const core_entry *entry =
+		&VEC_AT(c->entries, core_entry, need->first_entry + j);
+	    lua_pushstring(L, c->pool +
+			   VEC_AT(c->keys, core_key, entry->key).name);
+	    lua_rawseti(L, -2, j + 1);
+	}
+	lua_rawseti(L, -2, 3);
+	lua_rawseti(L, -2, ++count);
+    }
+    return 1;
+}
+
+// core:clone() gives an independent copy.
+LUAFN(core_clone)
+{
+    archive_core *c = check_core(L);
+    archive_core *copy = new_core(L);
+
+    copy->objects = c->objects;
+    copy->gone = c->gone;
+    copy->used = copy->size = c->used;
+    copy->slot_count = c->slot_count;
+    if (!(copy->pool = malloc(c->used + 1)) ||
+	!(copy->slots = malloc(c->slot_count * sizeof(uint32_t))) ||
+	vec_copy(&copy->keys, &c->keys, sizeof(core_key)) ||
+	vec_copy(&copy->entries, &c->entries, sizeof(core_entry)) ||
+	vec_copy(&copy->needs, &c->needs, sizeof(core_need)) ||
+	vec_copy(&copy->packages, &c->packages, sizeof(core_package)) ||
+	vec_copy(&copy->provides, &c->provides, sizeof(uint32_t)) ||
+	vec_copy(&copy->standard, &c->standard, sizeof(uint32_t)))
+	core_nomem(L);
+    memcpy(copy->pool, c->pool, c->used);
+    memcpy(copy->slots, c->slots, c->slot_count * sizeof(uint32_t));
+    lua_getfenv(L, -1);
+    lua_getfenv(L, 1);
+    lua_pushnil(L);
+    while (lua_next(L, -2)) {
+	lua_pushvalue(L, -2);
+	lua_insert(L, -2);
+	lua_rawset(L, -5);
+    }
+    lua_pop(L, 2);
+    return 1;
+}
+
+LUAFN(core_close)
+{
+    core_free(luaL_checkudata(L, 1, CORE_META));
+    return 0;
+}
+
+typedef struct { const char *name; int value; } intconst;
+
+LUALIB_API int luaopen_elfutil(lua_State *L)
+{
+    static const luaL_Reg funcptrs[] = {
 	FN_ENTRY(filter_on_machine),
 	FN_ENTRY(scan_elf),
+	FN_ENTRY(scan_elf_buffer),
+	FN_ENTRY(scan_archive),
+	FN_ENTRY(scan_archives),
+	FN_ENTRY(scan_many),
+	FN_ENTRY(open_cache),
 	FN_ENTRY(get_candidates),
 	FN_ENTRY(get_origins),
 	FN_ENTRY(canonicalize),
+	FN_ENTRY(library_search),
+	FN_ENTRY(walk_elfs),
+	FN_ENTRY(read_symbols),
+	FN_ENTRY(archive_core),
 	{NULL, NULL}
     };
 
@@ -388,6 +4174,79 @@ LUALIB_API int luaopen_elfutil(lua_State *L)
 	{NULL, 0}
     };
 
+    static const luaL_Reg cache_methods[] = {
+	{ "lookup", lua_fn_cache_lookup },
+	{ "has", lua_fn_cache_has },
+	{ "store", lua_fn_cache_store },
+	{ "close", lua_fn_cache_close },
+	{ NULL, NULL }
+    };
+
+    static const luaL_Reg search_methods[] = {
+	{ "lookup", lua_fn_search_lookup },
+	{ "cached", lua_fn_search_cached },
+	{ "close", lua_fn_search_close },
+	{ NULL, NULL }
+    };
+
+    static const luaL_Reg symbols_methods[] = {
+	{ "unresolved", lua_fn_symbols_unresolved },
+	{ "count", lua_fn_symbols_count },
+	{ "close", lua_fn_symbols_close },
+	{ NULL, NULL }
+    };
+
+    static const luaL_Reg core_methods[] = {
+	{ "add", lua_fn_core_add },
+	{ "remove", lua_fn_core_remove },
+	{ "satisfy", lua_fn_core_satisfy },
+	{ "unresolved", lua_fn_core_unresolved },
+	{ "clone", lua_fn_core_clone },
+	{ "close", lua_fn_core_close },
+	{ NULL, NULL }
+    };
+
+    luaL_newmetatable(L, CACHE_META);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, lua_fn_cache_close);
+    lua_setfield(L, -2, "__gc");
+    luaL_register(L, NULL, cache_methods);
+    lua_pop(L, 1);
+
+    luaL_newmetatable(L, WALK_META);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, lua_fn_walker_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pushcfunction(L, lua_fn_walker_next);
+    lua_setfield(L, -2, "next");
+    lua_pop(L, 1);
+
+    luaL_newmetatable(L, SEARCH_META);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, lua_fn_search_close);
+    lua_setfield(L, -2, "__gc");
+    luaL_register(L, NULL, search_methods);
+    lua_pop(L, 1);
+
+    luaL_newmetatable(L, SYMBOLS_META);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, lua_fn_symbols_close);
+    lua_setfield(L, -2, "__gc");
+    luaL_register(L, NULL, symbols_methods);
+    lua_pop(L, 1);
+
+    luaL_newmetatable(L, CORE_META);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, lua_fn_core_close);
+    lua_setfield(L, -2, "__gc");
+    luaL_register(L, NULL, core_methods);
+    lua_pop(L, 1);
+
     luaL_register(L, "elfutil", funcptrs);
     for (int i = 0; machines[i].name; i++) {
         lua_pushstring(L, machines[i].name);
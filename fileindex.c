@@ -0,0 +1,1504 @@
+// Needed for pthreads and mkstemp().
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <dirent.h>
+#include "lua_head.h"
+#include "unpack.h"
+
+// The decompressed manifest is read in pieces of this size.
+#define MANIFEST_CHUNK (1024 * 1024)
+
+#define JOB_META "fileindex.manifest_job"
+#define INDEX_META "fileindex.index"
+
+/* A file index is one image, either built in memory from a MANIFEST or
+ * an installation's package logs, or mapped from the copy saved in the
+ * cache directory:
+ *
+ *   header	  magic, then u32 counts of each of the following
+ *   packages	  u32 tag, u32 category, u64 stamp
+ *   entries	  u32 directory, u32 file name, u32 package
+ *   slots	  u32 hash, u32 kind, u32 key, u32 first posting
+ *   postings	  u32 entry, u32 next posting
+ *   strings	  interned, NUL terminated path components and names
+ *
+ * Strings are given as offsets into the string area.  The slots are an
+ * open addressed hash table over three kinds of key: full paths, whose
+ * key is an entry; sonames, which include each shorter version of a
+ * library's name, so libfoo.so.1.2.3 is found as libfoo.so.1 too; and
+ * the stems get_suggestions falls back to.  Each slot heads a list of
+ * the entries having that key.
+ *
+ * An installation has no categories, so a package's category is the
+ * name of its log in /var/log/packages instead, and its stamp is the
+ * log's mtime.  A manifest's stamps are zero.  Each package's entries
+ * are contiguous.
+ */
+#define INDEX_MAGIC "TFTMIDX2"
+#define NONE 0xffffffff
+
+enum { KEY_PATH, KEY_SONAME, KEY_STEM };
+
+typedef struct {
+    char magic[8];
+    uint32_t packages, entries, slots, postings, strings, zero;
+} index_header;
+
+typedef struct {
+    uint32_t tag, category;
+    uint64_t stamp;
+} index_package;
+
+typedef struct {
+    uint32_t dir, name, package;
+} index_entry;
+
+typedef struct {
+    uint32_t hash, kind, key, first;
+} index_slot;
+
+typedef struct {
+    uint32_t entry, next;
+} index_posting;
+
+// What's collected while reading the manifest.
+typedef struct {
+    char *pool;
+    size_t used, size;
+    uint32_t *interned;
+    size_t intern_slots, intern_count;
+    index_package *packages;
+    size_t package_count, package_room;
+    index_entry *entries;
+    size_t entry_count, entry_room;
+    uint32_t package;		// Current package, or NONE.
+} manifest;
+
+typedef struct {
+    char *image;
+    size_t size;
+    int mapped;
+    const index_header *header;
+    const index_package *packages;
+    const index_entry *entries;
+    const index_slot *slots;
+    const index_posting *postings;
+    const char *strings;
+} file_index;
+
+typedef struct {
+    char *path, *index_path;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    int threaded, done, cancel, collected;
+    int installation;		// path is a package log directory.
+    manifest parse;
+    char *image;
+    size_t image_size;
+    char errmsg[256];
+} manifest_job;
+
+static uint32_t hash_bytes(uint32_t hash, const char *data, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+	hash = (hash ^ (unsigned char)data[i]) * 16777619u;
+    return hash;
+}
+
+static uint32_t hash_string(const char *data, size_t len)
+{
+    return hash_bytes(2166136261u, data, len);
+}
+
+static uint32_t hash_path(const char *dir, size_t dirlen,
+			  const char *name, size_t namelen)
+{
+    uint32_t hash = hash_string(dir, dirlen);
+    if (dirlen > 0)
+	hash = hash_bytes(hash, "/", 1);
+    return hash_bytes(hash, name, namelen);
+}
+
+static int grow(void **array, size_t *room, size_t count, size_t size)
+{
+    if (count < *room)
+	return 0;
+    size_t newroom = *room ? 2 * *room : 1024;
+    void *bigger = realloc(*array, newroom * size);
+    if (!bigger)
+	return -1;
+    *array = bigger;
+    *room = newroom;
+    return 0;
+}
+
+// Returns the offset of the one copy of the string, or NONE.
+static uint32_t intern(manifest *m, const char *str, size_t len)
+{
+    if (2 * (m->intern_count + 1) > m->intern_slots) {
+	size_t slots = m->intern_slots ? 2 * m->intern_slots : 65536;
+	uint32_t *table = calloc(slots, sizeof(uint32_t));
+	if (!table)
+	    return NONE;
+	for (size_t i = 0; i < m->intern_slots; i++) {
+	    uint32_t offset = m->interned[i];
+	    if (!offset--)
+		continue;
+	    const char *old = m->pool + offset;
+	    size_t slot = hash_string(old, strlen(old)) & (slots - 1);
+	    while (table[slot])
+		slot = (slot + 1) & (slots - 1);
+	    table[slot] = offset + 1;
+	}
+	free(m->interned);
+	m->interned = table;
+	m->intern_slots = slots;
+    }
+
+    size_t slot = hash_string(str, len) & (m->intern_slots - 1);
+    for (; m->interned[slot]; slot = (slot + 1) & (m->intern_slots - 1)) {
+	const char *old = m->pool + m->interned[slot] - 1;
+	if (!memcmp(old, str, len) && !old[len])
+	    return m->interned[slot] - 1;
+    }
+
+    if (m->used + len + 1 > m->size) {
+	size_t size = m->size ? m->size : 65536;
+	while (m->used + len + 1 > size)
+	    size *= 2;
+	// Offsets have to fit in a u32.
+	if (size > NONE)
+	    return NONE;
+	// Not realloc(), since str may be a piece of the old pool.
+	char *pool = malloc(size);
+	if (!pool)
+	    return NONE;
+	if (m->used)
+	    memcpy(pool, m->pool, m->used);
+	memcpy(pool + m->used, str, len);
+	free(m->pool);
+	m->pool = pool;
+	m->size = size;
+    } else
+	memcpy(m->pool + m->used, str, len);
+    uint32_t offset = m->used;
+    m->pool[offset + len] = 0;
+    m->used += len + 1;
+    m->interned[slot] = offset + 1;
+    m->intern_count++;
+    return offset;
+}
+
+// Package:  ./category/tag-version-arch-build.t?z
+static int parse_package(manifest *m, const char *line, size_t len)
+{
+    const char *end = line + len;
+    const char *ptr = line + 2;
+
+    while (ptr < end && (*ptr == ' ' || *ptr == '\t'))
+	ptr++;
+    if (end - ptr < 8 || memcmp(ptr, "Package:", 8))
+	return 0;
+    ptr += 8;
+    m->package = NONE;
+    while (ptr < end && (*ptr == ' ' || *ptr == '\t'))
+	ptr++;
+    while (end > ptr && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r'))
+	end--;
+    if (end - ptr >= 2 && !memcmp(ptr, "./", 2))
+	ptr += 2;
+    const char *category = ptr;
+    const char *slash = memchr(ptr, '/', end - ptr);
+    if (!slash || slash == ptr)
+	return 0;
+    ptr = slash + 1;
+    if (memchr(ptr, '/', end - ptr))
+	return 0;
+    if (end - ptr < 4 || end[-4] != '.' || end[-3] != 't' || end[-1] != 'z')
+	return 0;
+    end -= 4;
+    // Drop version, arch and build.
+    for (int fields = 0; fields < 3; fields++) {
+	const char *dash = end;
+	while (dash > ptr && dash[-1] != '-')
+	    dash--;
+	if (dash == ptr || dash == end)
+	    return 0;
+	end = dash - 1;
+    }
+    if (end == ptr)
+	return 0;
+
+    if (grow((void **)&m->packages, &m->package_room, m->package_count,
+	     sizeof(index_package)))
+	return -1;
+    index_package *package = &m->packages[m->package_count];
+    if ((package->tag = intern(m, ptr, end - ptr)) == NONE ||
+	(package->category = intern(m, category, slash - category)) == NONE)
+	return -1;
+    package->stamp = 0;
+    m->package = m->package_count++;
+    return 0;
+}
+
+// For lib.so and lib.so.1.2.3, the length of the part ending in .so.
+// Otherwise zero.
+static size_t shared_object_base(const char *name, size_t len)
+{
+    if (len >= 3 && !memcmp(name + len - 3, ".so", 3))
+	return len;
+    for (const char *ptr = name; ptr + 4 < name + len; ptr++) {
+	if (memcmp(ptr, ".so.", 4))
+	    continue;
+	const char *tail = ptr + 4;
+	while (tail < name + len && (*tail == '.' || *tail >= '0' && *tail <= '9'))
+	    tail++;
+	if (tail == name + len)
+	    return ptr + 3 - name;
+    }
+    return 0;
+}
+
+static int is_alpha(char c)
+{
+    return c >= 'a' && c <= 'z' || c >= 'A' && c <= 'Z';
+}
+
+// The longest prefix of letters, underscores and dashes ending in a
+// letter.  This must agree with the stem taken from needed sonames.
+static size_t stem_length(const char *name, size_t len)
+{
+    size_t stem = 0;
+    for (size_t i = 0; i < len; i++) {
+	if (is_alpha(name[i]))
+	    stem = i + 1;
+	else if (name[i] != '_' && name[i] != '-')
+	    break;
+    }
+    return stem;
+}
+
+// Add the path from ptr to end as an entry of the current package.
+// Anything ending in a slash is a directory, and left out.
+static int add_entry(manifest *m, const char *ptr, const char *end)
+{
+    while (ptr < end && *ptr == '/')
+	ptr++;
+    if (end - ptr >= 2 && !memcmp(ptr, "./", 2))
+	ptr += 2;
+
+    const char *name = end;
+    while (name > ptr && name[-1] != '/')
+	name--;
+    if (name == end)
+	return 0;
+
+    if (grow((void **)&m->entries, &m->entry_room, m->entry_count,
+	     sizeof(index_entry)))
+	return -1;
+    index_entry *entry = &m->entries[m->entry_count];
+    size_t dirlen = name > ptr ? name - ptr - 1 : 0;
+    if ((entry->dir = intern(m, ptr, dirlen)) == NONE ||
+	(entry->name = intern(m, name, end - name)) == NONE)
+	return -1;
+    entry->package = m->package;
+    m->entry_count++;
+    return 0;
+}
+
+// A tar listing line: mode owner/group size date time path.  Field
+// widths vary with the sizes and owner names, so split on blanks
+// rather than trusting a column.
+static int parse_listing(manifest *m, const char *line, size_t len)
+{
+    const char *end = line + len;
+    const char *ptr = line;
+
+    // Directories are implied by their contents.
+    if (len < 11 || !strchr("-lhcbps", line[0]))
+	return 0;
+    for (int fields = 0; fields < 5; fields++) {
+	while (ptr < end && *ptr != ' ' && *ptr != '\t')
+	    ptr++;
+	while (ptr < end && (*ptr == ' ' || *ptr == '\t'))
+	    ptr++;
+    }
+    if (line[0] == 'l' || line[0] == 'h') {
+	const char *arrow = line[0] == 'l' ? " -> " : " link to ";
+	size_t arrowlen = strlen(arrow);
+	for (const char *scan = ptr; scan + arrowlen <= end; scan++)
+	    if (!memcmp(scan, arrow, arrowlen)) {
+		end = scan;
+		break;
+	    }
+    }
+    while (end > ptr && end[-1] == '\r')
+	end--;
+    return add_entry(m, ptr, end);
+}
+
+// Each line is classified on its own, so an unexpected header layout
+// or a stray line can't derail the rest of the parse.
+static int parse_line(manifest *m, const char *line, size_t len)
+{
+    if (len >= 2 && line[0] == '|' && line[1] == '|')
+	return parse_package(m, line, len);
+    if (len == 0 || line[0] == '+')
+	return 0;
+    if (m->package == NONE)
+	return 0;
+    return parse_listing(m, line, len);
+}
+
+static void manifest_free(manifest *m)
+{
+    free(m->pool);
+    free(m->interned);
+    free(m->packages);
+    free(m->entries);
+    memset(m, 0, sizeof(manifest));
+}
+
+typedef struct {
+    manifest *m;
+    index_slot *slots;
+    uint32_t *tails;
+    size_t slot_count;
+    index_posting *postings;
+    size_t posting_count;
+} index_builder;
+
+static void add_key(index_builder *b, uint32_t kind, uint32_t key,
+		    uint32_t hash, uint32_t entry)
+{
+    const index_entry *entries = b->m->entries;
+    size_t slot = hash & (b->slot_count - 1);
+
+    for (;; slot = (slot + 1) & (b->slot_count - 1)) {
+	index_slot *s = &b->slots[slot];
+	if (s->first == NONE) {
+	    s->hash = hash;
+	    s->kind = kind;
+	    s->key = key;
+	    s->first = b->posting_count;
+	    break;
+	}
+	if (s->hash != hash || s->kind != kind)
+	    continue;
+	if (kind == KEY_PATH ?
+	    entries[s->key].dir == entries[key].dir &&
+	    entries[s->key].name == entries[key].name : s->key == key) {
+	    b->postings[b->tails[slot]].next = b->posting_count;
+	    break;
+	}
+    }
+    b->tails[slot] = b->posting_count;
+    b->postings[b->posting_count].entry = entry;
+    b->postings[b->posting_count].next = NONE;
+    b->posting_count++;
+}
+
+static int add_name_keys(index_builder *b, uint32_t entry)
+{
+    manifest *m = b->m;
+    const char *name = m->pool + m->entries[entry].name;
+    size_t len = strlen(name);
+    size_t base = shared_object_base(name, len);
+    if (!base)
+	return 0;
+
+    // The name and each version cut off from the end of it.
+    for (size_t cut = len; cut >= base; cut--) {
+	if (cut < len && name[cut] != '.')
+	    continue;
+	uint32_t key = intern(m, name, cut);
+	if (key == NONE)
+	    return -1;
+	// intern() may have moved the pool.
+	name = m->pool + m->entries[entry].name;
+	add_key(b, KEY_SONAME, key, hash_string(name, cut), entry);
+    }
+    size_t stem = stem_length(name, len);
+    if (stem > 0) {
+	uint32_t key = intern(m, name, stem);
+	if (key == NONE)
+	    return -1;
+	name = m->pool + m->entries[entry].name;
+	add_key(b, KEY_STEM, key, hash_string(name, stem), entry);
+    }
+    return 0;
+}
+
+// Build the index image.  Returns 0, or -1 if out of memory.
+static int build_index(manifest *m, char **image, size_t *image_size)
+{
+    index_builder b = { .m = m };
+    size_t keys = 0;
+    int rc = -1;
+
+    for (size_t i = 0; i < m->entry_count; i++) {
+	const char *name = m->pool + m->entries[i].name;
+	size_t len = strlen(name);
+	size_t base = shared_object_base(name, len);
+	keys++;
+	if (base) {
+	    keys += 2;
+	    for (size_t j = base; j < len; j++)
+		keys += name[j] == '.';
+	}
+    }
+    if (keys >= NONE / 2)
+	return -1;
+    b.slot_count = 1024;
+    while (b.slot_count < 2 * keys)
+	b.slot_count *= 2;
+    b.slots = malloc(b.slot_count * sizeof(index_slot));
+    b.tails = malloc(b.slot_count * sizeof(uint32_t));
+    b.postings = malloc((keys ? keys : 1) * sizeof(index_posting));
+    if (!b.slots || !b.tails || !b.postings)
+	goto out;
+    for (size_t i = 0; i < b.slot_count; i++)
+	b.slots[i].first = NONE;
+
+    for (size_t i = 0; i < m->entry_count; i++) {
+	const index_entry *entry = &m->entries[i];
+	const char *dir = m->pool + entry->dir;
+	const char *name = m->pool + entry->name;
+	add_key(&b, KEY_PATH, i,
+		hash_path(dir, strlen(dir), name, strlen(name)), i);
+	if (add_name_keys(&b, i))
+	    goto out;
+    }
+
+    index_header header = {
+	.packages = m->package_count, .entries = m->entry_count,
+	.slots = b.slot_count, .postings = b.posting_count,
+	.strings = m->used, .zero = 0
+    };
+    memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+    size_t sizes[] = {
+	sizeof(header),
+	m->package_count * sizeof(index_package),
+	m->entry_count * sizeof(index_entry),
+	b.slot_count * sizeof(index_slot),
+	b.posting_count * sizeof(index_posting),
+	m->used
+    };
+    const void *parts[] = {
+	&header, m->packages, m->entries, b.slots, b.postings, m->pool
+    };
+    size_t total = 0;
+    for (int i = 0; i < 6; i++)
+	total += sizes[i];
+    char *out = malloc(total);
+    if (!out)
+	goto out;
+    *image = out;
+    *image_size = total;
+    for (int i = 0; i < 6; i++) {
+	if (sizes[i])
+	    memcpy(out, parts[i], sizes[i]);
+	out += sizes[i];
+    }
+    rc = 0;
+out:
+    free(b.slots);
+    free(b.tails);
+    free(b.postings);
+    return rc;
+}
+
+// Save the image where open_index() will find it.  The cache is only a
+// convenience, so failure is quietly ignored.
+static void save_index(const char *path, const char *image, size_t size)
+{
+    size_t len = strlen(path);
+    char *temp = malloc(len + 8);
+    if (!temp)
+	return;
+    memcpy(temp, path, len);
+    memcpy(temp + len, ".XXXXXX", 8);
+    int fd = mkstemp(temp);
+    if (fd < 0) {
+	free(temp);
+	return;
+    }
+    size_t done = 0;
+    while (done < size) {
+	ssize_t actual = write(fd, image + done, size - done);
+	if (actual < 0 && errno == EINTR)
+	    continue;
+	if (actual <= 0)
+	    break;
+	done += actual;
+    }
+    if (close(fd) || done < size || rename(temp, path))
+	unlink(temp);
+    free(temp);
+}
+
+static int setup_index(file_index *index)
+{
+    const index_header *header = (const index_header *)index->image;
+
+    if (index->size < sizeof(index_header) ||
+	memcmp(header->magic, INDEX_MAGIC, sizeof(header->magic)))
+	return -1;
+    uint64_t need = sizeof(index_header) +
+	(uint64_t)header->packages * sizeof(index_package) +
+	(uint64_t)header->entries * sizeof(index_entry) +
+	(uint64_t)header->slots * sizeof(index_slot) +
+	(uint64_t)header->postings * sizeof(index_posting) +
+	header->strings;
+    if (need != index->size || header->strings == 0 ||
+	header->slots == 0 || header->slots & (header->slots - 1))
+	return -1;
+    index->header = header;
+    index->packages = (const index_package *)(header + 1);
+    index->entries = (const index_entry *)
+	(index->packages + header->packages);
+    index->slots = (const index_slot *)(index->entries + header->entries);
+    index->postings = (const index_posting *)
+	(index->slots + header->slots);
+    index->strings = (const char *)(index->postings + header->postings);
+    if (index->strings[header->strings - 1])
+	return -1;
+    return 0;
+}
+
+static char *copy_string(const char *str)
+{
+    size_t len = strlen(str) + 1;
+    char *copy = malloc(len);
+    if (copy)
+	memcpy(copy, str, len);
+    return copy;
+}
+
+static void parse_manifest(manifest_job *job)
+{
+    const char *errmsg;
+    manifest *m = &job->parse;
+    unpack *stream = unpack_open(job->path, &errmsg);
+    size_t size = MANIFEST_CHUNK, held = 0;
+    char *buffer = malloc(size);
+
+    m->package = NONE;
+    if (!stream || !buffer) {
+	snprintf(job->errmsg, sizeof(job->errmsg), "%s: %s", job->path,
+		 stream ? strerror(ENOMEM) : errmsg);
+	goto done;
+    }
+    for (;;) {
+	pthread_mutex_lock(&job->lock);
+	int cancel = job->cancel;
+	pthread_mutex_unlock(&job->lock);
+	if (cancel)
+	    goto done;
+	if (held == size) {
+	    // A line longer than the buffer.  Make room.
+	    char *bigger = realloc(buffer, 2 * size);
+	    if (!bigger)
+		goto nomem;
+	    buffer = bigger;
+	    size *= 2;
+	}
+	ssize_t actual = unpack_read(stream, buffer + held, size - held);
+	if (actual < 0) {
+	    snprintf(job->errmsg, sizeof(job->errmsg), "%s: %s", job->path,
+		     unpack_error(stream));
+	    goto done;
+	}
+	held += actual;
+	char *line = buffer, *end = buffer + held;
+	char *newline;
+	while ((newline = memchr(line, '\n', end - line))) {
+	    if (parse_line(m, line, newline - line))
+		goto nomem;
+	    line = newline + 1;
+	}
+	if (actual == 0) {
+	    // Last line without a newline.
+	    if (line < end && parse_line(m, line, end - line))
+		goto nomem;
+	    break;
+	}
+	held = end - line;
+	memmove(buffer, line, held);
+    }
+    if (build_index(m, &job->image, &job->image_size))
+	goto nomem;
+    if (job->index_path)
+	save_index(job->index_path, job->image, job->image_size);
+    goto done;
+nomem:
+    snprintf(job->errmsg, sizeof(job->errmsg), "%s", strerror(ENOMEM));
+done:
+    manifest_free(m);
+    free(buffer);
+    unpack_close(stream);
+}
+
+// The whole of a file, NUL terminated, or NULL.
+static char *read_whole_file(const char *path, size_t *len)
+{
+    struct stat statb;
+    int fd = open(path, O_RDONLY);
+    char *text = NULL;
+    size_t done = 0;
+
+    if (fd < 0)
+	return NULL;
+    if (fstat(fd, &statb) || !(text = malloc(statb.st_size + 1)))
+	goto out;
+    while (done < (size_t)statb.st_size) {
+	ssize_t actual = read(fd, text + done, statb.st_size - done);
+	if (actual < 0 && errno == EINTR)
+	    continue;
+	if (actual <= 0)
+	    break;
+	done += actual;
+    }
+    text[done] = 0;
+    *len = done;
+out:
+    close(fd);
+    return text;
+}
+
+/* A package's FILE LIST is everything after that line in its log.
+ * Directories end in a slash, and install/ holds the scripts run while
+ * installing rather than anything installed.  A config file shipped as
+ * foo.new normally ends up as foo, so it owns both.
+ */
+static int parse_file_list(manifest *m, const char *text, size_t len)
+{
+    const char *line = text, *end = text + len;
+    int listing = 0;
+
+    while (line < end) {
+	const char *eol = memchr(line, '\n', end - line);
+	if (!eol)
+	    eol = end;
+	const char *next = eol < end ? eol + 1 : end;
+	while (eol > line && eol[-1] == '\r')
+	    eol--;
+	if (!listing)
+	    listing = eol - line == 10 && !memcmp(line, "FILE LIST:", 10);
+	else if (eol > line && eol[-1] != '/' &&
+		 (eol - line < 8 || memcmp(line, "install/", 8))) {
+	    if (add_entry(m, line, eol))
+		return -1;
+	    if (eol - line > 4 && !memcmp(eol - 4, ".new", 4) &&
+		add_entry(m, line, eol - 4))
+		return -1;
+	}
+	line = next;
+    }
+    return 0;
+}
+
+// Match word and the blanks after it, returning what follows, or NULL.
+static const char *skip_word(const char *ptr, const char *end,
+			     const char *word)
+{
+    size_t len = strlen(word);
+
+    if (end - ptr < (ptrdiff_t)len || memcmp(ptr, word, len))
+	return NULL;
+    for (ptr += len; ptr < end && *ptr == ' '; ptr++)
+	;
+    return ptr;
+}
+
+// The token at ptr, up to a blank.
+static const char *token_end(const char *ptr, const char *end)
+{
+    while (ptr < end && *ptr != ' ')
+	ptr++;
+    return ptr;
+}
+
+/* Symlinks aren't in the FILE LIST.  The install script makes them,
+ * and installpkg keeps it in ../scripts, where each is a line like
+ *	( cd usr/lib64 ; ln -sf libz.so.1.2.13 libz.so.1 )
+ */
+static int parse_script_links(manifest *m, const char *text, size_t len)
+{
+    const char *line = text, *end = text + len;
+    char path[4096];
+
+    while (line < end) {
+	const char *eol = memchr(line, '\n', end - line);
+	if (!eol)
+	    eol = end;
+	const char *next = eol < end ? eol + 1 : end;
+	const char *ptr = skip_word(line, eol, "( cd ");
+	const char *dir = ptr, *dir_end = ptr ? token_end(ptr, eol) : NULL;
+	if (ptr)
+	    ptr = skip_word(dir_end, eol, " ;");
+	if (ptr)
+	    ptr = skip_word(ptr, eol, "ln -sf ");
+	if (ptr)
+	    ptr = token_end(ptr, eol);
+	if (ptr)
+	    ptr = skip_word(ptr, eol, " ");
+	const char *link = ptr, *link_end = ptr ? token_end(ptr, eol) : NULL;
+	if (link && link_end > link && skip_word(link_end, eol, " )") &&
+	    (dir_end - dir) + (link_end - link) + 1 < sizeof(path)) {
+	    size_t dirlen = dir_end - dir;
+	    memcpy(path, dir, dirlen);
+	    path[dirlen] = '/';
+	    memcpy(path + dirlen + 1, link, link_end - link);
+	    if (add_entry(m, path, path + dirlen + 1 + (link_end - link)))
+		return -1;
+	}
+	line = next;
+    }
+    return 0;
+}
+
+// The length of the tag in tag-version-arch-build, or zero.
+static size_t log_tag_length(const char *name)
+{
+    const char *end = name + strlen(name);
+
+    for (int fields = 0; fields < 3; fields++) {
+	const char *dash = end;
+	while (dash > name && dash[-1] != '-')
+	    dash--;
+	if (dash == name || dash == end)
+	    return 0;
+	end = dash - 1;
+    }
+    return end - name;
+}
+
+static int compare_names(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static uint64_t mtime_stamp(const struct stat *statb)
+{
+    return (uint64_t)statb->st_mtim.tv_sec * 1000000000u +
+	statb->st_mtim.tv_nsec;
+}
+
+/* The index saved last time, so that packages whose logs haven't
+ * changed are copied from it rather than parsed again.
+ */
+typedef struct {
+    file_index index;
+    uint32_t *by_log;		// Open addressed, package + 1 or zero.
+    size_t slots;
+    uint32_t *first, *count;	// Each package's entries.
+} previous_index;
+
+static void open_previous(previous_index *prev, const char *path)
+{
+    struct stat statb;
+    int fd = path ? open(path, O_RDONLY) : -1;
+
+    memset(prev, 0, sizeof(previous_index));
+    if (fd < 0)
+	return;
+    if (!fstat(fd, &statb) && statb.st_size > 0) {
+	void *map = mmap(NULL, statb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map != MAP_FAILED) {
+	    prev->index.image = map;
+	    prev->index.size = statb.st_size;
+	}
+    }
+    close(fd);
+    file_index *index = &prev->index;
+    if (!index->image)
+	return;
+    uint32_t packages = 0;
+    if (!setup_index(index))
+	packages = index->header->packages;
+    prev->slots = 1024;
+    while (prev->slots < 2 * (size_t)packages)
+	prev->slots *= 2;
+    prev->by_log = calloc(prev->slots, sizeof(uint32_t));
+    prev->first = calloc(packages + 1, sizeof(uint32_t));
+    prev->count = calloc(packages + 1, sizeof(uint32_t));
+    if (!packages || !prev->by_log || !prev->first || !prev->count) {
+	prev->slots = 0;
+	return;
+    }
+    for (uint32_t i = 0; i < packages; i++) {
+	const char *log = index->strings + index->packages[i].category;
+	if (index->packages[i].category >= index->header->strings)
+	    continue;
+	size_t slot = hash_string(log, strlen(log)) & (prev->slots - 1);
+	while (prev->by_log[slot])
+	    slot = (slot + 1) & (prev->slots - 1);
+	prev->by_log[slot] = i + 1;
+    }
+    for (uint32_t i = index->header->entries; i-- > 0;) {
+	uint32_t package = index->entries[i].package;
+	if (package < packages) {
+	    prev->first[package] = i;
+	    prev->count[package]++;
+	}
+    }
+}
+
+static void close_previous(previous_index *prev)
+{
+    if (prev->index.image)
+	munmap(prev->index.image, prev->index.size);
+    free(prev->by_log);
+    free(prev->first);
+    free(prev->count);
+}
+
+// The previous index's package for the log, if its stamp is the same.
+static uint32_t previous_package(previous_index *prev, const char *log,
+				 uint64_t stamp)
+{
+    file_index *index = &prev->index;
+
+    if (!prev->slots)
+	return NONE;
+    for (size_t slot = hash_string(log, strlen(log)) & (prev->slots - 1);
+	 prev->by_log[slot]; slot = (slot + 1) & (prev->slots - 1)) {
+	uint32_t package = prev->by_log[slot] - 1;
+	const index_package *p = &index->packages[package];
+	if (!strcmp(index->strings + p->category, log))
+	    return p->stamp == stamp ? package : NONE;
+    }
+    return NONE;
+}
+
+// Copy a package's entries from the previous index.
+static int copy_package(manifest *m, previous_index *prev, uint32_t package)
+{
+    file_index *index = &prev->index;
+    uint32_t first = prev->first[package], count = prev->count[package];
+
+    for (uint32_t i = first; i < first + count; i++) {
+	const index_entry *old = &index->entries[i];
+	if (old->package != package || old->dir >= index->header->strings ||
+	    old->name >= index->header->strings)
+	    return -2;
+	const char *dir = index->strings + old->dir;
+	const char *name = index->strings + old->name;
+	if (grow((void **)&m->entries, &m->entry_room, m->entry_count,
+		 sizeof(index_entry)))
+	    return -1;
+	index_entry *entry = &m->entries[m->entry_count];
+	if ((entry->dir = intern(m, dir, strlen(dir))) == NONE ||
+	    (entry->name = intern(m, name, strlen(name))) == NONE)
+	    return -1;
+	entry->package = m->package;
+	m->entry_count++;
+    }
+    return 0;
+}
+
+// Read one package's log and install script.
+static int parse_package_log(manifest *m, const char *log_path,
+			     const char *script_path)
+{
+    size_t len;
+    char *text = read_whole_file(log_path, &len);
+    int rc = 0;
+
+    if (text) {
+	rc = parse_file_list(m, text, len);
+	free(text);
+    }
+    if (!rc && (text = read_whole_file(script_path, &len))) {
+	rc = parse_script_links(m, text, len);
+	free(text);
+    }
+    return rc;
+}
+
+/* Index the files of each package installed, as listed by its log in
+ * the directory.  A package whose log and script are no newer than in
+ * the index saved last time is taken from there.
+ */
+static void parse_installation(manifest_job *job)
+{
+    manifest *m = &job->parse;
+    previous_index prev;
+    char **names = NULL;
+    size_t name_count = 0, name_room = 0;
+    DIR *dir = opendir(job->path);
+    struct dirent *dirent;
+    char *log_path = NULL, *script_path = NULL;
+
+    open_previous(&prev, job->index_path);
+    if (!dir) {
+	snprintf(job->errmsg, sizeof(job->errmsg), "%s: %s", job->path,
+		 strerror(errno));
+	goto done;
+    }
+    while ((dirent = readdir(dir))) {
+	if (dirent->d_name[0] == '.' || !log_tag_length(dirent->d_name))
+	    continue;
+	if (grow((void **)&names, &name_room, name_count, sizeof(char *)) ||
+	    !(names[name_count] = copy_string(dirent->d_name)))
+	    goto nomem;
+	name_count++;
+    }
+    if (names)
+	qsort(names, name_count, sizeof(char *), compare_names);
+
+    size_t dirlen = strlen(job->path);
+    log_path = malloc(dirlen + NAME_MAX + 2);
+    script_path = malloc(dirlen + NAME_MAX + 13);
+    if (!log_path || !script_path)
+	goto nomem;
+    for (size_t i = 0; i < name_count; i++) {
+	pthread_mutex_lock(&job->lock);
+	int cancel = job->cancel;
+	pthread_mutex_unlock(&job->lock);
+	if (cancel)
+	    goto done;
+
+	struct stat statb;
+	const char *name = names[i];
+	sprintf(log_path, "%s/%s", job->path, name);
+	sprintf(script_path, "%s/../scripts/%s", job->path, name);
+	if (stat(log_path, &statb) || !S_ISREG(statb.st_mode))
+	    continue;
+	uint64_t stamp = mtime_stamp(&statb);
+	if (!stat(script_path, &statb) && mtime_stamp(&statb) > stamp)
+	    stamp = mtime_stamp(&statb);
+
+	if (grow((void **)&m->packages, &m->package_room, m->package_count,
+		 sizeof(index_package)))
+	    goto nomem;
+	index_package *package = &m->packages[m->package_count];
+	if ((package->tag = intern(m, name, log_tag_length(name))) == NONE ||
+	    (package->category = intern(m, name, strlen(name))) == NONE)
+	    goto nomem;
+	package->stamp = stamp;
+	m->package = m->package_count++;
+
+	size_t entries = m->entry_count;
+	uint32_t old = previous_package(&prev, name, stamp);
+	int rc = old == NONE ? -2 : copy_package(m, &prev, old);
+	if (rc == -2) {
+	    m->entry_count = entries;
+	    rc = parse_package_log(m, log_path, script_path);
+	}
+	if (rc)
+	    goto nomem;
+    }
+    if (build_index(m, &job->image, &job->image_size))
+	goto nomem;
+    // Done with the old copy before replacing it.
+    close_previous(&prev);
+    memset(&prev, 0, sizeof(prev));
+    if (job->index_path)
+	save_index(job->index_path, job->image, job->image_size);
+    goto done;
+nomem:
+    snprintf(job->errmsg, sizeof(job->errmsg), "%s", strerror(ENOMEM));
+done:
+    if (dir)
+	closedir(dir);
+    close_previous(&prev);
+    for (size_t i = 0; i < name_count; i++)
+	free(names[i]);
+    free(names);
+    free(log_path);
+    free(script_path);
+    manifest_free(m);
+}
+
+static void *manifest_thread(void *arg)
+{
+    manifest_job *job = arg;
+
+    if (job->installation)
+	parse_installation(job);
+    else
+	parse_manifest(job);
+    pthread_mutex_lock(&job->lock);
+    job->done = 1;
+    pthread_mutex_unlock(&job->lock);
+    return NULL;
+}
+
+static void wait_for_job(manifest_job *job)
+{
+    if (job->threaded) {
+	pthread_join(job->thread, NULL);
+	job->threaded = 0;
+    }
+}
+
+static int start_job(lua_State *L, int installation)
+{
+    const char *path = luaL_checkstring(L, 1);
+    const char *index_path = luaL_optstring(L, 2, NULL);
+    manifest_job *job = lua_newuserdata(L, sizeof(manifest_job));
+
+    memset(job, 0, sizeof(manifest_job));
+    job->installation = installation;
+    luaL_getmetatable(L, JOB_META);
+    lua_setmetatable(L, -2);
+    lua_newtable(L);
+    lua_setfenv(L, -2);
+    if (!(job->path = copy_string(path)) ||
+	index_path && !(job->index_path = copy_string(index_path))) {
+	free(job->path);
+	job->path = NULL;
+	return luaL_error(L, "%s", strerror(ENOMEM));
+    }
+    pthread_mutex_init(&job->lock, NULL);
+    if (!pthread_create(&job->thread, NULL, manifest_thread, job))
+	job->threaded = 1;
+    else
+	// No thread to be had.  Do it now.
+	manifest_thread(job);
+    return 1;
+}
+
+// Start indexing a MANIFEST on a background thread, saving the index
+// to index_path if that's given.  Returns a job object with ready()
+// and result() methods.
+LUAFN(read_manifest)
+{
+    return start_job(L, 0);
+}
+
+// Likewise index the files of the packages whose logs are in the
+// directory, which is usually /var/log/packages.  Given an index_path,
+// the index saved there last time is used for packages unchanged since.
+LUAFN(read_installation)
+{
+    return start_job(L, 1);
+}
+
+LUAFN(job_ready)
+{
+    manifest_job *job = luaL_checkudata(L, 1, JOB_META);
+
+    pthread_mutex_lock(&job->lock);
+    lua_pushboolean(L, job->done);
+    pthread_mutex_unlock(&job->lock);
+    return 1;
+}
+
+static file_index *new_index(lua_State *L)
+{
+    file_index *index = lua_newuserdata(L, sizeof(file_index));
+
+    memset(index, 0, sizeof(file_index));
+    luaL_getmetatable(L, INDEX_META);
+    lua_setmetatable(L, -2);
+    return index;
+}
+
+// Wait for the job and return the index, or nil and a message if the
+// manifest couldn't be read.
+LUAFN(job_result)
+{
+    manifest_job *job = luaL_checkudata(L, 1, JOB_META);
+
+    lua_getfenv(L, 1);
+    int cache = lua_gettop(L);
+    if (job->collected) {
+	lua_getfield(L, cache, "result");
+	lua_getfield(L, cache, "error");
+	return 2;
+    }
+    wait_for_job(job);
+    job->collected = 1;
+    if (job->errmsg[0]) {
+	lua_pushstring(L, job->errmsg);
+	lua_setfield(L, cache, "error");
+	lua_pushnil(L);
+	lua_pushstring(L, job->errmsg);
+	return 2;
+    }
+
+    file_index *index = new_index(L);
+    index->image = job->image;
+    index->size = job->image_size;
+    job->image = NULL;
+    if (setup_index(index))
+	return luaL_error(L, "Botched manifest index");
+    lua_pushvalue(L, -1);
+    lua_setfield(L, cache, "result");
+    return 1;
+}
+
+LUAFN(job_gc)
+{
+    manifest_job *job = luaL_checkudata(L, 1, JOB_META);
+
+    if (job->threaded) {
+	pthread_mutex_lock(&job->lock);
+	job->cancel = 1;
+	pthread_mutex_unlock(&job->lock);
+	wait_for_job(job);
+    }
+    if (job->path) {
+	pthread_mutex_destroy(&job->lock);
+	free(job->image);
+	free(job->path);
+	free(job->index_path);
+	job->path = NULL;
+    }
+    return 0;
+}
+
+// Map an index saved by read_manifest.  Returns nil and a message if
+// there's no usable index there.
+LUAFN(open_index)
+{
+    const char *path = luaL_checkstring(L, 1);
+    struct stat statb;
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0 || fstat(fd, &statb)) {
+	if (fd >= 0)
+	    close(fd);
+	lua_pushnil(L);
+	lua_pushfstring(L, "%s: %s", path, strerror(errno));
+	return 2;
+    }
+    file_index *index = new_index(L);
+    if (statb.st_size > 0) {
+	void *map = mmap(NULL, statb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map != MAP_FAILED) {
+	    index->image = map;
+	    index->size = statb.st_size;
+	    index->mapped = 1;
+	}
+    }
+    close(fd);
+    if (!index->image || setup_index(index)) {
+	lua_pushnil(L);
+	lua_pushfstring(L, "%s isn't a manifest index", path);
+	return 2;
+    }
+    return 1;
+}
+
+static file_index *check_index(lua_State *L)
+{
+    file_index *index = luaL_checkudata(L, 1, INDEX_META);
+    if (!index->image)
+	luaL_error(L, "Index is closed");
+    return index;
+}
+
+static const char *index_string(file_index *index, uint32_t offset)
+{
+    return offset < index->header->strings ? index->strings + offset : "";
+}
+
+static const index_entry *index_entry_at(file_index *index, uint32_t entry)
+{
+    static const index_entry none = { NONE, NONE, NONE };
+    return entry < index->header->entries ? &index->entries[entry] : &none;
+}
+
+static const char *entry_tag(file_index *index, const index_entry *entry)
+{
+    if (entry->package >= index->header->packages)
+	return "";
+    return index_string(index, index->packages[entry->package].tag);
+}
+
+static int same_path(file_index *index, uint32_t entry,
+		     const char *dir, size_t dirlen,
+		     const char *name, size_t namelen)
+{
+    const index_entry *e = index_entry_at(index, entry);
+    const char *edir = index_string(index, e->dir);
+    const char *ename = index_string(index, e->name);
+    return !strncmp(edir, dir, dirlen) && !edir[dirlen] &&
+	!strncmp(ename, name, namelen) && !ename[namelen];
+}
+
+// Find the slot for a key.  Path keys are given as dir and name.
+static const index_slot *find_slot(file_index *index, uint32_t kind,
+				   const char *dir, size_t dirlen,
+				   const char *name, size_t namelen)
+{
+    uint32_t hash = kind == KEY_PATH ?
+	hash_path(dir, dirlen, name, namelen) : hash_string(name, namelen);
+    uint32_t mask = index->header->slots - 1;
+
+    for (uint32_t probe = 0, slot = hash & mask; probe <= mask;
+	 probe++, slot = (slot + 1) & mask) {
+	const index_slot *s = &index->slots[slot];
+	if (s->first == NONE)
+	    return NULL;
+	if (s->hash != hash || s->kind != kind)
+	    continue;
+	if (kind == KEY_PATH) {
+	    if (same_path(index, s->key, dir, dirlen, name, namelen))
+		return s;
+	} else {
+	    const char *key = index_string(index, s->key);
+	    if (!strncmp(key, name, namelen) && !key[namelen])
+		return s;
+	}
+    }
+    return NULL;
+}
+
+// The postings of a slot, bounded in case the file is bad.
+#define FOR_POSTINGS(INDEX, SLOT, ENTRY)				\
+    for (uint32_t posting_ = (SLOT) ? (SLOT)->first : NONE, count_ = 0, \
+	     ENTRY;							\
+	 posting_ < (INDEX)->header->postings &&			\
+	     count_++ < (INDEX)->header->postings &&			\
+	     (ENTRY = (INDEX)->postings[posting_].entry, 1);		\
+	 posting_ = (INDEX)->postings[posting_].next)
+
+// index:which(path) returns the tags of the packages shipping path.
+LUAFN(index_which)
+{
+    file_index *index = check_index(L);
+    size_t len;
+    const char *path = luaL_checklstring(L, 2, &len);
+    const char *end = path + len;
+
+    while (path < end && *path == '/')
+	path++;
+    if (end - path >= 2 && !memcmp(path, "./", 2))
+	path += 2;
+    const char *name = end;
+    while (name > path && name[-1] != '/')
+	name--;
+    size_t dirlen = name > path ? name - path - 1 : 0;
+    const index_slot *slot =
+	find_slot(index, KEY_PATH, path, dirlen, name, end - name);
+    int results = 0;
+    FOR_POSTINGS(index, slot, entry) {
+	luaL_checkstack(L, 1, "too many packages");
+	lua_pushstring(L, entry_tag(index, index_entry_at(index, entry)));
+	results++;
+    }
+    return results;
+}
+
+// Push an array of { file, tag, path } for the key.
+static int push_matches(lua_State *L, uint32_t kind)
+{
+    file_index *index = check_index(L);
+    size_t len;
+    const char *name = luaL_checklstring(L, 2, &len);
+    const index_slot *slot = find_slot(index, kind, NULL, 0, name, len);
+    int count = 0;
+
+    lua_newtable(L);
+    FOR_POSTINGS(index, slot, entry) {
+	const index_entry *e = index_entry_at(index, entry);
+	const char *dir = index_string(index, e->dir);
+	lua_createtable(L, 3, 0);
+	lua_pushstring(L, index_string(index, e->name));
+	lua_rawseti(L, -2, 1);
+	lua_pushstring(L, entry_tag(index, e));
+	lua_rawseti(L, -2, 2);
+	lua_pushfstring(L, "/%s%s%s", dir, *dir ? "/" : "",
+			index_string(index, e->name));
+	lua_rawseti(L, -2, 3);
+	lua_rawseti(L, -2, ++count);
+    }
+    return 1;
+}
+
+// index:sonames(soname) returns the files which could satisfy soname.
+LUAFN(index_sonames)
+{
+    return push_matches(L, KEY_SONAME);
+}
+
+// index:stems(stem) returns the shared objects with the stem.
+LUAFN(index_stems)
+{
+    return push_matches(L, KEY_STEM);
+}
+
+typedef struct {
+    lua_State *L;
+    file_index *index;
+    char path[PATH_MAX];
+    size_t root;		// Length of the root prefix in path.
+    dev_t dev;			// The device the walk stays on.
+    int count;
+} orphan_walk;
+
+// Trees under the root which hold what the system makes as it runs, or
+// users' files, and nothing a package installs.
+static const char *const volatile_trees[] = {
+    "dev", "home", "proc", "run", "sys", "tmp", NULL
+};
+
+static int volatile_tree(const orphan_walk *walk, size_t len,
+			 const char *name)
+{
+    if (len != walk->root)
+	return 0;
+    for (const char *const *tree = volatile_trees; *tree; tree++)
+	if (!strcmp(name, *tree))
+	    return 1;
+    return 0;
+}
+
+// Add anything under walk->path that no package owns to the table on
+// top of the stack.  Other filesystems mounted there aren't entered,
+// nor are the volatile trees, unless the walk starts in one.
+static void find_orphans(orphan_walk *walk, size_t len)
+{
+    DIR *dir = opendir(len ? walk->path : "/");
+    struct dirent *entry;
+
+    if (!dir)
+	return;
+    while ((entry = readdir(dir))) {
+	const char *name = entry->d_name;
+	size_t namelen = strlen(name);
+	struct stat statb;
+	if (name[0] == '.' && (!name[1] || name[1] == '.' && !name[2]))
+	    continue;
+	if (len + 1 + namelen >= sizeof(walk->path))
+	    continue;
+	walk->path[len] = '/';
+	memcpy(walk->path + len + 1, name, namelen + 1);
+	if (lstat(walk->path, &statb))
+	    continue;
+	if (S_ISDIR(statb.st_mode)) {
+	    if (statb.st_dev == walk->dev &&
+		!volatile_tree(walk, len, name))
+		find_orphans(walk, len + 1 + namelen);
+	    continue;
+	}
+	// Paths in the index have no leading slash.
+	const char *dirpath = walk->path + walk->root;
+	while (*dirpath == '/')
+	    dirpath++;
+	size_t dirlen = walk->path + len > dirpath ?
+	    walk->path + len - dirpath : 0;
+	if (!find_slot(walk->index, KEY_PATH, dirpath, dirlen, name, namelen)) {
+	    lua_pushstring(walk->L, walk->path + walk->root);
+	    lua_rawseti(walk->L, -2, ++walk->count);
+	}
+    }
+    closedir(dir);
+    walk->path[len] = 0;
+}
+
+// index:orphans(root, directory) returns the files under directory in
+// the installation at root which no package owns.  Paths are given
+// relative to root.
+LUAFN(index_orphans)
+{
+    file_index *index = check_index(L);
+    size_t rootlen, dirlen;
+    const char *root = luaL_checklstring(L, 2, &rootlen);
+    const char *directory = luaL_optlstring(L, 3, "/", &dirlen);
+    orphan_walk *walk = malloc(sizeof(orphan_walk));
+
+    if (!walk)
+	return luaL_error(L, "%s", strerror(ENOMEM));
+    while (rootlen > 0 && root[rootlen - 1] == '/')
+	rootlen--;
+    while (dirlen > 0 && directory[dirlen - 1] == '/')
+	dirlen--;
+    if (rootlen + 1 + dirlen >= sizeof(walk->path)) {
+	free(walk);
+	return luaL_error(L, "Path too long");
+    }
+    walk->L = L;
+    walk->index = index;
+    walk->root = rootlen;
+    walk->count = 0;
+    memcpy(walk->path, root, rootlen);
+    size_t len = rootlen;
+    if (dirlen > 0 && directory[0] != '/')
+	walk->path[len++] = '/';
+    memcpy(walk->path + len, directory, dirlen);
+    walk->path[len + dirlen] = 0;
+    lua_newtable(L);
+    struct stat statb;
+    if (!stat(len + dirlen ? walk->path : "/", &statb)) {
+	walk->dev = statb.st_dev;
+	find_orphans(walk, len + dirlen);
+    }
+    free(walk);
+    return 1;
+}
+
+LUAFN(index_close)
+{
+    file_index *index = luaL_checkudata(L, 1, INDEX_META);
+
+    if (index->image) {
+	if (index->mapped)
+	    munmap(index->image, index->size);
+	else
+	    free(index->image);
+	index->image = NULL;
+    }
+    return 0;
+}
+
+int luaopen_fileindex(lua_State *L)
+{
+    static const luaL_Reg funcptrs[] = {
+	FN_ENTRY(read_manifest),
+	FN_ENTRY(read_installation),
+	FN_ENTRY(open_index),
+	{ NULL, NULL }
+    };
+
+    static const luaL_Reg job_methods[] = {
+	{ "ready", lua_fn_job_ready },
+	{ "result", lua_fn_job_result },
+	{ NULL, NULL }
+    };
+
+    static const luaL_Reg index_methods[] = {
+	{ "which", lua_fn_index_which },
+	{ "sonames", lua_fn_index_sonames },
+	{ "stems", lua_fn_index_stems },
+	{ "orphans", lua_fn_index_orphans },
+	{ "close", lua_fn_index_close },
+	{ NULL, NULL }
+    };
+
+    luaL_newmetatable(L, JOB_META);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, lua_fn_job_gc);
+    lua_setfield(L, -2, "__gc");
+    luaL_register(L, NULL, job_methods);
+    lua_pop(L, 1);
+
+    luaL_newmetatable(L, INDEX_META);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, lua_fn_index_close);
+    lua_setfield(L, -2, "__gc");
+    luaL_register(L, NULL, index_methods);
+    lua_pop(L, 1);
+
+    luaL_register(L, "fileindex", funcptrs);
+    return 1;
+}
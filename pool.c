@@ -0,0 +1,69 @@
+#include <pthread.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include "pool.h"
+
+// Sanity limit for a thread count given by a caller.
+#define MAX_THREADS 256
+
+struct pool {
+    pthread_mutex_t lock;
+    size_t next, count;
+    void (*work)(void *context, size_t index);
+    void *context;
+};
+
+static void *worker(void *arg)
+{
+    struct pool *pool = arg;
+
+    for (;;) {
+	pthread_mutex_lock(&pool->lock);
+	size_t index = pool->next++;
+	pthread_mutex_unlock(&pool->lock);
+	if (index >= pool->count)
+	    return NULL;
+	pool->work(pool->context, index);
+    }
+}
+
+int pool_run(size_t count, int threads,
+	     void (*work)(void *context, size_t index), void *context)
+{
+    struct pool pool = { .next = 0, .count = count,
+			 .work = work, .context = context };
+
+    if (threads <= 0)
+	threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads <= 0)
+	threads = 1;
+    if (threads > MAX_THREADS)
+	threads = MAX_THREADS;
+    if (threads > count)
+	threads = count;
+    // Not worth a thread.
+    if (threads <= 1) {
+	for (size_t i = 0; i < count; i++)
+	    work(context, i);
+	return 0;
+    }
+
+    pthread_t *tids = malloc(threads * sizeof(pthread_t));
+    if (!tids)
+	return -1;
+    pthread_mutex_init(&pool.lock, NULL);
+    int started;
+    for (started = 0; started < threads; started++)
+	if (pthread_create(&tids[started], NULL, worker, &pool))
+	    break;
+    if (started == 0) {
+	pthread_mutex_destroy(&pool.lock);
+	free(tids);
+	return -1;
+    }
+    for (int i = 0; i < started; i++)
+	pthread_join(tids[i], NULL);
+    pthread_mutex_destroy(&pool.lock);
+    free(tids);
+    return 0;
+}
@@ -0,0 +1,12 @@
+#ifndef __POOL_H__
+#define __POOL_H__
+#include <stddef.h>
+
+// Run work(context, index) for every index below count on up to
+// threads worker threads, and wait for them all.  Work functions
+// mustn't touch the Lua state.  A thread count of zero or less means
+// one per online CPU.  Returns 0, or -1 if no thread could be started,
+// in which case nothing has run.
+int pool_run(size_t count, int threads,
+	     void (*work)(void *context, size_t index), void *context);
+#endif
@@ -2,65 +2,115 @@ local function case_insensitive_less_than(a,b)
    return string.lower(a) < string.lower(b)
 end
 
-local make_tmpdir, rm_tmpdir
-do
-   local tmpdir, tmpdirlen
-   function make_tmpdir()
-      if not tmpdir then
-	 local pipe = io.popen 'mktemp -d 2>&-'
-	 local dirname
-	 if pipe then
-	    tmpdir = pipe:read '*l'
-	    tmpdirlen = #tmpdir
-	    pipe:close()
+-- Archive scans are kept across sessions, keyed by archive checksum.
+local elf_cache
+local function get_elf_cache()
+   if elf_cache == nil then
+      elf_cache = elfutil.open_cache(cache_directory()) or false
+   end
+   return elf_cache
+end
+
+-- The directories the loader searches when ld.so.cache fails it.
+local trusted_directories = { '/lib', '/lib64', '/usr/lib', '/usr/lib64' }
+
+-- Add the directories named in an ld.so.conf under root to the list,
+-- following its includes.
+local function read_ld_so_conf(root, file, directories, seen, depth)
+   local conf = depth <= 8 and io.open(root..file)
+   if not conf then return end
+   for line in conf:lines() do
+      line = line:gsub('#.*', '')
+      local include = line:match '^%s*include%s+(.*)$'
+      if include then
+	 for pattern in include:gmatch '%S+' do
+	    if pattern:sub(1, 1) ~= '/' then
+	       pattern = file:match '^(.*)/'..'/'..pattern
+	    end
+	    for _, match in ipairs(util.glob(root..pattern) or {}) do
+	       read_ld_so_conf(root, match:sub(#root + 1), directories, seen,
+			       depth + 1)
+	    end
+	 end
+      elseif not line:match '^%s*hwcap%s' then
+	 -- Old style type suffixes are ignored.
+	 for directory in line:gsub('=%S*', ''):gmatch '[^%s:,]+' do
+	    directory = directory:gsub('/+$', '')
+	    if not seen[directory] then
+	       seen[directory] = true
+	       table.insert(directories, directory)
+	    end
 	 end
       end
-      return tmpdir, tmpdirlen
    end
-   function rm_tmpdir()
-      if tmpdir then
-	 os.execute('rm -rf '..tmpdir)
-	 tmpdir = nil
+   conf:close()
+end
+
+-- The directories of ld.so.conf under root, relative to it.
+local function configured_directories(root)
+   local directories = {}
+   read_ld_so_conf(root, '/etc/ld.so.conf', directories, {}, 0)
+   return directories
+end
+
+-- The real paths of the directories the loader searches under root:
+-- the standard ones, then those named in ld.so.conf.
+local function library_directories(root)
+   local paths, seen = {}, {}
+   for _, directories in ipairs { trusted_directories,
+				  configured_directories(root) } do
+      for _, line in ipairs(directories) do
+	 local pathname = util.realpath(root..line)
+	 if pathname and not seen[pathname] then
+	    seen[pathname] = true
+	    table.insert(paths, pathname)
+	 end
       end
    end
+   return paths
+end
+
+-- The loader's view of the libraries under root, which is '' for /:
+-- search:lookup(soname[, class]) gives the paths it may be had at.
+local function library_search(root)
+   return elfutil.library_search(root, configured_directories(root),
+				 trusted_directories)
 end
 
 function _G.read_archive(archive_file, myprint, mygetch)
    local print = myprint or print
    local getch = mygetch or getch
+
+   -- Bring needed up to date with changes from the core.
+   local function apply(self, changes)
+      local needed = self.needed
+      for _, change in ipairs(changes) do
+	 local elf, name, unresolved = change[1], change[2], change[3]
+	 if unresolved then
+	    needed[name] = needed[name] or {}
+	    needed[name][elf] = true
+	 elseif needed[name] then
+	    needed[name][elf] = nil
+	    if not next(needed[name]) then needed[name] = nil end
+	 end
+      end
+   end
+
    local function satisfy(self, root, myprint, mygetch)
       print = myprint or print
       getch = mygetch or getch
-      local root = root or ''
-      local paths, seen = {}, {}
-      for _, line in ipairs { '/lib', '/lib64', '/usr/lib', '/usr/lib64' } do
-	 local pathname = util.realpath(root..line)
-	 if pathname then
-	    seen[pathname] = true
-	    table.insert(paths, pathname)
-	 end
-      end
-      local ldsoconf = io.open(root..'/etc/ld.so.conf')
-      if ldsoconf then
-	 for line in ldsoconf:lines() do
-	    local pathname = util.realpath(root..line)
-	    if pathname and not seen[pathname] then
-	       seen[pathname] = true
-	       table.insert(paths, pathname)
-	    end
-	 end
-	 ldsoconf:close()
-      end
-      seen = nil
+      local search = library_search(root or '')
       local remove = {}
       local removes
       for needed in pairs(self.needed) do
-	 local satisfied = {}
-	 for _, path in ipairs(paths) do
-	    if util.lib_exists(path..'/'..needed) then
-	       table.insert(satisfied, path);
+	 local satisfied, seen = {}, {}
+	 for _, path in ipairs(search:lookup(needed)) do
+	    local directory = path:match '^(.*)/[^/]*$'
+	    if not seen[directory] then
+	       seen[directory] = true
+	       table.insert(satisfied, directory)
 	       remove[needed] = true
-	       removes = true;
+	       removes = true
 	    end
 	 end
 	 if #satisfied == 1 then
@@ -78,21 +128,18 @@ function _G.read_archive(archive_file, myprint, mygetch)
 	 getch('Remove satisfied needs? (y/N):',  '[YyNn\n\4]', 'n')
       if confirm == '\4' or confirm:upper() == 'N' then return end
       for needed in pairs(remove) do
-	 self.needed[needed] = nil
+	 apply(self, self.core:satisfy(needed))
       end
    end
 
    local function clone(self)
-      local new = create()
-      for sum in pairs(self.archivesums) do
-	 new.archivesums[sum] = true
+      local new = create(self.core:clone())
+      for sum, count in pairs(self.archivesums) do
+	 new.archivesums[sum] = count
       end
       for path, name in pairs(self.elfpaths) do
 	 new.elfpaths[path] = name
       end
-      for soname in pairs(self.sonames) do
-	 new.sonames[soname] = true
-      end
       for _, elf in ipairs(self.elfs) do
 	 table.insert(new.elfs, elf)
       end
@@ -101,24 +148,26 @@ function _G.read_archive(archive_file, myprint, mygetch)
 	 for elf in pairs(elftable) do newelfs[elf] = true end
 	 new.needed[name] = newelfs
       end
+      for number, loaded in pairs(self.loaded) do
+	 new.loaded[number] = loaded
+      end
       return new
    end
 
+   local function find_archive(archive_file)
+      local matches=util.glob(archive_file..'.t?z')
+      if not matches or #matches ~= 1 then
+	 print('Can\'t find archive for '..archive_file)
+	 return
+      end
+      return matches[1]
+   end
+
    local function extend(self, archive_file, myprint, mygetch)
       local print = myprint or print
       local getch = mygetch or getch
-      local std_search = {
-	 ['/lib']=true, ['/lib64']=true,
-	 ['/usr/lib']=true, ['/usr/lib64']=true
-      }
-      do
-	 local matches=util.glob(archive_file..'.t?z')
-	 if not matches or #matches ~= 1 then
-	    print('Can\'t find archive for '..archive_file)
-	    return
-	 end
-	 archive_file = matches[1]
-      end
+      archive_file = find_archive(archive_file)
+      if not archive_file then return end
       local decompose_archive_name =
 	 '([^/]+)/([^/]+)%-[^/-]+%-[^/-]+%-[^/-]+%.t.z$'
 
@@ -131,79 +180,83 @@ function _G.read_archive(archive_file, myprint, mygetch)
       end
    
       local elfs = self.elfs
-      local sonames = self.sonames
-      local needed = self.needed
       local elfpaths = self.elfpaths
-      local tmpdir, len = make_tmpdir()
-      tmpdir=tmpdir..'/'
       local conflicts
 
-      local inodes_read = {}
-      os.execute('ROOT=$(readlink -f '..tmpdir..') installpkg 2>&- 1>&-'..
-		    archive_file)
-      local findproc = io.popen('find -L '..tmpdir..
-				   ' ! -type d -printf "%D,%i %p\n" 2>&-')
-      for line in findproc:lines() do
-	 local inode, name = line:match('^([^%s]+) (.*)$')
-	 local elf =
-	    inodes_read[inode] == nil and (elfutil.scan_elf(name) or false)
-	 if elf then
-	    inodes_read[inode] = elf
-	    elf.path = name:sub(len+1)
-	    elf.category, elf.package =
-	       archive_file:match(decompose_archive_name)
-	    if elfpaths[elf.path] then
-	       print('Potential conflict for '..elf.path..' in '..elf.package)
-	       local path=elfpaths[elf.path]
-	       if tmpdir == path:sub(1,#tmpdir) then
-		  path="$WORKDIR/"..path:sub(#tmpdir+1)
-	       end
-	       print('Exists already as '..path)
-	       conflicts = true
-	    end
-	    elfpaths[elf.path] = name
-	    table.insert(elfs, elf)
-	    if elf.soname and std_search[elf.path:match('^(.*)/[^/]*$')] then
-	       sonames[elf.soname] = true
-	    end
-	    for _,name in ipairs(elf.needed) do
-	       if not needed[name] then needed[name] = {} end
-	       needed[name][elf] = true
-	    end
+      local cache = archivesum ~= 'X' and get_elf_cache()
+      local scanned, aliases
+      if cache then scanned, aliases = cache:lookup(archivesum) end
+      if not scanned then
+	 scanned, aliases = elfutil.scan_archive(archive_file)
+	 if not scanned then
+	    print('Can\'t read archive '..archive_file..': '..aliases)
+	    return
 	 end
+	 if cache then cache:store(archivesum, scanned, aliases) end
       end
-      os.execute('find $(readlink -f '..tmpdir..') -mindepth 1 -delete')
-      -- resolve internal needed.  (Assumes architecture matches.)
-      for soname in pairs(sonames) do needed[soname] = nil end
-      local found = {}
-      for name,elfs in pairs(needed) do
-	 local unresolved = 0
-	 for elf in pairs(elfs) do
-	    unresolved = unresolved + 1
-	    for _, path in ipairs(elf.runpath or elf.rpath or {}) do
-	       if path == '$ORIGIN' then
-		  path = elf.path:match '^(.*)/[^/]*$'
-	       elseif path:sub(1, 8) == '$ORIGIN/' then
-		  path = elf.path:match '^(.*)/[^/]*$'..'/'..altpath:sub(9)
-	       end
-	       if elfpaths[path..'/'..name] then
-		  unresolved = unresolved - 1
-	       end
-	    end
-	    if unresolved == 0 then table.insert(found, name) end
+      local category, package = archive_file:match(decompose_archive_name)
+      for _, elf in ipairs(scanned) do
+	 elf.category, elf.package = category, package
+	 if elfpaths[elf.path] then
+	    print('Potential conflict for '..elf.path..' in '..elf.package)
+	    print('Exists already in '..elfpaths[elf.path])
+	    conflicts = true
 	 end
+	 elfpaths[elf.path] = package
+	 table.insert(elfs, elf)
+      end
+      -- Links to the objects stand in for them when resolving.
+      for alias in pairs(aliases) do
+	 if not elfpaths[alias] then elfpaths[alias] = package end
       end
-      for _, found in pairs(found) do needed[found] = nil end
-      self.archivesums[archivesum] = true
+      -- The core works out what's newly resolved, or not, from what
+      -- this package provides and needs alone.  (Assumes architecture
+      -- matches.)
+      local number, changes = self.core:add(scanned, aliases)
+      apply(self, changes)
+      self.loaded[number] = { file = archive_file, sum = archivesum,
+			      elfs = scanned, aliases = aliases,
+			      package = package }
+      self.archivesums[archivesum] = (self.archivesums[archivesum] or 0) + 1
       return conflicts
    end
 
-   function create()
+   -- Take out what was loaded from an archive.
+   local function remove(self, archive_file)
+      archive_file = find_archive(archive_file)
+      if not archive_file then return end
+      for number, loaded in pairs(self.loaded) do
+	 if loaded.file == archive_file then
+	    apply(self, self.core:remove(number))
+	    self.loaded[number] = nil
+	    local gone = {}
+	    for _, elf in ipairs(loaded.elfs) do gone[elf] = true end
+	    for i = #self.elfs, 1, -1 do
+	       if gone[self.elfs[i]] then table.remove(self.elfs, i) end
+	    end
+	    local count = self.archivesums[loaded.sum] - 1
+	    self.archivesums[loaded.sum] = count > 0 and count or nil
+	 end
+      end
+      -- What's left decides who has each path.
+      self.elfpaths = {}
+      for _, elf in ipairs(self.elfs) do
+	 self.elfpaths[elf.path] = elf.package
+      end
+      for _, loaded in pairs(self.loaded) do
+	 for alias in pairs(loaded.aliases) do
+	    self.elfpaths[alias] = self.elfpaths[alias] or loaded.package
+	 end
+      end
+   end
+
+   function create(core)
       return make_object('archive_set', {
-	 archivesums = {}, elfs = {}, sonames = {}, needed = {},
-	 elfpaths = {},
+	 archivesums = {}, elfs = {}, needed = {}, elfpaths = {},
+	 loaded = {},
+	 core = core or elfutil.archive_core(trusted_directories),
 	 clone = clone, satisfy = satisfy, extend = extend,
-	 cleanup=rm_tmpdir })
+	 remove = remove })
    end
 
    local new = create()
@@ -212,56 +265,348 @@ function _G.read_archive(archive_file, myprint, mygetch)
 end
 
 
--- Assumes architecture matches.  When is this a bad thing?
-
+-- Archive scans by checksum, as the ELF cache gives them, for the
+-- session.
+local archive_scans = {}
 
-function _G.read_manifest(archive_directory)
-   local archpat = '^||   Package:  '..
-      '%./([^/]+)/([^/]+)%-([^/-]+)%-([^/-]+)%-([^/-]+)%.t.z'
-   local eoh = '++========================================'
-   local associations = {}
-   local input = io.popen('bzcat '..archive_directory..'/MANIFEST.bz2')
-   local state = 0
-   local category, tag, version, arch, build
-   for line in input:lines() do
-      if state == 0 then
-	 category, tag, version, arch, build = line:match(archpat)
-	 if category then state = 1 end
-      elseif state == 1 then
-	 state = 2
-      elseif state == 2 then
-	 if line ~= eoh then
-	    print('I got lost reading the manifest.  Line was: '..line)
-	    return
+-- The package archives in a distribution tree, which keeps them no
+-- more than a few directories down (as in testing/packages/*).
+local function find_archives(directory)
+   local files, pattern = {}, directory
+   for depth = 1, 4 do
+      pattern = pattern..'/*'
+      for _, file in ipairs(util.glob(pattern..'.t?z') or {}) do
+	 if file:match '/[^/]+%-[^/-]+%-[^/-]+%-[^/-]+%.t.z$' then
+	    table.insert(files, file)
 	 end
-	 state = 3
-      elseif state == 3 then
-	 if line == '' then
-	    state = 0
+      end
+   end
+   return files
+end
+
+-- Hash the archives from directory on worker threads.  The hashes are
+-- kept in the cache directory for as long as the files look unchanged,
+-- so a tree that's only been synced is mostly not read again.
+local function hash_archives(directory, files, threads)
+   local memo_file = cache_directory()..'/archives-'..
+      directory:gsub('[%%/]', { ['%'] = '%25', ['/'] = '%2F' })..'.sums'
+   local memo = {}
+   local input = io.open(memo_file)
+   if input then
+      for line in input:lines() do
+	 local key, sum = line:match '^(%S+) (%S+)$'
+	 if key then memo[key] = sum end
+      end
+      input:close()
+   end
+   local sums = util.xxhsum_many(files, { threads = threads, memo = memo })
+   -- Only what's still in the tree is worth remembering.
+   local current = {}
+   for _, sum in pairs(sums) do current[sum] = true end
+   local output = io.open(memo_file..'.new', 'w')
+   if output then
+      for key, sum in pairs(memo) do
+	 if current[sum] then output:write(key, ' ', sum, '\n') end
+      end
+      output:close()
+      os.rename(memo_file..'.new', memo_file)
+   end
+   return sums
+end
+
+-- Scan the archives neither in the ELF cache nor seen this session on
+-- worker threads, storing them in the cache, and with keep, for the
+-- session too.  Returns the count scanned.
+local function index_archives(files, sums, threads, keep)
+   local cache = get_elf_cache()
+   local missing, seen = {}, {}
+   for _, file in ipairs(files) do
+      local sum = sums[file]
+      if sum == 'X' then
+	 print('Can\'t read archive '..file)
+      elseif not seen[sum] and not archive_scans[sum] and
+	 not (cache and cache:has(sum)) then
+	 seen[sum] = true
+	 table.insert(missing, file)
+      end
+   end
+   if #missing == 0 then return 0 end
+   print('Scanning '..#missing..' archives not yet indexed...')
+   -- In batches, so what's been scanned is kept if we're interrupted.
+   local scanned, batch = 0, 128
+   for first = 1, #missing, batch do
+      local files = { unpack(missing, first,
+			     math.min(first + batch - 1, #missing)) }
+      local elfs, aliases, errors =
+	 elfutil.scan_archives(files, { threads = threads })
+      if not elfs then
+	 print('Can\'t scan archives: '..aliases)
+	 break
+      end
+      for i, file in ipairs(files) do
+	 local sum = sums[file]
+	 if not elfs[i] then
+	    print('Can\'t read archive '..file..': '..errors[i])
 	 else
-	    local dir,file = line:match('(.+)/([^/]+)$',49)
-	    if dir and (file:sub(-3) == '.so' or
-			file:match('%.so%.[.0-9]+$')) then
-	       local stem = file:match '^([%a_%-]*[%a])'
-	       
-	       local assoc = associations[stem]
-	       if not assoc then
-		  assoc = {}
-		  associations[stem] = assoc
+	    if cache then cache:store(sum, elfs[i], aliases[i]) end
+	    if keep or not cache then
+	       archive_scans[sum] = { elfs = elfs[i], aliases = aliases[i] }
+	    end
+	    scanned = scanned + 1
+	 end
+      end
+   end
+   return scanned
+end
+
+-- Bring the ELF cache up to date with every package archive in a
+-- distribution tree, so that what each package provides and needs can
+-- be had without reading it again.  Archives are hashed and scanned on
+-- worker threads, and only those not seen before are scanned.
+-- Options: threads.  Returns the counts of archives found and scanned.
+function _G.build_dependency_db(directory, options)
+   options = options or {}
+   if not get_elf_cache() then
+      print 'Can\'t open the ELF cache'
+      return
+   end
+   directory = util.realpath(directory)
+   if not directory then
+      print 'No such directory'
+      return
+   end
+   local files = find_archives(directory)
+   local sums = hash_archives(directory, files, options.threads)
+   local scanned = index_archives(files, sums, options.threads)
+   print(('%d archives in the tree, %d scanned'):format(#files, scanned))
+   return #files, scanned
+end
+
+-- The scans of every package archive in the tagset's tree, by tag, and
+-- for each soname and path, the packages providing it.  Archives not
+-- yet in the ELF cache are scanned into it.  Options: threads.
+function _G.dependency_index(tagset, options)
+   options = options or {}
+   if not tagset.directory then
+      print 'Tagset has no package directory'
+      return
+   end
+   local files, tags = {}, {}
+   for _, file in ipairs(util.glob(tagset.directory..'/*/*.t?z') or {}) do
+      local tag = file:match '/([^/]+)%-[^/-]+%-[^/-]+%-[^/-]+%.t.z$'
+      if tag and tagset.tags[tag] then
+	 table.insert(files, file)
+	 tags[file] = tag
+      end
+   end
+   local directory = util.realpath(tagset.directory) or tagset.directory
+   local sums = hash_archives(directory, files, options.threads)
+   index_archives(files, sums, options.threads, true)
+   local cache = get_elf_cache()
+   for _, file in ipairs(files) do
+      local sum = sums[file]
+      if not archive_scans[sum] and cache and sum ~= 'X' then
+	 local elfs, aliases = cache:lookup(sum)
+	 if elfs then
+	    archive_scans[sum] = { elfs = elfs, aliases = aliases }
+	 end
+      end
+   end
+
+   local trusted = {}
+   for _, dir in ipairs(trusted_directories) do trusted[dir] = true end
+   local packages, providers = {}, {}
+   local function provide(key, tag)
+      providers[key] = providers[key] or {}
+      providers[key][tag] = true
+   end
+   for _, file in ipairs(files) do
+      local tag, scan = tags[file], archive_scans[sums[file]]
+      if scan then
+	 packages[tag] = scan
+	 for _, elf in ipairs(scan.elfs) do
+	    elf.package = tag
+	    provide(elf.path, tag)
+	    if elf.soname and trusted[elf.path:match '^(.*)/[^/]*$'] then
+	       provide(elf.soname, tag)
+	    end
+	 end
+	 for alias in pairs(scan.aliases) do provide(alias, tag) end
+      end
+   end
+   return make_object('dependency_index',
+		      { packages = packages, providers = providers })
+end
+
+-- Order { package, path, name } triples.
+local function need_less_than(a, b)
+   if a[1] ~= b[1] then return a[1] < b[1] end
+   if a[2] ~= b[2] then return a[2] < b[2] end
+   return a[3] < b[3]
+end
+
+-- Choose packages to add to the tagset's ADD packages so that every
+-- DT_NEEDED among them is satisfied.  The package satisfying most
+-- needs is taken each time, and any then found to be redundant are
+-- dropped again.  Returns the packages chosen, each as { tag, reasons },
+-- where a reason is { package, path, name } for a need nothing else
+-- chosen satisfies.  The second value returned is the list of needs
+-- nothing satisfies, each as { package, path, name } too.  Options:
+-- root, whose libraries count as there already; threads; add, to set
+-- the packages chosen to ADD.
+function _G.dependency_closure(tagset, options)
+   options = options or {}
+   local index = dependency_index(tagset, options)
+   if not index then return end
+   local search
+   if options.root then
+      local root = util.realpath(options.root)
+      if not root then
+	 print('Invalid root: '..options.root)
+	 return
+      end
+      search = library_search(root == '/' and '' or root)
+   end
+
+   local core = elfutil.archive_core(trusted_directories)
+   local members = {}
+   for tag, tuple in pairs(tagset.tags) do
+      local package = index.packages[tag]
+      if tuple.state == 'ADD' and package then
+	 members[tag] = core:add(package.elfs, package.aliases)
+      end
+   end
+
+   -- Whether a need is left for the tree to satisfy.
+   local found = {}
+   local function wanted(elf, name)
+      if not search then return true end
+      local key = name..'\0'..(elf.class or 0)
+      if found[key] == nil then
+	 found[key] = #search:lookup(name, elf.class) > 0
+      end
+      return not found[key]
+   end
+   local function unresolved()
+      local needs = {}
+      for _, need in ipairs(core:unresolved()) do
+	 if wanted(need[1], need[2]) then table.insert(needs, need) end
+      end
+      return needs
+   end
+
+   local order, reasons = {}, {}
+   while true do
+      local needs, counts, best = unresolved(), {}
+      for _, need in ipairs(needs) do
+	 local seen = {}
+	 for _, key in ipairs(need[3]) do
+	    for tag in pairs(index.providers[key] or {}) do
+	       if not members[tag] and not seen[tag] then
+		  seen[tag] = true
+		  counts[tag] = (counts[tag] or 0) + 1
 	       end
-	       table.insert(assoc, {file,tag})
 	    end
 	 end
       end
-      ::cont::
+      for tag, count in pairs(counts) do
+	 if not best or count > counts[best] or
+	    count == counts[best] and tag < best then
+	    best = tag
+	 end
+      end
+      if not best then break end
+      local package = index.packages[best]
+      members[best] = core:add(package.elfs, package.aliases)
+      table.insert(order, best)
    end
-   
+
+   -- Taken greedily, a package may be made redundant by those after.
+   -- Those that aren't are needed for what only they satisfy.
+   for i = #order, 1, -1 do
+      local tag = order[i]
+      local needs = {}
+      for _, change in ipairs(core:remove(members[tag])) do
+	 local elf, name = change[1], change[2]
+	 if change[3] and wanted(elf, name) then
+	    table.insert(needs, { elf.package, elf.path, name })
+	 end
+      end
+      if #needs > 0 then
+	 local package = index.packages[tag]
+	 members[tag] = core:add(package.elfs, package.aliases)
+	 reasons[tag] = needs
+      else
+	 members[tag] = nil
+      end
+   end
+
+   local chosen, tags = {}, {}
+   for _, tag in ipairs(order) do
+      if reasons[tag] then
+	 table.sort(reasons[tag], need_less_than)
+	 table.insert(chosen, { tag, reasons[tag] })
+	 table.insert(tags, tag)
+      end
+   end
+   table.sort(chosen, function (a, b)
+		 return case_insensitive_less_than(a[1], b[1]) end)
+   local unsatisfied = {}
+   for _, need in ipairs(unresolved()) do
+      table.insert(unsatisfied, { need[1].package, need[1].path, need[2] })
+   end
+   table.sort(unsatisfied, need_less_than)
+   core:close()
+   if options.add and #tags > 0 then tagset:set_state(tags) end
+   return chosen, unsatisfied
+end
+
+-- Assumes architecture matches.  When is this a bad thing?
+
+
+-- The manifest is indexed on a background thread, and the index is
+-- kept in the cache directory under the manifest's checksum.  Pass
+-- background to get the manifest object back at once; its ready
+-- method says whether the index is there yet.
+function _G.read_manifest(archive_directory, background)
+   local manifest_file = archive_directory..'/MANIFEST.bz2'
+   local manifestsum = util.xxhsum_file(manifest_file)
+   local index_file = manifestsum ~= 'X' and
+      cache_directory()..'/manifest-'..manifestsum..'.idx'
+   local index = index_file and fileindex.open_index(index_file)
+   local job = not index and
+      fileindex.read_manifest(manifest_file, index_file or nil)
+
+   local function get_index()
+      if job then
+	 local err
+	 index, err = job:result()
+	 if not index then
+	    print('Can\'t read the manifest: '..err)
+	    index = false
+	 end
+	 job = nil
+      end
+      return index
+   end
+
+   local function ready(self)
+      return not job or job:ready()
+   end
+
+   -- Return the tags of packages in the tree which ship path.
+   local function which(self, path)
+      local index = get_index()
+      if index then return index:which(path) end
+   end
+
    local function get_suggestions (self, archiveset)
       if object_type[archiveset] ~= 'archive_set' then
 	 print 'Argument must be an archive set'
 	 return
       end
-      local associations = self.associations
+      local index = get_index()
+      if not index then return {} end
       local function bad_offer(needed, offered)
 	 local offer = bad_offers[offered]
 	 if offer then
@@ -277,9 +622,13 @@ function _G.read_manifest(archive_directory)
       local nomatch = {}
       for needed, neededby in pairs(archiveset.needed) do
 	 local stem = needed:match '^([%a_%-]*[%a])'
-	 local candidates = associations[stem]
-	 if not candidates then
-	    nomatch[stem] = true;
+	 -- Exact soname matches first, then anything with the stem.
+	 local candidates = index:sonames(needed)
+	 if #candidates == 0 and stem then
+	    candidates = index:stems(stem)
+	 end
+	 if #candidates == 0 then
+	    nomatch[needed] = true;
 	 else
 	    for _, candidate in ipairs(candidates) do
 	       if not bad_offer(needed, candidate[2]) then
@@ -328,7 +677,321 @@ function _G.read_manifest(archive_directory)
       end
    end
    
-   return make_object('manifest',
-		      { suggest = suggest, get_suggestions = get_suggestions,
-			associations = associations })
+   local manifest =
+      make_object('manifest',
+		  { suggest = suggest, get_suggestions = get_suggestions,
+		    ready = ready, which = which })
+   if not background then get_index() end
+   return manifest
+end
+
+-- Scan the ELF objects installed under root and link each DT_NEEDED to
+-- the file the loader would choose for it, giving a graph which answers
+-- what needs what.  Paths in the graph are relative to root.  owner(path)
+-- gives the package owning a file, if that's known.  Options: threads.
+function _G.scan_installed_elfs(root, options, owner)
+   options = options or {}
+   root = util.realpath(root or '/')
+   if not root then
+      print 'Invalid root for scan'
+      return
+   end
+   local prefix = root == '/' and '' or root
+   local function relative(path) return path:sub(#prefix + 1) end
+
+   local walked, seen = {}, {}
+   for _, pathname in ipairs(library_directories(prefix)) do
+      seen[pathname] = true
+      table.insert(walked, pathname)
+   end
+   for _, line in ipairs { '/bin', '/sbin', '/usr/bin', '/usr/sbin' } do
+      local pathname = util.realpath(prefix..line)
+      if pathname and not seen[pathname] then
+	 seen[pathname] = true
+	 table.insert(walked, pathname)
+      end
+   end
+
+   -- Every ELF object under the walked directories, by way of links
+   -- too.  files maps each name found onto the first name of the same
+   -- file.  Each batch is scanned as it comes.
+   local files, elfs, elf_at, failed = {}, {}, {}, {}
+   local walker = elfutil.walk_elfs(walked)
+   while true do
+      local paths, aliases = walker:next(1024)
+      if not paths then break end
+      for alias, path in pairs(aliases) do
+	 files[relative(alias)] = relative(path)
+      end
+      local scanned, errors =
+	 elfutil.scan_many(paths, { threads = options.threads })
+      if not scanned then
+	 print('Can\'t scan: '..errors)
+	 return
+      end
+      for i, err in pairs(errors) do failed[relative(paths[i])] = err end
+      for i, elf in ipairs(scanned) do
+	 local first = relative(paths[i])
+	 files[first] = first
+	 if elf then
+	    -- Name it by its real path, which is what packages list.
+	    elf.path = relative(util.realpath(paths[i]) or paths[i])
+	    elf.package = owner and owner(elf.path)
+	    elf.provider = {}
+	    elfs[elf.path] = elf
+	    elf_at[first] = elf
+	 end
+      end
+   end
+
+   local function under_walk(dir)
+      for _, pathname in ipairs(walked) do
+	 local top = relative(pathname)
+	 if dir == top or dir:sub(1, #top + 1) == top..'/' then
+	    return true
+	 end
+      end
+   end
+   local covered = setmetatable({}, { __index = function(t, dir)
+      t[dir] = under_walk(dir) or false
+      return t[dir]
+   end })
+
+   local function expand(dir, elf)
+      local origin = elf.path:match '^(.*)/[^/]*$'
+      local lib = elf.class == 64 and 'lib64' or 'lib'
+      return (dir:gsub('%$(%b{})', function (name)
+		 return '$'..name:sub(2, -2) end)
+		 :gsub('%$ORIGIN', origin):gsub('%$LIB', lib))
+   end
+
+   -- The path of the file the loader picks, or nil.
+   local loader = library_search(prefix)
+
+   local function usable(provider, elf)
+      -- The loader passes over objects of the wrong class.
+      return provider.class == elf.class and provider.machine == elf.machine
+   end
+
+   -- The provider at path for elf, if there's a usable one.
+   local function provider_at(path, elf)
+      local first = files[path]
+      if first then
+	 local provider = elf_at[first]
+	 return provider and usable(provider, elf) and provider.path
+      end
+      local dir = path:match '^(.*)/[^/]*$'
+      local real = not covered[dir] and util.realpath(prefix..path)
+      if not real then return end
+      -- Reached by a link from outside the walk, or not walked at all,
+      -- in which case it wasn't scanned either.
+      real = relative(real)
+      local provider = elfs[real]
+      if not provider then return real end
+      return usable(provider, elf) and real
+   end
+
+   -- The path of the file the loader picks, or nil.
+   local function resolve(elf, name)
+      if name:sub(1, 1) == '/' then
+	 return provider_at(name, elf) or nil
+      elseif name:find '/' then
+	 -- Relative to wherever the program happens to be run.
+	 return
+      end
+      local dirs = {}
+      if elf.rpath and not elf.runpath then
+	 for _, dir in ipairs(elf.rpath) do table.insert(dirs, dir) end
+      end
+      for _, dir in ipairs(elf.runpath or {}) do table.insert(dirs, dir) end
+      for _, dir in ipairs(dirs) do
+	 local provider = provider_at(expand(dir, elf)..'/'..name, elf)
+	 if provider then return provider end
+      end
+      for _, path in ipairs(loader:lookup(name, elf.class)) do
+	 local provider = provider_at(path, elf)
+	 if provider then return provider end
+      end
+   end
+
+   local users = {}
+   for path, elf in pairs(elfs) do
+      for _, name in ipairs(elf.needed) do
+	 local provider = resolve(elf, name) or false
+	 elf.provider[name] = provider
+	 if provider then
+	    users[provider] = users[provider] or {}
+	    users[provider][path] = true
+	 end
+      end
+   end
+
+   local function sorted_keys(set)
+      local keys = {}
+      for key in pairs(set) do table.insert(keys, key) end
+      table.sort(keys)
+      return keys
+   end
+
+   -- The objects needing path directly.
+   local function needed_by(self, path)
+      return sorted_keys(users[path] or {})
+   end
+
+   -- Each need nothing satisfies, with the objects having it.
+   local function unsatisfied(self)
+      local needs = {}
+      for path, elf in pairs(elfs) do
+	 for name, provider in pairs(elf.provider) do
+	    if not provider then
+	       needs[name] = needs[name] or {}
+	       needs[name][path] = true
+	    end
+	 end
+      end
+      local sorted = {}
+      for _, name in ipairs(sorted_keys(needs)) do
+	 table.insert(sorted, { name, sorted_keys(needs[name]) })
+      end
+      return sorted
+   end
+
+   -- Each symbol version an object requires of a scanned provider
+   -- which doesn't define it, as { path, name needed, versions }.
+   -- Providers defining no versions at all are passed over, as the
+   -- loader does.
+   local function missing_versions(self)
+      local missing = {}
+      for _, path in ipairs(sorted_keys(elfs)) do
+	 local elf = elfs[path]
+	 for _, name in ipairs(sorted_keys(elf.verneed or {})) do
+	    local provider = elf.provider[name] and elfs[elf.provider[name]]
+	    if provider and provider.verdef then
+	       local defined, lacking = {}, {}
+	       for _, version in ipairs(provider.verdef) do
+		  defined[version] = true
+	       end
+	       for _, version in ipairs(elf.verneed[name]) do
+		  if not defined[version] then
+		     table.insert(lacking, version)
+		  end
+	       end
+	       if #lacking > 0 then
+		  table.insert(missing, { path, name, lacking })
+	       end
+	    end
+	 end
+      end
+      return missing
+   end
+
+   -- Each object with undefined symbols which nothing it would be bound
+   -- to defines, as { package, path, symbols }, by package.  Only
+   -- programs and libraries with a soname are checked, as plugins lean
+   -- on whatever loads them, and the scope searched is the object and
+   -- what it needs, breadth first, as the loader would have it.  Those
+   -- needing something unsatisfied are left to unsatisfied().  The
+   -- symbol tables are read the first time this is asked.
+   local unresolved
+   local function unresolved_symbols(self)
+      if unresolved then return unresolved end
+      local paths, index, files = sorted_keys(elfs), {}, {}
+      for i, path in ipairs(paths) do
+	 index[path] = i
+	 files[i] = prefix..path
+      end
+      local symbols, errors =
+	 elfutil.read_symbols(files, { threads = options.threads })
+      if not symbols then
+	 print('Can\'t read symbols: '..errors)
+	 return
+      end
+
+      -- The objects searched for the symbols of path, or nil if any of
+      -- them wasn't found or scanned.
+      local function scope(path)
+	 local queue, seen = { path }, { [path] = true }
+	 local order = { index[path] }
+	 local next = 1
+	 while queue[next] do
+	    local elf = elfs[queue[next]]
+	    next = next + 1
+	    for _, name in ipairs(elf.needed) do
+	       local provider = elf.provider[name]
+	       if not provider or not index[provider] then return end
+	       if not seen[provider] then
+		  seen[provider] = true
+		  table.insert(queue, provider)
+		  table.insert(order, index[provider])
+	       end
+	    end
+	 end
+	 return order
+      end
+
+      unresolved = {}
+      for i, path in ipairs(paths) do
+	 local elf = elfs[path]
+	 local order = (elf.interp or elf.soname) and not errors[i] and
+	    scope(path)
+	 if order then
+	    local missing = symbols:unresolved(i, order)
+	    if #missing > 0 then
+	       table.sort(missing)
+	       table.insert(unresolved,
+			    { elf.package or false, path, missing })
+	    end
+	 end
+      end
+      symbols:close()
+      table.sort(unresolved, function (a, b)
+		    if a[1] ~= b[1] then
+		       return (a[1] or '') < (b[1] or '')
+		    end
+		    return a[2] < b[2]
+      end)
+      return unresolved
+   end
+
+   -- The objects left wanting, directly or not, if the package were
+   -- removed, and the packages they belong to.
+   local function breaks(self, tag)
+      local gone, queue = {}, {}
+      for path, elf in pairs(elfs) do
+	 if elf.package == tag then
+	    gone[path] = true
+	    table.insert(queue, path)
+	 end
+      end
+      -- Providers not scanned are known to users only.
+      if owner then
+	 for provider in pairs(users) do
+	    if not elfs[provider] and owner(provider) == tag then
+	       gone[provider] = true
+	       table.insert(queue, provider)
+	    end
+	 end
+      end
+      local broken, packages = {}, {}
+      while #queue > 0 do
+	 local path = table.remove(queue)
+	 for user in pairs(users[path] or {}) do
+	    if not gone[user] then
+	       gone[user] = true
+	       broken[user] = true
+	       local package = elfs[user].package
+	       if package then packages[package] = true end
+	       table.insert(queue, user)
+	    end
+	 end
+      end
+      return sorted_keys(broken), sorted_keys(packages)
+   end
+
+   return make_object('elf_graph',
+		      { root = root, elfs = elfs, users = users,
+			errors = failed, needed_by = needed_by,
+			unsatisfied = unsatisfied, breaks = breaks,
+			missing_versions = missing_versions,
+			unresolved_symbols = unresolved_symbols })
 end
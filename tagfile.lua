@@ -37,60 +37,61 @@ function make_installation_description(object, tag, descr_file)
    end
 end
 
-function make_package_description(object, tag, descr_file)
-   local present_number = 'numfmt --to=iec '
-   local uncompressors = { tgz='zcat', tbz='bzcat', tlz='lzcat',
-			   txz='xzcat' }
+-- Lay out a package description from what's known of the package:
+-- the text of its description file (nil if that couldn't be read), the
+-- archive and the count of archives matching, and their sizes.
+function format_package_description(object, facts)
    local descr_lines = {}
-   local package_file = util.glob(descr_file:gsub('txt$', 't?z'))
-   if package_file and #package_file == 1 then
-      package_file = package_file[1]
-   end
-   local descr_file = io.open(descr_file)
-   if descr_file then
-      for line in descr_file:lines() do
+   if facts.text then
+      local text = facts.text
+      if text ~= '' and text:sub(-1) ~= '\n' then text = text..'\n' end
+      for line in text:gmatch '(.-)\n' do
 	 table.insert(descr_lines, line:match '^[^:]*: ?(.*)$')
       end
       while #descr_lines > 0 and descr_lines[#descr_lines] == '' do
 	 table.remove(descr_lines)
       end
-      descr_file:close()
    else
-      insert.table(descr_lines, '* PACKAGE DOCUMENTATION UNREADABLE *')
+      table.insert(descr_lines, '* PACKAGE DOCUMENTATION UNREADABLE *')
    end
-   if not package_file then
-      insert.table(descr_lines, '* PACKAGE FILE MISSING *')
+   if facts.matches == 0 then
+      table.insert(descr_lines, '* PACKAGE FILE MISSING *')
       return descr_lines
    end
-   if type(package_file) == 'table' then
-      insert.table(descr_lines, '* PACKAGE FILE AMBIGUOUS *')
+   if facts.matches > 1 then
+      table.insert(descr_lines, '* PACKAGE FILE AMBIGUOUS *')
       return descr_lines
    end
-   proc = io.popen(present_number..util.file_size(package_file))
-   if proc then
-      local sizes = ''
-      sizes='Compressed size: '..(proc:read '*l' or 'UNKNOWN')
-      proc:close()
+   local compressed = facts.compressed
+   local sizes='Compressed size: '..(compressed and util.iec(compressed)
+					or 'UNKNOWN')
+   if object.show_uncompressed_size then
+      local uncompressed = facts.uncompressed
+      sizes = sizes..'  Uncompressed size: '..
+	 (uncompressed and util.iec(uncompressed) or 'UNKNOWN')
+   end
+   table.insert(descr_lines, '')
+   table.insert(descr_lines, sizes)
+   return descr_lines
+end
+
+function make_package_description(object, tag, descr_file)
+   local facts = {}
+   local package_file = util.glob(descr_file:gsub('txt$', 't?z'))
+   facts.matches = package_file and #package_file or 0
+   local descr_file = io.open(descr_file)
+   if descr_file then
+      facts.text = descr_file:read '*a'
+      descr_file:close()
+   end
+   if facts.matches == 1 then
+      facts.package = package_file[1]
+      facts.compressed = util.file_size(facts.package)
       if object.show_uncompressed_size then
-	 local uncompress = uncompressors[package_file:match '(...)$']
-	 if not uncompress then
-	    insert.table(descr_lines, "No uncompressor for "..package_file)
-	    return descr_lines
-	 end
-	 local decompress_stream = io.popen(uncompress..' '..package_file)
-	 proc = io.popen(present_number..
-			    util.stream_length(decompress_stream))
-	 decompress_stream:close()
-	 if proc then
-	    sizes = sizes..'  Uncompressed size: '..
-	       (proc:read '*l' or 'UNKNOWN')
-	    proc:close()
-	 end
+	 facts.uncompressed = util.uncompressed_size(facts.package)
       end
-      table.insert(descr_lines, '')
-      table.insert(descr_lines, sizes)
    end
-   return descr_lines
+   return format_package_description(object, facts)
 end
 
 local show_matches, show_tuples, describe, like, matcher
@@ -202,6 +203,39 @@ end
 installation_global_functions = {}
 local installation_metatable = { __index = installation_global_functions }
 
+-- File indexes of installations, or the jobs building them.  Kept out
+-- of the installation so they're never saved with it.
+local installation_indexes = setmetatable({}, {__mode = 'k'})
+
+local function start_installation_index(installation)
+   if installation_indexes[installation] ~= nil then return end
+   local root = installation.root
+   if not root then
+      print 'Installation has no root to index'
+      installation_indexes[installation] = false
+      return
+   end
+   local index_file = cache_directory()..'/installation-'..
+      root:gsub('[%%/]', { ['%'] = '%25', ['/'] = '%2F' })..'.idx'
+   installation_indexes[installation] =
+      fileindex.read_installation(installation.log_directory, index_file)
+end
+
+local function installation_index(installation)
+   start_installation_index(installation)
+   local index = installation_indexes[installation]
+   if index and index.result then
+      local err
+      index, err = index:result()
+      if not index then
+	 print('Can\'t index the installation: '..err)
+	 index = false
+      end
+      installation_indexes[installation] = index
+   end
+   return index
+end
+
 do
    local igf = installation_global_functions
    local function check_other(arg)
@@ -221,6 +255,34 @@ do
 
    igf.describe = describe
 
+   -- Return the tags of the installed packages owning path.
+   function igf.which(self, path)
+      local index = installation_index(self)
+      if index then return index:which(path) end
+   end
+
+   -- Scan the ELF objects installed, giving a graph of what needs what
+   -- and which packages they're in.  Options: threads.
+   function igf.scan_elfs(self, options)
+      if not self.root then
+	 print 'Installation has no root to scan'
+	 return
+      end
+      local index = installation_index(self)
+      local function owner(path) return (index:which(path)) end
+      return scan_installed_elfs(self.root, options, index and owner)
+   end
+
+   -- Return the files under directory, or anywhere packages install,
+   -- which no installed package owns.
+   function igf.orphans(self, directory)
+      local index = installation_index(self)
+      if not index then return end
+      local orphans = index:orphans(self.root, directory)
+      table.sort(orphans)
+      return orphans
+   end
+
    function igf.reset_descriptions(self)
       for tag, package_entry in pairs(self.tags) do
 	 package_entry.description.text = nil
@@ -252,13 +314,17 @@ do
    end
 end
 
-function _G.read_installation(prefix)
+-- Given index_files, the files of each package are indexed at once on
+-- a background thread.  Otherwise that waits for the first which or
+-- orphans.
+function _G.read_installation(prefix, index_files)
    local directory = util.realpath((prefix or '')..'/var/log/packages')
    if not directory then
       print('Invalid root for installation: '..prefix)
       return
    end
-   local installed = { tags={} }
+   local installed = { tags={}, root = util.realpath(prefix or '/'),
+		       log_directory = directory }
    local globmatches, err = util.glob(directory..'/*')
    if not globmatches then
       print("Can't find installation: "..directory)
@@ -277,8 +343,10 @@ function _G.read_installation(prefix)
 				 description = { file = package_file } }
       end
    end
-   return make_object('installation',
-		      setmetatable(installed, installation_metatable))
+   make_object('installation',
+	       setmetatable(installed, installation_metatable))
+   if index_files then start_installation_index(installed) end
+   return installed
 end
 
 tagset_list = {}
@@ -291,6 +359,45 @@ local function get_instance(directory)
    return new_instance
 end
 
+-- What each tagset was last saved or reconstituted as.  Saving it to
+-- the same file again appends just the states that have changed, until
+-- there are max_save_deltas of those and the file is rewritten.
+local saved_images = setmetatable({}, {__mode = 'k'})
+local max_save_deltas = 64
+
+local function remember_save(tagset, filename, image)
+   local state, old_state = {}, {}
+   for i, tuple in ipairs(image.order) do
+      state[i], old_state[i] = tuple.state, tuple.old_state
+   end
+   saved_images[tagset] = {
+      filename = util.realpath(filename) or filename,
+      size = image.size, order = image.order, extras = image.extras,
+      deltas = image.deltas, state = state, old_state = old_state,
+      installation = tagset.installation,
+      archive = tagset.category_description }
+end
+
+-- All of a tagset but its tuples and its installation's, marshalled.
+-- The editor's last package is kept as its place in its category.
+local function encode_extras(tagset)
+   local extras = {}
+   for k,v in pairs(tagset) do extras[k] = v end
+   extras.tags, extras.categories = nil, nil
+   local installation = tagset.installation
+   extras.installation = installation and {
+      root = installation.root, log_directory = installation.log_directory }
+   extras.dirty, extras.instance = nil, nil
+   trim_editor_cache(extras)
+   local last_package = extras.last_package
+   if last_package then
+      extras.last_package = {
+	 category = last_package.category,
+	 category_index = last_package.category_index }
+   end
+   return marshal.encode(extras)
+end
+
 tagset_global_functions = {}
 local tagset_metatable = { __index = tagset_global_functions }
 
@@ -415,28 +522,97 @@ do
       if not filename:match(file_pattern) then
 	 filename=filename..'.'..file_extension
       end
+      local saved = saved_images[self]
+      if saved and saved.deltas < max_save_deltas and
+	 saved.installation == self.installation and
+	 saved.archive == self.category_description and
+	 saved.filename == (util.realpath(filename) or filename)
+      then
+	 local changed = {}
+	 for i, tuple in ipairs(saved.order) do
+	    if tuple.state ~= saved.state[i] or
+	       tuple.old_state ~= saved.old_state[i]
+	    then
+	       table.insert(changed, i)
+	    end
+	 end
+	 local extras = encode_extras(self)
+	 if extras == saved.extras then extras = nil end
+	 local size = tagfns.append(filename, saved.size, saved.order,
+				    changed, extras)
+	 if size then
+	    for _, i in ipairs(changed) do
+	       saved.state[i] = saved.order[i].state
+	       saved.old_state[i] = saved.order[i].old_state
+	    end
+	    saved.size, saved.extras = size, extras or saved.extras
+	    saved.deltas = saved.deltas + 1
+	    self.dirty = false
+	    return
+	 end
+	 -- The file was changed behind our back.  Write it afresh.
+      end
       local shallow_copy = {}
       for k,v in pairs(self) do shallow_copy[k] = v end
-      trim_editor_cache(shallow_copy)
       if not tgf.reset_descriptions(shallow_copy) then return end
-      if shallow_copy.installation then
-	 local installation = {}
-	 for k,v in pairs(shallow_copy.installation) do
-	    installation[k] = v
-	 end
-	 shallow_copy.installation = installation
-	 installation_global_functions.reset_descriptions(installation)
-      end
-      local destination, err = io.open(filename, 'w')
-      if not destination then print(err); return end
-      destination:write((require 'zstd'.new()):
-	    compress(marshal.encode(shallow_copy)))
+      local extras = encode_extras(shallow_copy)
+      local installation = shallow_copy.installation
+      local size, order =
+	 tagfns.save(filename, self.categories, self.tags,
+		     installation and installation.tags, extras)
+      if not size then print(order); return end
+      remember_save(self, filename, { size = size, order = order,
+				      extras = extras, deltas = 0 })
       self.dirty = false
-      destination:close()
    end
 
    tgf.describe = describe
 
+   -- Start making the descriptions for the tags given, or for every
+   -- tag, on worker threads.  Returns a function which fills in those
+   -- made so far, and returns true once all are; given wait, it waits
+   -- for them.  Returns nothing if there's nothing to do.
+   function tgf.prefetch_metadata_later(self, taglist, threads)
+      local files, tags = {}, {}
+      if not taglist then
+	 taglist = {}
+	 for tag in pairs(self.tags) do table.insert(taglist, tag) end
+      end
+      for _, tag in ipairs(taglist) do
+	 local tuple = self.tags[tag]
+	 local description = tuple and tuple.description
+	 if description and not description.text and
+	    not tags[description.file] then
+	    table.insert(files, description.file)
+	    tags[description.file] = tag
+	 end
+      end
+      if #files == 0 then return end
+      local uncompressed = self.show_uncompressed_size
+      local job = util.describe_packages(files, {
+	 threads = threads, uncompressed = uncompressed })
+      return function (wait)
+	 local described, finished = job:take(wait)
+	 for file, facts in pairs(described) do
+	    local description = self.tags[tags[file]].description
+	    -- Those filled in or asked for differently meanwhile are
+	    -- left alone.
+	    if not description.text and description.file == file and
+	       self.show_uncompressed_size == uncompressed then
+	       description.text = format_package_description(self, facts)
+	    end
+	 end
+	 return finished
+      end
+   end
+
+   -- Make the descriptions for the tags given, or for every tag,
+   -- ahead of time, on worker threads.
+   function tgf.prefetch_metadata(self, taglist, threads)
+      local fill = tgf.prefetch_metadata_later(self, taglist, threads)
+      if fill then fill(true) end
+   end
+
    function tgf.reset_descriptions(self)
       if not self.directory then return end
       local directory = util.realpath(self.directory)
@@ -488,7 +664,9 @@ do
       self.directory = directory
    end
 
-   function tgf.write_cpio(self, cpio_name, omit_trailer)
+   -- Options are passed to cpiofns.open: mtime and ino make the
+   -- archive reproducible.
+   function tgf.write_cpio(self, cpio_name, omit_trailer, options)
       if cpio_name:match '%.cpio%-nt$' then omit_trailer = true
       else
 	 if not cpio_name:match '%.cpio$' then
@@ -498,28 +676,33 @@ do
 	    cpio_name = cpio_name..'-nt'
 	 end
       end
-      cpio_file = io.open(cpio_name, 'w')
+      local cpio_file = cpiofns.open(cpio_name, options)
       if not cpio_file then
 	 print('Can\'t create cpio archive '..cpio_name)
 	 return
       end
-      cpio_file:write(cpiofns.emit_directory 'tags')
-      for category, tags in pairs(self.categories) do
+      local categories = {}
+      for category in pairs(self.categories) do
+	 table.insert(categories, category)
+      end
+      table.sort(categories)
+      local ok, err = cpio_file:dir 'tags'
+      for _, category in ipairs(categories) do
+	 if not ok then break end
 	 local tagdir='tags/'..category
-	 cpio_file:write(cpiofns.emit_directory(tagdir))
-	 local contents=''
-	 for _, tuple in ipairs(tags) do
-	    if self.skp_if_not_add and tuple.state ~= 'ADD' then
-	       contents=contents..tuple.tag..':SKP\n'
-	    else
-	       contents=contents..tuple.tag..':'..tuple.state..'\n'
-	    end
+	 ok, err = cpio_file:dir(tagdir)
+	 if ok then
+	    ok, err = cpio_file:tagfile(tagdir..'/tagfile',
+					self.categories[category],
+					self.skp_if_not_add)
 	 end
-	 cpio_file:write(cpiofns.emit_file(tagdir..'/tagfile', contents))
-	 self.dirty = false
       end
-      if not omit_trailer then cpio_file:write(cpiofns.emit_trailer()) end
-      cpio_file:close()
+      if ok then ok, err = cpio_file:close(omit_trailer) end
+      if not ok then
+	 print('Can\'t write cpio archive '..cpio_name..': '..err)
+	 return
+      end
+      self.dirty = false
    end
 
    function tgf.clone(self, preserve_old_state)
@@ -575,6 +758,28 @@ do
    end
 
 
+   -- Find the packages which the ADD packages need, directly or not,
+   -- and say what needs each.  Options: root, threads and add, as for
+   -- dependency_closure.
+   function tgf.closure(self, options)
+      local chosen, unsatisfied = dependency_closure(self, options)
+      if not chosen then return end
+      if #chosen == 0 then print '  Nothing more is needed' end
+      for _, choice in ipairs(chosen) do
+	 print(choice[1])
+	 for _, reason in ipairs(choice[2]) do
+	    print('    '..reason[3]..' for '..reason[2]..' ('..reason[1]..')')
+	 end
+      end
+      if #unsatisfied > 0 then
+	 print '  Nothing in the tree satisfies:'
+	 for _, need in ipairs(unsatisfied) do
+	    print('    '..need[3]..' for '..need[2]..' ('..need[1]..')')
+	 end
+      end
+      return chosen, unsatisfied
+   end
+
    function tgf.missing(self, installation)
       if object_type[installation] ~= 'installation' then
 	 print 'Argument must be an installation'
@@ -718,12 +923,78 @@ do
       end
    end
 
-   function tgf.change_archive(self, directory)
+   local function forget_package(tuple)
+      tuple.version = nil
+      tuple.arch = nil
+      tuple.build = nil
+      tuple.description = nil
+   end
+
+   -- Complaints about the package tree are printed, or collected in
+   -- messages if that's given, for the editor to show.
+   local function complain(messages, text)
+      if messages then table.insert(messages, text) else print(text) end
+   end
+
+   local function add_description_file(self, descr_file, messages)
+      local tag,version,arch,build =
+	 descr_file:match '/([^/]+)%-([^/-]+)%-([^/-]+)%-([^/-]+).txt$'
+      if not tag then return end
+      if not self.tags[tag] then
+	 complain(messages, 'No tagfile record for '..tag..'.  Skipping!')
+      else
+	 self.tags[tag].version = version
+	 self.tags[tag].arch = arch
+	 self.tags[tag].build = build
+	 self.tags[tag].description = { file = descr_file }
+	 return tag
+      end
+   end
+
+   local function read_maketag(self, filename, messages)
+      local maketag = io.open(filename)
+      if not maketag then return end
+      local gotdata
+      for line in maketag:lines() do
+	 local quoted = line:sub(1,1) == '"'
+	 if gotdata and not quoted then break end
+	 if quoted then
+	    gotdata = true
+	    local tag, descr =
+	       line:match '"([^"]*)" "([^"]*)" "[^"]*" \\'
+	    if not tag then
+	       complain(messages, 'Skipping strange line: '..line)
+	    else
+	       local entry = self.tags[tag]
+	       if entry then
+		  entry.shortdescr = descr
+		  entry.required = descr:match 'REQUIRED$' and true or nil
+	       end
+	    end
+	 end
+      end
+      maketag:close()
+   end
+
+   local function read_setpkg(self, filename)
+      local setpkg = io.open(filename)
+      if not setpkg then return end
+      for line in setpkg:lines() do
+	 local category, short, long =
+	    line:match '^"([A-Z]+)" "([^"]*)" on "([^"]*)"'
+	 if category then
+	    local category = category:lower()
+	    self.category_description[category] = {
+	       short = short, long = long
+	    }
+	 end
+      end
+      setpkg:close()
+   end
+
+   local function load_archive(self, directory, messages)
       for _,tuple in pairs(self.tags) do
-	 tuple.version = nil
-	 tuple.arch = nil
-	 tuple.build = nil
-	 tuple.description = nil
+	 forget_package(tuple)
 	 tuple.shortdescr = nil
 	 tuple.required = nil
       end
@@ -735,65 +1006,128 @@ do
       self.directory = directory
       directory = util.realpath(directory)
       for _,descr_file in ipairs(util.glob(directory..'/*/*txt')) do
-	 local tag,version,arch,build =
-	    descr_file:match '/([^/]+)%-([^/-]+)%-([^/-]+)%-([^/-]+).txt$'
-	 if not self.tags[tag] then
-	    print('No tagfile record for '..tag..'.  Skipping!')
-	 else
-	    self.tags[tag].version = version
-	    self.tags[tag].arch = arch
-	    self.tags[tag].build = build
-	    self.tags[tag].description = { file = descr_file }
-	 end
-      end
-
-      for _,line in ipairs(util.glob(directory..'/*/maketag')) do
-	 local maketag = io.open(line)
-	 if maketag then
-	    local gotdata
-	    for line in maketag:lines() do
-	       local quoted = line:sub(1,1) == '"'
-	       if gotdata and not quoted then break end
-	       if quoted then
-		  gotdata = true
-		  local tag, descr =
-		     line:match '"([^"]*)" "([^"]*)" "[^"]*" \\'
-		  if not tag then
-		     print('Skipping strange line: '..line)
-		  else
-		     local entry = self.tags[tag]
-		     if entry then
-			entry.shortdescr = descr
-			if descr:match 'REQUIRED$' then
-			   entry.required = true
-			end
-		     end
-		  end
+	 add_description_file(self, descr_file, messages)
+      end
+      for _,maketag in ipairs(util.glob(directory..'/*/maketag')) do
+	 read_maketag(self, maketag, messages)
+      end
+      read_setpkg(self, directory..'/../isolinux/setpkg')
+   end
+
+   function tgf.change_archive(self, directory)
+      load_archive(self, directory)
+   end
+
+   -- Watchers aren't kept in the tagset, so they're never saved.
+   local archive_watchers = setmetatable({}, {__mode = 'k'})
+
+   -- Follow changes to the package tree from now on, or stop if asked.
+   -- Changes are applied by refresh, which the editor calls while it
+   -- waits for keys.
+   local function rewatch(self, stop, messages)
+      local watcher = archive_watchers[self]
+      if watcher then
+	 watcher:close()
+	 archive_watchers[self] = nil
+      end
+      if stop or not self.directory then return end
+      local err
+      watcher, err = tagfns.watch(util.realpath(self.directory) or
+				  self.directory)
+      if not watcher then complain(messages, err); return end
+      archive_watchers[self] = watcher
+   end
+
+   function tgf.watch(self, stop)
+      rewatch(self, stop)
+   end
+
+   function tgf.watching(self)
+      return archive_watchers[self] ~= nil
+   end
+
+   -- Apply just what changed in the watched package tree.  Returns
+   -- true if anything did, and a list of complaints if there were any,
+   -- since the editor calls this with the screen in curses' hands.
+   function tgf.refresh(self)
+      local watcher = archive_watchers[self]
+      if not watcher then return end
+      local messages = {}
+      local changes, err = watcher:read()
+      if not changes then
+	 rewatch(self, true)
+	 return nil, { err }
+      end
+      if #changes == 0 then return end
+      local affected = {}
+      for _, change in ipairs(changes) do
+	 local path, removed = change.path, change.kind == 'removed'
+	 if change.kind == 'overflow' then
+	    -- Events were lost, so the watches may not cover categories
+	    -- made meanwhile either.  Start over.
+	    rewatch(self, false, messages)
+	    load_archive(self, self.directory, messages)
+	    affected = {}
+	    break
+	 elseif change.directory and not removed then
+	    -- A category moved in whole.
+	    for _,descr_file in ipairs(util.glob(path..'/*txt') or {}) do
+	       local tag = add_description_file(self, descr_file, messages)
+	       if tag then affected[tag] = true end
+	    end
+	    read_maketag(self, path..'/maketag', messages)
+	 elseif change.directory then
+	    local prefix = path..'/'
+	    for tag, tuple in pairs(self.tags) do
+	       local description = tuple.description
+	       if description and
+		  description.file:sub(1, #prefix) == prefix
+	       then
+		  forget_package(tuple)
+		  affected[tag] = true
 	       end
 	    end
+	 elseif path:match '%.txt$' then
+	    local tag = path:match '/([^/]+)%-[^/-]+%-[^/-]+%-[^/-]+.txt$'
+	    local tuple = tag and self.tags[tag]
+	    if removed then
+	       if tuple and tuple.description and
+		  tuple.description.file == path
+	       then
+		  forget_package(tuple)
+	       end
+	    else
+	       add_description_file(self, path, messages)
+	    end
+	    if tuple then affected[tag] = true end
+	 elseif path:match '%.t.z$' then
+	    -- Rebuilt: the sizes and any loaded ELF data are stale.
+	    local tag = path:match '/([^/]+)%-[^/-]+%-[^/-]+%-[^/-]+%.t.z$'
+	    if self.tags[tag] then affected[tag] = true end
+	 elseif path:match '/maketag$' then
+	    if not removed then read_maketag(self, path, messages) end
+	 elseif path:match '/setpkg$' then
+	    if not removed then read_setpkg(self, path) end
+	 elseif path:match '/MANIFEST%.bz2$' then
+	    self.manifest = nil
 	 end
       end
-
-      local setpkg = io.open(directory..'/../isolinux/setpkg')
-      if setpkg then
-	 for line in setpkg:lines() do
-	    local category, short, long =
-	       line:match '^"([A-Z]+)" "([^"]*)" on "([^"]*)"'
-	    if category then
-	       local category = category:lower()
-	       self.category_description[category] = {
-		  short = short, long = long
-	       }
-	    end
+      for tag in pairs(affected) do
+	 local tuple = self.tags[tag]
+	 if tuple.description then tuple.description.text = nil end
+	 if self.packages_loaded and self.packages_loaded[tuple] then
+	    self.package_cache = nil
+	    self.packages_loaded = nil
 	 end
-	 setpkg:close()
       end
+      -- Package metadata lives in a save file's base, not its deltas.
+      local saved = saved_images[self]
+      if saved then saved.archive = nil end
+      return true, #messages > 0 and messages or nil
    end
 end
 
 function _G.read_tagset(tagset_directory)
-   local allowed_states = {ADD=true, REC=true, OPT=true, SKP=true}
-
    do
       local directory = util.realpath(tagset_directory)
       if not directory then
@@ -804,44 +1138,15 @@ function _G.read_tagset(tagset_directory)
    end
 
    local tagset = {
-      tags = {}, categories = {},
       directory = tagset_directory, category_description = {} }
    local tagfiles = util.glob(tagset_directory..'/*/tagfile')
    if #tagfiles == 0 then
       print('Directory doesn\'t contain a tagset: '..tagset_directory)
       return
    end
-   for _, category_tagfile in
-   ipairs(tagfiles) do
-      category_directory = category_tagfile:match '^(/.*)/[^/]*$'
-      local category = category_directory:match '([^/]*)$'
-      local tagfile = io.open(category_directory..'/tagfile')
-      if not tagfile then
-	 print('No tagfile found in '..category_directory..' Skipping!')
-	 goto next_directory
-      end
-      for line in tagfile:lines() do
-	 if line:match '^[%s]*$' then goto skip_blank end
-	 local tag,state = line:match '[%s]*(.*)[%s]*:[%s]*([^:%s]+)[%s]*$'
-	 if not allowed_states[state] then
-	    print('Bad state for tag '..tag..' in category '..category)
-	 else
-	    local tuple = {
-	       tag=tag, category=category, state=state, old_state=state }
-	    tagset.tags[tag] = tuple
-	    local category_table = tagset.categories[category]
-	    if not category_table then
-	       category_table = {}
-	       tagset.categories[category] = category_table
-	    end
-	    tuple.category_index = #category_table + 1
-	    table.insert(category_table, tuple)
-	 end
-	 ::skip_blank::
-      end
-      tagfile:close()
-      ::next_directory::
-   end
+   local problems
+   tagset.categories, tagset.tags, problems = tagfns.read_tagfiles(tagfiles)
+   for _, problem in ipairs(problems) do print(problem) end
    setmetatable(tagset, tagset_metatable)
    -- Now try to enumerate txt files for packages.  If this is
    -- just a tagset directory, then there will be none.
@@ -852,7 +1157,64 @@ function _G.read_tagset(tagset_directory)
    return make_object('tagset', tagset)
 end
 
-function _G.reconstitute(filename)
+-- Save files are compressed with the dictionary retrain_dictionary
+-- made last, if any.  Every dictionary it has made is kept, since the
+-- files compressed with one can't be read without it.
+local compression = { level = 3, workers = 0 }
+
+local function dictionary_directory()
+   return data_directory()..'/dictionaries'
+end
+
+-- Change the zstd compression level or worker thread count, or turn
+-- the dictionary off with dictionary=false.
+function _G.slktag_compression(options)
+   for k, v in pairs(options or {}) do compression[k] = v end
+   local directory = dictionary_directory()
+   local current = directory..'/slktag.dict'
+   local ok, err = tagfns.set_compression {
+      level = compression.level, workers = compression.workers,
+      dictionary = compression.dictionary ~= false and
+	 util.readable(current) and current or nil,
+      dictionaries = util.glob(directory..'/slktag-*.dict') }
+   if not ok then print(err) end
+   return ok
+end
+slktag_compression()
+
+-- Train a new dictionary on the save files in directory, then
+-- recompress them with it.
+function _G.retrain_dictionary(directory, size)
+   local files = util.glob(directory..'/*.'..file_extension) or {}
+   local dictionary, id, used = tagfns.train_dictionary(files, size)
+   if not dictionary then print(id); return end
+   local destination = dictionary_directory()
+   os.execute('mkdir -p '..shell_quote(destination)..' 2>&-')
+   for _, name in ipairs { ('slktag-%u.dict'):format(id), 'slktag.dict' } do
+      local path = destination..'/'..name
+      local file, err = io.open(path..'.new', 'wb')
+      if not file then print(err); return end
+      local ok
+      ok, err = file:write(dictionary)
+      if ok then ok, err = file:close() else file:close() end
+      if ok then ok, err = os.rename(path..'.new', path) end
+      if not ok then os.remove(path..'.new'); print(err); return end
+   end
+   print(('Trained dictionary %u on %d save files.'):format(id, used))
+   if not slktag_compression() then return end
+   local before, after = 0, 0
+   for _, file in ipairs(files) do
+      local new_size, old_size = tagfns.recompress(file)
+      if new_size then
+	 before, after = before + old_size, after + new_size
+      else
+	 print(file..': '..old_size)
+      end
+   end
+   print(('Recompressed %s to %s.'):format(util.iec(before), util.iec(after)))
+end
+
+local function save_file_name(filename)
    if not filename:match(file_pattern) then
       filename=filename..'.'..file_extension
    end
@@ -860,11 +1222,34 @@ function _G.reconstitute(filename)
       print('Can\'t read '..filename)
       return
    end
-   local source, err = io.open(filename)
-   if not source then print(err); return end
-   local tagset =
-      marshal.decode((require 'zstd'.new()):decompress(source:read '*a'))
-   source:close()
+   return filename
+end
+
+-- Make a tagset of what tagfns.load read from filename.
+local function restore_tagset(filename, image, err)
+   if not image then print(err); return end
+   local tagset
+   if type(image) == 'string' then
+      tagset = marshal.decode(image)
+   else
+      tagset = marshal.decode(image.extras)
+      tagset.tags, tagset.categories = image.tags, image.categories
+      -- Files from before the installation's paths were kept have
+      -- just its tags.
+      if image.installed then
+	 tagset.installation = tagset.installation or {}
+	 tagset.installation.tags = image.installed
+      else
+	 tagset.installation = nil
+      end
+      local last_package = tagset.last_package
+      if last_package then
+	 local category = tagset.categories[last_package.category]
+	 tagset.last_package =
+	    category and category[last_package.category_index]
+      end
+      remember_save(tagset, filename, image)
+   end
    tagset_list[tagset] = true
    tagset.instance = get_instance(tagset.directory)
    if tagset.installation then
@@ -874,6 +1259,26 @@ function _G.reconstitute(filename)
    return make_object('tagset', setmetatable(tagset, tagset_metatable))
 end
 
+function _G.reconstitute(filename)
+   filename = save_file_name(filename)
+   if filename then return restore_tagset(filename, tagfns.load(filename)) end
+end
+
+-- Start reading a save file on a background thread.  Returns a
+-- function that returns the tagset, waiting for it if need be.
+function _G.reconstitute_later(filename)
+   filename = save_file_name(filename)
+   if not filename then return end
+   local job, tagset = tagfns.start_load(filename)
+   return function()
+      if job then
+	 tagset = restore_tagset(filename, job:result())
+	 job = nil
+      end
+      return tagset
+   end
+end
+
 do
    local tagset_list_last_size=0
    function _G.tagsets(ix)
@@ -0,0 +1,1696 @@
+// Needed for pthreads, mmap(), posix_madvise() and mkstemp().
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/inotify.h>
+#include <dirent.h>
+#include <zstd.h>
+#include <zdict.h>
+#include "lua_head.h"
+
+#define LOAD_META "tagfns.load_job"
+#define WATCH_META "tagfns.watcher"
+
+// Dictionaries are trained to this size, given enough save files.
+#define DICTIONARY_SIZE (64 * 1024)
+#define MIN_TRAINING_FILES 8
+
+enum state { ADD, REC, OPT, SKP, BAD };
+
+static const char *state_names[] = { "ADD", "REC", "OPT", "SKP" };
+
+// Stack slots used while building a tagset.
+enum { PATHS = 1, CATEGORIES, TAGS, PROBLEMS, STATES };
+
+static int is_blank(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+}
+
+static enum state state_of(const char *s, size_t len)
+{
+    if (len != 3)
+	return BAD;
+    for (int i = 0; i < BAD; i++)
+	if (!memcmp(s, state_names[i], 3))
+	    return i;
+    return BAD;
+}
+
+static void problem(lua_State *L, const char *format, ...)
+{
+    va_list ap;
+
+    va_start(ap, format);
+    lua_pushvfstring(L, format, ap);
+    va_end(ap);
+    lua_rawseti(L, PROBLEMS, lua_objlen(L, PROBLEMS) + 1);
+}
+
+// Map a whole file.  An empty file maps to an empty, non-NULL region.
+static const char *map_file(const char *path, size_t *len)
+{
+    struct stat sb;
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0)
+	return NULL;
+    if (fstat(fd, &sb) < 0) {
+	close(fd);
+	return NULL;
+    }
+    *len = sb.st_size;
+    if (*len == 0) {
+	close(fd);
+	return "";
+    }
+    void *base = mmap(NULL, *len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+	return NULL;
+    posix_madvise(base, *len, POSIX_MADV_SEQUENTIAL);
+    return base;
+}
+
+// Parse one category's tagfile into the category table on top of the
+// stack.  The category name sits just below it.
+static void parse_tagfile(lua_State *L, const char *category,
+			  const char *text, size_t len)
+{
+    const char *end = text + len;
+    int count = lua_objlen(L, -1);
+
+    while (text < end) {
+	const char *eol = memchr(text, '\n', end - text);
+	const char *line = text;
+	if (!eol)
+	    eol = end;
+	text = eol + 1;
+
+	while (line < eol && is_blank(*line))
+	    line++;
+	if (line == eol)
+	    continue;
+
+	// Like the old pattern, the state follows the last colon.
+	const char *colon = eol;
+	while (colon > line && colon[-1] != ':')
+	    colon--;
+	if (colon == line) {
+	    lua_pushlstring(L, line, eol - line);
+	    problem(L, "Malformed line in category %s: %s", category,
+		    lua_tostring(L, -1));
+	    lua_pop(L, 1);
+	    continue;
+	}
+	const char *tag_end = colon - 1;
+	const char *state = colon, *state_end = eol;
+	while (tag_end > line && is_blank(tag_end[-1]))
+	    tag_end--;
+	while (state < state_end && is_blank(*state))
+	    state++;
+	while (state_end > state && is_blank(state_end[-1]))
+	    state_end--;
+
+	enum state which = state_of(state, state_end - state);
+	if (which == BAD) {
+	    lua_pushlstring(L, line, tag_end - line);
+	    problem(L, "Bad state for tag %s in category %s",
+		    lua_tostring(L, -1), category);
+	    lua_pop(L, 1);
+	    continue;
+	}
+
+	lua_createtable(L, 0, 5);
+	lua_pushlstring(L, line, tag_end - line);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -3, "tag");
+	lua_pushvalue(L, -2);
+	lua_rawset(L, TAGS);
+	lua_pushvalue(L, -3);
+	lua_setfield(L, -2, "category");
+	lua_rawgeti(L, STATES, which + 1);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -3, "state");
+	lua_setfield(L, -2, "old_state");
+	lua_pushinteger(L, ++count);
+	lua_setfield(L, -2, "category_index");
+	lua_rawseti(L, -2, count);
+    }
+}
+
+// read_tagfiles(paths) parses each category/tagfile named in paths.
+// Returns a table of categories, each an array of tag tuples, a table
+// of the same tuples keyed by tag, and an array of complaints about
+// lines that were skipped.
+LUAFN(read_tagfiles)
+{
+    luaL_checktype(L, 1, LUA_TTABLE);
+    int files = lua_objlen(L, 1);
+
+    lua_settop(L, PATHS);
+    lua_createtable(L, 0, files);
+    lua_newtable(L);
+    lua_newtable(L);
+    lua_createtable(L, BAD, 0);
+    for (int i = 0; i < BAD; i++) {
+	lua_pushstring(L, state_names[i]);
+	lua_rawseti(L, STATES, i + 1);
+    }
+
+    for (int i = 1; i <= files; i++) {
+	lua_rawgeti(L, PATHS, i);
+	const char *path = lua_tostring(L, -1);
+	const char *slash = path ? strrchr(path, '/') : NULL;
+	if (!slash || slash == path) {
+	    lua_pop(L, 1);
+	    continue;
+	}
+	const char *start = slash;
+	while (start > path && start[-1] != '/')
+	    start--;
+
+	size_t len;
+	const char *text = map_file(path, &len);
+	if (!text) {
+	    problem(L, "Can't read %s: %s", path, strerror(errno));
+	    lua_pop(L, 1);
+	    continue;
+	}
+
+	lua_pushlstring(L, start, slash - start);
+	lua_pushvalue(L, -1);
+	lua_rawget(L, CATEGORIES);
+	if (lua_isnil(L, -1)) {
+	    // A newline per 12 bytes or so is typical of a tagfile.
+	    lua_pop(L, 1);
+	    lua_createtable(L, len / 12, 0);
+	    lua_pushvalue(L, -2);
+	    lua_pushvalue(L, -2);
+	    lua_rawset(L, CATEGORIES);
+	}
+	parse_tagfile(L, lua_tostring(L, -2), text, len);
+	if (len > 0)
+	    munmap((void *)text, len);
+	lua_pop(L, 3);
+    }
+    lua_pop(L, 1);
+    return 3;
+}
+
+/* A save file is a run of zstd frames.  Decompressed, they make one
+ * stream: the magic, then records, each a u32 type and a u32 length
+ * followed by that many bytes.
+ *
+ *   strings	  NUL terminated strings, referred to by offset
+ *   tuples	  the tagset's tuples, category by category
+ *   installed	  the attached installation's packages, if any
+ *   extras	  the rest of the tagset, marshalled by the caller
+ *   delta	  new states for tuples, by index in the tuples record
+ *
+ * save() writes the first four as one frame.  append() adds a frame
+ * with a delta and perhaps fresh extras, the last of which win.  Save
+ * files from before this format are one frame of marshalled tagset,
+ * which load() hands back undecoded.
+ */
+#define SAVE_MAGIC "TFTSLK1\n"
+#define NONE 0xffffffff
+
+enum { REC_STRINGS = 1, REC_TUPLES, REC_INSTALLED, REC_EXTRAS, REC_DELTA };
+
+enum { TUPLE_REQUIRED = 1, TUPLE_DESCRIBED = 2, TUPLE_INDEXED = 4 };
+
+typedef struct {
+    uint32_t type, length;
+} save_record;
+
+typedef struct {
+    uint32_t tag, category, version, arch, build, file, shortdescr;
+    uint8_t state, old_state, flags, spare;
+} save_tuple;
+
+typedef struct {
+    uint32_t tag, version, arch, build, file;
+} save_installed;
+
+typedef struct {
+    uint32_t tuple;
+    uint8_t state, old_state, spare[2];
+} save_delta;
+
+typedef struct {
+    char *data;
+    size_t len, room;
+} buffer;
+
+typedef struct {
+    buffer strings, tuples, installed, delta;
+    uint32_t *interned;
+    size_t intern_slots, intern_count;
+    char errmsg[256];
+} save_image;
+
+/* How save files are compressed: the level, the count of zstd worker
+ * threads, and the dictionary to use.  Every other dictionary that's
+ * been used is kept for reading older files.  Background loads may
+ * hold a reference while set_compression() swaps in another.
+ */
+typedef struct {
+    int level, workers, refs;
+    ZSTD_CDict *cdict;
+    ZSTD_DDict **ddicts;
+    size_t ddict_count;
+} zconfig;
+
+typedef struct {
+    int fd;
+    ZSTD_CCtx *cctx;
+    zconfig *config;
+    void *out;
+    size_t out_size;
+    const char *errmsg;
+} zwriter;
+
+static zconfig default_config = { .level = ZSTD_CLEVEL_DEFAULT, .refs = 1 };
+static zconfig *config = &default_config;
+static pthread_mutex_t config_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static zconfig *get_config(void)
+{
+    pthread_mutex_lock(&config_lock);
+    zconfig *c = config;
+    c->refs++;
+    pthread_mutex_unlock(&config_lock);
+    return c;
+}
+
+static void put_config(zconfig *c)
+{
+    pthread_mutex_lock(&config_lock);
+    int unused = --c->refs == 0;
+    pthread_mutex_unlock(&config_lock);
+    if (!unused || c == &default_config)
+	return;
+    ZSTD_freeCDict(c->cdict);
+    for (size_t i = 0; i < c->ddict_count; i++)
+	ZSTD_freeDDict(c->ddicts[i]);
+    free(c->ddicts);
+    free(c);
+}
+
+// Use the dictionary the frame at src was compressed with, if any.
+static const char *pick_dictionary(ZSTD_DCtx *dctx, zconfig *c,
+				   const void *src, size_t len)
+{
+    unsigned id = ZSTD_getDictID_fromFrame(src, len);
+    ZSTD_DDict *ddict = NULL;
+
+    for (size_t i = 0; id && !ddict && i < c->ddict_count; i++)
+	if (ZSTD_getDictID_fromDDict(c->ddicts[i]) == id)
+	    ddict = c->ddicts[i];
+    if (id && !ddict)
+	return "Save file needs a zstd dictionary that isn't installed";
+    if (ZSTD_isError(ZSTD_DCtx_refDDict(dctx, ddict)))
+	return "Can't set zstd dictionary";
+    return NULL;
+}
+
+static int buffer_add(buffer *b, const void *data, size_t len)
+{
+    if (b->len + len > b->room) {
+	size_t room = b->room ? b->room : 65536;
+	while (b->len + len > room)
+	    room *= 2;
+	char *bigger = realloc(b->data, room);
+	if (!bigger)
+	    return -1;
+	b->data = bigger;
+	b->room = room;
+    }
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+    return 0;
+}
+
+static uint32_t hash_string(const char *data, size_t len)
+{
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++)
+	hash = (hash ^ (unsigned char)data[i]) * 16777619u;
+    return hash;
+}
+
+// Sets *offset to that of the one copy of str, or NONE if str is NULL.
+static int intern(save_image *img, const char *str, size_t len,
+		  uint32_t *offset)
+{
+    if (!str) {
+	*offset = NONE;
+	return 0;
+    }
+    if (2 * (img->intern_count + 1) > img->intern_slots) {
+	size_t slots = img->intern_slots ? 2 * img->intern_slots : 4096;
+	uint32_t *table = calloc(slots, sizeof(uint32_t));
+	if (!table)
+	    return -1;
+	for (size_t i = 0; i < img->intern_slots; i++) {
+	    uint32_t old = img->interned[i];
+	    if (!old--)
+		continue;
+	    const char *s = img->strings.data + old;
+	    size_t slot = hash_string(s, strlen(s)) & (slots - 1);
+	    while (table[slot])
+		slot = (slot + 1) & (slots - 1);
+	    table[slot] = old + 1;
+	}
+	free(img->interned);
+	img->interned = table;
+	img->intern_slots = slots;
+    }
+
+    size_t slot = hash_string(str, len) & (img->intern_slots - 1);
+    for (; img->interned[slot];
+	 slot = (slot + 1) & (img->intern_slots - 1)) {
+	const char *old = img->strings.data + img->interned[slot] - 1;
+	if (!memcmp(old, str, len) && !old[len]) {
+	    *offset = img->interned[slot] - 1;
+	    return 0;
+	}
+    }
+    if (img->strings.len + len + 1 >= NONE)
+	return -1;
+    *offset = img->strings.len;
+    if (buffer_add(&img->strings, str, len) ||
+	buffer_add(&img->strings, "", 1))
+	return -1;
+    img->interned[slot] = *offset + 1;
+    img->intern_count++;
+    return 0;
+}
+
+static void free_image(save_image *img)
+{
+    free(img->strings.data);
+    free(img->tuples.data);
+    free(img->installed.data);
+    free(img->delta.data);
+    free(img->interned);
+}
+
+// Interns the string field name of the table at idx.  Anything but a
+// string is taken as nil.
+static int intern_field(lua_State *L, save_image *img, int idx,
+			const char *name, uint32_t *offset)
+{
+    size_t len = 0;
+    lua_getfield(L, idx, name);
+    const char *str =
+	lua_type(L, -1) == LUA_TSTRING ? lua_tolstring(L, -1, &len) : NULL;
+    int rc = intern(img, str, len, offset);
+    lua_pop(L, 1);
+    return rc;
+}
+
+// As intern_field, for the file field of the description field.
+static int intern_description(lua_State *L, save_image *img, int idx,
+			      uint32_t *offset)
+{
+    int rc = 0;
+    *offset = NONE;
+    lua_getfield(L, idx, "description");
+    if (lua_istable(L, -1))
+	rc = intern_field(L, img, lua_gettop(L), "file", offset);
+    lua_pop(L, 1);
+    return rc;
+}
+
+static int state_field(lua_State *L, int idx, const char *name)
+{
+    size_t len = 0;
+    lua_getfield(L, idx, name);
+    const char *state = lua_tolstring(L, -1, &len);
+    enum state which = state ? state_of(state, len) : BAD;
+    lua_pop(L, 1);
+    return which;
+}
+
+static int compare_names(const void *a, const void *b)
+{
+    return strcmp(*(const char **)a, *(const char **)b);
+}
+
+// The string keys of the table at idx, sorted so that saving the same
+// tagset twice gives the same file.
+static const char **sorted_keys(lua_State *L, int idx, size_t *count)
+{
+    size_t room = 64;
+    const char **names = malloc(room * sizeof(char *));
+
+    *count = 0;
+    lua_pushnil(L);
+    while (names && lua_next(L, idx)) {
+	lua_pop(L, 1);
+	if (lua_type(L, -1) != LUA_TSTRING)
+	    continue;
+	if (*count == room) {
+	    const char **bigger = realloc(names, 2 * room * sizeof(char *));
+	    if (!bigger) {
+		free(names);
+		names = NULL;
+		lua_pop(L, 1);
+		break;
+	    }
+	    names = bigger;
+	    room *= 2;
+	}
+	// The table holds on to the key, so the pointer stays good.
+	names[(*count)++] = lua_tostring(L, -1);
+    }
+    if (names)
+	qsort(names, *count, sizeof(char *), compare_names);
+    return names;
+}
+
+// Adds the tuples of categories, in order, to the image and to the
+// order table.  Returns an error message or NULL.
+static const char *add_tuples(lua_State *L, save_image *img,
+			      int categories, int tags, int order)
+{
+    size_t count, next = 0;
+    const char **names = sorted_keys(L, categories, &count);
+
+    if (!names)
+	return strerror(ENOMEM);
+    for (size_t i = 0; i < count; i++) {
+	lua_getfield(L, categories, names[i]);
+	int list = lua_gettop(L);
+	int length = lua_istable(L, list) ? lua_objlen(L, list) : 0;
+	for (int j = 1; j <= length; j++) {
+	    lua_rawgeti(L, list, j);
+	    int tuple = lua_gettop(L);
+	    save_tuple record = { .flags = 0 };
+	    if (!lua_istable(L, tuple)) {
+		lua_pop(L, 1);
+		continue;
+	    }
+	    record.state = state_field(L, tuple, "state");
+	    record.old_state = state_field(L, tuple, "old_state");
+	    if (intern_field(L, img, tuple, "tag", &record.tag) ||
+		intern(img, names[i], strlen(names[i]), &record.category) ||
+		intern_field(L, img, tuple, "version", &record.version) ||
+		intern_field(L, img, tuple, "arch", &record.arch) ||
+		intern_field(L, img, tuple, "build", &record.build) ||
+		intern_field(L, img, tuple, "shortdescr",
+			     &record.shortdescr) ||
+		intern_description(L, img, tuple, &record.file)) {
+		free(names);
+		return strerror(ENOMEM);
+	    }
+	    if (record.tag == NONE ||
+		record.state == BAD || record.old_state == BAD) {
+		snprintf(img->errmsg, sizeof(img->errmsg),
+			 "Bad tuple %d in category %s", j, names[i]);
+		free(names);
+		return img->errmsg;
+	    }
+	    lua_getfield(L, tuple, "required");
+	    if (lua_toboolean(L, -1))
+		record.flags |= TUPLE_REQUIRED;
+	    lua_getfield(L, tuple, "description");
+	    if (lua_istable(L, -1))
+		record.flags |= TUPLE_DESCRIBED;
+	    lua_getfield(L, tuple, "tag");
+	    lua_rawget(L, tags);
+	    if (lua_rawequal(L, -1, tuple))
+		record.flags |= TUPLE_INDEXED;
+	    lua_pop(L, 3);
+
+	    if (buffer_add(&img->tuples, &record, sizeof(record))) {
+		free(names);
+		return strerror(ENOMEM);
+	    }
+	    lua_rawseti(L, order, ++next);
+	}
+	lua_pop(L, 1);
+    }
+    free(names);
+    return NULL;
+}
+
+static const char *add_installed(lua_State *L, save_image *img, int tags)
+{
+    size_t count;
+    const char **names = sorted_keys(L, tags, &count);
+
+    if (!names)
+	return strerror(ENOMEM);
+    for (size_t i = 0; i < count; i++) {
+	save_installed record;
+	lua_getfield(L, tags, names[i]);
+	int package = lua_gettop(L);
+	if (lua_istable(L, package) &&
+	    (intern(img, names[i], strlen(names[i]), &record.tag) ||
+	     intern_field(L, img, package, "version", &record.version) ||
+	     intern_field(L, img, package, "arch", &record.arch) ||
+	     intern_field(L, img, package, "build", &record.build) ||
+	     intern_description(L, img, package, &record.file) ||
+	     buffer_add(&img->installed, &record, sizeof(record)))) {
+	    free(names);
+	    return strerror(ENOMEM);
+	}
+	lua_pop(L, 1);
+    }
+    free(names);
+    return NULL;
+}
+
+static int write_all(int fd, const void *data, size_t len)
+{
+    while (len > 0) {
+	ssize_t actual = write(fd, data, len);
+	if (actual < 0 && errno == EINTR)
+	    continue;
+	if (actual < 0)
+	    return -1;
+	data = (const char *)data + actual;
+	len -= actual;
+    }
+    return 0;
+}
+
+static int zwriter_open(zwriter *w, int fd)
+{
+    w->fd = fd;
+    w->errmsg = NULL;
+    w->out_size = ZSTD_CStreamOutSize();
+    w->out = malloc(w->out_size);
+    w->cctx = ZSTD_createCCtx();
+    if (!w->out || !w->cctx) {
+	free(w->out);
+	ZSTD_freeCCtx(w->cctx);
+	return -1;
+    }
+    w->config = get_config();
+    if (w->config->cdict)
+	ZSTD_CCtx_refCDict(w->cctx, w->config->cdict);
+    else
+	ZSTD_CCtx_setParameter(w->cctx, ZSTD_c_compressionLevel,
+			       w->config->level);
+    // A libzstd built without threads refuses this.  That's fine.
+    if (w->config->workers > 0)
+	ZSTD_CCtx_setParameter(w->cctx, ZSTD_c_nbWorkers,
+			       w->config->workers);
+    return 0;
+}
+
+// Compress data into the frame, ending the frame if asked.
+static int zwrite(zwriter *w, const void *data, size_t len,
+		  ZSTD_EndDirective mode)
+{
+    ZSTD_inBuffer in = { data, len, 0 };
+
+    for (;;) {
+	ZSTD_outBuffer out = { w->out, w->out_size, 0 };
+	size_t left = ZSTD_compressStream2(w->cctx, &out, &in, mode);
+	if (ZSTD_isError(left)) {
+	    w->errmsg = ZSTD_getErrorName(left);
+	    return -1;
+	}
+	if (write_all(w->fd, w->out, out.pos)) {
+	    w->errmsg = strerror(errno);
+	    return -1;
+	}
+	if (mode == ZSTD_e_end ? left == 0 : in.pos == in.size)
+	    return 0;
+    }
+}
+
+static int zwrite_record(zwriter *w, uint32_t type, const buffer *b)
+{
+    save_record head = { type, b->len };
+
+    if (b->len > NONE) {
+	w->errmsg = "Save record too large";
+	return -1;
+    }
+    return zwrite(w, &head, sizeof(head), ZSTD_e_continue) ||
+	zwrite(w, b->data, b->len, ZSTD_e_continue);
+}
+
+static void zwriter_close(zwriter *w)
+{
+    free(w->out);
+    ZSTD_freeCCtx(w->cctx);
+    put_config(w->config);
+}
+
+// Create path.XXXXXX, to be renamed over path, with the mode a new
+// file would get.
+static int create_temp(const char *path, char **temp)
+{
+    size_t len = strlen(path);
+
+    if (!(*temp = malloc(len + 8))) {
+	errno = ENOMEM;
+	return -1;
+    }
+    memcpy(*temp, path, len);
+    memcpy(*temp + len, ".XXXXXX", 8);
+    int fd = mkstemp(*temp);
+    if (fd < 0) {
+	int saved = errno;
+	free(*temp);
+	errno = saved;
+	return -1;
+    }
+    mode_t mask = umask(0);
+    umask(mask);
+    fchmod(fd, 0666 & ~mask);
+    return fd;
+}
+
+// Put the file written to temp in place, unless there was an error
+// writing it.  Returns the error, if any.
+static const char *install_temp(int fd, char *temp, const char *path,
+				const char *errmsg)
+{
+    if (close(fd) && !errmsg)
+	errmsg = strerror(errno);
+    if (!errmsg && rename(temp, path))
+	errmsg = strerror(errno);
+    if (errmsg)
+	unlink(temp);
+    free(temp);
+    return errmsg;
+}
+
+// save(path, categories, tags, installed, extras) writes a new save
+// file.  installed is the attached installation's tags table, or nil,
+// and extras is the marshalled remainder of the tagset.  Returns the
+// size of the file and the tuples in the order append() refers to
+// them, or nil and an error message.
+LUAFN(save)
+{
+    const char *path = luaL_checkstring(L, 1);
+    luaL_checktype(L, 2, LUA_TTABLE);
+    luaL_checktype(L, 3, LUA_TTABLE);
+    int installed = lua_istable(L, 4);
+    buffer extras = { .len = 0 };
+    extras.data = (char *)luaL_checklstring(L, 5, &extras.len);
+
+    save_image img;
+    memset(&img, 0, sizeof(img));
+    lua_settop(L, 5);
+    lua_newtable(L);
+    const char *errmsg = add_tuples(L, &img, 2, 3, 6);
+    if (!errmsg && installed)
+	errmsg = add_installed(L, &img, 4);
+    if (errmsg) {
+	free_image(&img);
+	lua_pushnil(L);
+	lua_pushstring(L, errmsg);
+	return 2;
+    }
+
+    char *temp;
+    int fd = create_temp(path, &temp);
+    if (fd < 0)
+	errmsg = strerror(errno);
+    else {
+	zwriter w;
+	if (zwriter_open(&w, fd))
+	    errmsg = strerror(ENOMEM);
+	else {
+	    if (!zwrite(&w, SAVE_MAGIC, 8, ZSTD_e_continue) &&
+		!zwrite_record(&w, REC_STRINGS, &img.strings) &&
+		!zwrite_record(&w, REC_TUPLES, &img.tuples) &&
+		(!installed ||
+		 !zwrite_record(&w, REC_INSTALLED, &img.installed)) &&
+		!zwrite_record(&w, REC_EXTRAS, &extras))
+		zwrite(&w, NULL, 0, ZSTD_e_end);
+	    errmsg = w.errmsg;
+	    zwriter_close(&w);
+	}
+	off_t size = lseek(fd, 0, SEEK_END);
+	if (!(errmsg = install_temp(fd, temp, path, errmsg))) {
+	    free_image(&img);
+	    lua_pushnumber(L, size);
+	    lua_pushvalue(L, 6);
+	    return 2;
+	}
+    }
+    free_image(&img);
+    lua_pushnil(L);
+    lua_pushstring(L, errmsg);
+    return 2;
+}
+
+// append(path, size, order, changed, extras) adds the states of the
+// tuples whose indexes in order are listed in changed to the save file
+// at path, along with new extras if they're given.  The file must
+// still be size bytes long.  Returns the new size, or nil and an error
+// message.
+LUAFN(append)
+{
+    const char *path = luaL_checkstring(L, 1);
+    off_t expected = luaL_checknumber(L, 2);
+    luaL_checktype(L, 3, LUA_TTABLE);
+    luaL_checktype(L, 4, LUA_TTABLE);
+    buffer extras = { .len = 0 };
+    if (!lua_isnoneornil(L, 5))
+	extras.data = (char *)luaL_checklstring(L, 5, &extras.len);
+
+    save_image img;
+    memset(&img, 0, sizeof(img));
+    int changed = lua_objlen(L, 4);
+    for (int i = 1; i <= changed; i++) {
+	save_delta record = { .spare = { 0, 0 } };
+	lua_rawgeti(L, 4, i);
+	record.tuple = lua_tointeger(L, -1) - 1;
+	lua_rawgeti(L, 3, record.tuple + 1);
+	if (!lua_istable(L, -1)) {
+	    free_image(&img);
+	    return luaL_error(L, "No tuple %d in the save order",
+			      record.tuple + 1);
+	}
+	record.state = state_field(L, lua_gettop(L), "state");
+	record.old_state = state_field(L, lua_gettop(L), "old_state");
+	lua_pop(L, 2);
+	if (record.state == BAD || record.old_state == BAD) {
+	    free_image(&img);
+	    return luaL_error(L, "Bad state for tuple %d", record.tuple + 1);
+	}
+	if (buffer_add(&img.delta, &record, sizeof(record))) {
+	    free_image(&img);
+	    return luaL_error(L, "%s", strerror(ENOMEM));
+	}
+    }
+
+    const char *errmsg = NULL;
+    struct stat sb;
+    int fd = open(path, O_WRONLY | O_APPEND);
+    if (fd < 0 || fstat(fd, &sb))
+	errmsg = strerror(errno);
+    else if (sb.st_size != expected)
+	errmsg = "Save file changed since it was written";
+    else {
+	zwriter w;
+	if (zwriter_open(&w, fd))
+	    errmsg = strerror(ENOMEM);
+	else {
+	    if (!zwrite_record(&w, REC_DELTA, &img.delta) &&
+		(!extras.data || !zwrite_record(&w, REC_EXTRAS, &extras)))
+		zwrite(&w, NULL, 0, ZSTD_e_end);
+	    errmsg = w.errmsg;
+	    zwriter_close(&w);
+	}
+    }
+    off_t size = fd < 0 ? 0 : lseek(fd, 0, SEEK_END);
+    if (fd >= 0 && close(fd) && !errmsg)
+	errmsg = strerror(errno);
+    free_image(&img);
+    if (errmsg) {
+	lua_pushnil(L);
+	lua_pushstring(L, errmsg);
+	return 2;
+    }
+    lua_pushnumber(L, size);
+    return 1;
+}
+
+// Decompress every whole frame of the file.  A frame cut short by a
+// crash while appending is dropped, and with it the last save.  The
+// length of the file up to the end of the last whole frame goes in
+// *whole, so that nothing is appended after the torn one.
+static const char *inflate_save(const char *map, size_t size, buffer *out,
+				zconfig *c, size_t *whole)
+{
+    ZSTD_DCtx *dctx = ZSTD_createDCtx();
+    ZSTD_inBuffer in = { map, size, 0 };
+    unsigned long long guess = ZSTD_getFrameContentSize(map, size);
+    size_t complete = 0;
+
+    *whole = 0;
+    const char *errmsg = NULL;
+
+    if (!dctx)
+	return strerror(ENOMEM);
+    out->room = guess < (1ull << 30) ? guess + 65536 : 4 * size + 65536;
+    if (!(out->data = malloc(out->room))) {
+	ZSTD_freeDCtx(dctx);
+	return strerror(ENOMEM);
+    }
+    if ((errmsg = pick_dictionary(dctx, c, map, size))) {
+	ZSTD_freeDCtx(dctx);
+	return errmsg;
+    }
+    for (;;) {
+	if (out->len == out->room) {
+	    char *bigger = realloc(out->data, 2 * out->room);
+	    if (!bigger) {
+		errmsg = strerror(ENOMEM);
+		break;
+	    }
+	    out->data = bigger;
+	    out->room *= 2;
+	}
+	ZSTD_outBuffer o = { out->data, out->room, out->len };
+	size_t rc = ZSTD_decompressStream(dctx, &o, &in);
+	out->len = o.pos;
+	if (ZSTD_isError(rc)) {
+	    if (!complete)
+		errmsg = ZSTD_getErrorName(rc);
+	    break;
+	}
+	if (rc == 0) {
+	    complete = out->len;
+	    *whole = in.pos;
+	    if (in.pos == in.size)
+		break;
+	    // A missing dictionary is an error, not a torn frame.
+	    if ((errmsg = pick_dictionary(dctx, c, map + in.pos,
+					  size - in.pos)))
+		break;
+	} else if (in.pos == in.size && o.pos < o.size)
+	    break;
+    }
+    if (!complete && !errmsg)
+	errmsg = "Truncated save file";
+    out->len = complete;
+    ZSTD_freeDCtx(dctx);
+    return errmsg;
+}
+
+// Push strings[offset], or nil for NONE.
+static int push_saved_string(lua_State *L, const buffer *strings,
+			     uint32_t offset)
+{
+    if (offset == NONE)
+	lua_pushnil(L);
+    else if (offset < strings->len)
+	lua_pushstring(L, strings->data + offset);
+    else
+	return -1;
+    return 0;
+}
+
+static int set_saved_field(lua_State *L, const buffer *strings,
+			   const char *name, uint32_t offset)
+{
+    if (offset == NONE)
+	return 0;
+    if (push_saved_string(L, strings, offset))
+	return -1;
+    lua_setfield(L, -2, name);
+    return 0;
+}
+
+// Stack slots used while loading a save file.
+enum { RESULT = 2, LOADED_CATEGORIES, LOADED_TAGS, LOADED_ORDER };
+
+static int load_tuples(lua_State *L, const buffer *strings,
+		       const char *data, size_t len)
+{
+    if (len % sizeof(save_tuple))
+	return -1;
+    for (size_t i = 0; i < len / sizeof(save_tuple); i++) {
+	save_tuple record;
+	memcpy(&record, data + i * sizeof(record), sizeof(record));
+	if (record.state >= BAD || record.old_state >= BAD ||
+	    push_saved_string(L, strings, record.category) ||
+	    lua_isnil(L, -1))
+	    return -1;
+	int category = lua_gettop(L);
+	lua_pushvalue(L, category);
+	lua_rawget(L, LOADED_CATEGORIES);
+	if (lua_isnil(L, -1)) {
+	    lua_pop(L, 1);
+	    lua_newtable(L);
+	    lua_pushvalue(L, category);
+	    lua_pushvalue(L, -2);
+	    lua_rawset(L, LOADED_CATEGORIES);
+	}
+	int index = lua_objlen(L, -1) + 1;
+
+	lua_createtable(L, 0, 10);
+	lua_pushvalue(L, category);
+	lua_setfield(L, -2, "category");
+	lua_pushinteger(L, index);
+	lua_setfield(L, -2, "category_index");
+	lua_pushstring(L, state_names[record.state]);
+	lua_setfield(L, -2, "state");
+	lua_pushstring(L, state_names[record.old_state]);
+	lua_setfield(L, -2, "old_state");
+	if (record.flags & TUPLE_REQUIRED) {
+	    lua_pushboolean(L, 1);
+	    lua_setfield(L, -2, "required");
+	}
+	if (set_saved_field(L, strings, "tag", record.tag) ||
+	    set_saved_field(L, strings, "version", record.version) ||
+	    set_saved_field(L, strings, "arch", record.arch) ||
+	    set_saved_field(L, strings, "build", record.build) ||
+	    set_saved_field(L, strings, "shortdescr", record.shortdescr))
+	    return -1;
+	if (record.flags & TUPLE_DESCRIBED) {
+	    lua_createtable(L, 0, 2);
+	    if (set_saved_field(L, strings, "file", record.file))
+		return -1;
+	    lua_setfield(L, -2, "description");
+	}
+	if (record.flags & TUPLE_INDEXED) {
+	    lua_getfield(L, -1, "tag");
+	    lua_pushvalue(L, -2);
+	    lua_rawset(L, LOADED_TAGS);
+	}
+	lua_pushvalue(L, -1);
+	lua_rawseti(L, LOADED_ORDER, lua_objlen(L, LOADED_ORDER) + 1);
+	lua_rawseti(L, -2, index);
+	lua_pop(L, 2);
+    }
+    return 0;
+}
+
+static int load_installed(lua_State *L, const buffer *strings,
+			  const char *data, size_t len)
+{
+    if (len % sizeof(save_installed))
+	return -1;
+    lua_createtable(L, 0, len / sizeof(save_installed));
+    for (size_t i = 0; i < len / sizeof(save_installed); i++) {
+	save_installed record;
+	memcpy(&record, data + i * sizeof(record), sizeof(record));
+	if (record.tag == NONE)
+	    return -1;
+	lua_createtable(L, 0, 5);
+	lua_createtable(L, 0, 2);
+	if (set_saved_field(L, strings, "file", record.file))
+	    return -1;
+	lua_setfield(L, -2, "description");
+	if (set_saved_field(L, strings, "tag", record.tag) ||
+	    set_saved_field(L, strings, "version", record.version) ||
+	    set_saved_field(L, strings, "arch", record.arch) ||
+	    set_saved_field(L, strings, "build", record.build))
+	    return -1;
+	lua_getfield(L, -1, "tag");
+	lua_insert(L, -2);
+	lua_rawset(L, -3);
+    }
+    lua_setfield(L, RESULT, "installed");
+    return 0;
+}
+
+static int load_delta(lua_State *L, const char *data, size_t len)
+{
+    int tuples = lua_objlen(L, LOADED_ORDER);
+
+    if (len % sizeof(save_delta))
+	return -1;
+    for (size_t i = 0; i < len / sizeof(save_delta); i++) {
+	save_delta record;
+	memcpy(&record, data + i * sizeof(record), sizeof(record));
+	if (record.tuple >= tuples ||
+	    record.state >= BAD || record.old_state >= BAD)
+	    return -1;
+	lua_rawgeti(L, LOADED_ORDER, record.tuple + 1);
+	lua_pushstring(L, state_names[record.state]);
+	lua_setfield(L, -2, "state");
+	lua_pushstring(L, state_names[record.old_state]);
+	lua_setfield(L, -2, "old_state");
+	lua_pop(L, 1);
+    }
+    return 0;
+}
+
+static int load_records(lua_State *L, const buffer *image)
+{
+    buffer strings = { .len = 0 };
+    size_t at = 8;
+    int tuples = 0, extras = 0, deltas = 0;
+
+    while (at < image->len) {
+	save_record head;
+	if (image->len - at < sizeof(head))
+	    return -1;
+	memcpy(&head, image->data + at, sizeof(head));
+	at += sizeof(head);
+	if (image->len - at < head.length)
+	    return -1;
+	const char *data = image->data + at;
+	at += head.length;
+
+	switch (head.type) {
+	case REC_STRINGS:
+	    if (head.length && data[head.length - 1])
+		return -1;
+	    strings.data = (char *)data;
+	    strings.len = head.length;
+	    break;
+	case REC_TUPLES:
+	    if (tuples++ || load_tuples(L, &strings, data, head.length))
+		return -1;
+	    break;
+	case REC_INSTALLED:
+	    if (load_installed(L, &strings, data, head.length))
+		return -1;
+	    break;
+	case REC_EXTRAS:
+	    extras++;
+	    lua_pushlstring(L, data, head.length);
+	    lua_setfield(L, RESULT, "extras");
+	    break;
+	case REC_DELTA:
+	    if (load_delta(L, data, head.length))
+		return -1;
+	    deltas++;
+	    break;
+	default:
+	    // Records from some later version can be passed over.
+	    break;
+	}
+    }
+    lua_pushinteger(L, deltas);
+    lua_setfield(L, RESULT, "deltas");
+    return tuples && extras ? 0 : -1;
+}
+
+typedef struct {
+    char *path;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    int threaded, done, collected;
+    buffer image;
+    off_t size;
+    char errmsg[256];
+} load_job;
+
+// Map and decompress a save file.  Safe to run off the main thread.
+static void read_save(load_job *job)
+{
+    struct stat sb;
+    const char *errmsg = NULL;
+    int fd = open(job->path, O_RDONLY);
+
+    if (fd < 0 || fstat(fd, &sb))
+	errmsg = strerror(errno);
+    else if (sb.st_size == 0)
+	errmsg = "Empty save file";
+    else {
+	void *map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED)
+	    errmsg = strerror(errno);
+	else {
+	    zconfig *c = get_config();
+	    size_t whole;
+	    errmsg = inflate_save(map, sb.st_size, &job->image, c, &whole);
+	    // A torn frame makes the file longer than this, so the next
+	    // append() writes the whole file afresh instead.
+	    job->size = whole;
+	    put_config(c);
+	    munmap(map, sb.st_size);
+	}
+    }
+    if (fd >= 0)
+	close(fd);
+    if (errmsg)
+	snprintf(job->errmsg, sizeof(job->errmsg), "%s", errmsg);
+}
+
+// Turn what read_save() found into what load() returns.  The one
+// argument is in stack slot 1.
+static int push_save(lua_State *L, load_job *job)
+{
+    lua_settop(L, 1);
+    if (job->errmsg[0]) {
+	lua_pushnil(L);
+	lua_pushstring(L, job->errmsg);
+	return 2;
+    }
+    if (job->image.len < 8 || memcmp(job->image.data, SAVE_MAGIC, 8)) {
+	lua_pushlstring(L, job->image.data, job->image.len);
+	return 1;
+    }
+
+    lua_createtable(L, 0, 8);
+    lua_newtable(L);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, RESULT, "categories");
+    lua_newtable(L);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, RESULT, "tags");
+    lua_newtable(L);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, RESULT, "order");
+    lua_pushnumber(L, job->size);
+    lua_setfield(L, RESULT, "size");
+    if (load_records(L, &job->image)) {
+	lua_pushnil(L);
+	lua_pushstring(L, "Corrupt save file");
+	return 2;
+    }
+    lua_settop(L, RESULT);
+    return 1;
+}
+
+// load(path) reads a save file.  Returns a table of categories, tags,
+// order (as from save()), installed and extras, along with the count
+// of deltas applied and the file's size.  An old save file comes back
+// as its decompressed contents, and failure as nil and a message.
+LUAFN(load)
+{
+    load_job job;
+
+    memset(&job, 0, sizeof(job));
+    job.path = (char *)luaL_checkstring(L, 1);
+    read_save(&job);
+    int results = push_save(L, &job);
+    free(job.image.data);
+    return results;
+}
+
+static void *load_thread(void *arg)
+{
+    load_job *job = arg;
+
+    read_save(job);
+    pthread_mutex_lock(&job->lock);
+    job->done = 1;
+    pthread_mutex_unlock(&job->lock);
+    return NULL;
+}
+
+static void wait_for_load(load_job *job)
+{
+    if (job->threaded) {
+	pthread_join(job->thread, NULL);
+	job->threaded = 0;
+    }
+}
+
+// Start reading a save file on a background thread.  Returns a job
+// object whose result() method returns what load() would.
+LUAFN(start_load)
+{
+    const char *path = luaL_checkstring(L, 1);
+    size_t len = strlen(path) + 1;
+    load_job *job = lua_newuserdata(L, sizeof(load_job));
+
+    memset(job, 0, sizeof(load_job));
+    luaL_getmetatable(L, LOAD_META);
+    lua_setmetatable(L, -2);
+    lua_newtable(L);
+    lua_setfenv(L, -2);
+    if (!(job->path = malloc(len)))
+	return luaL_error(L, "%s", strerror(ENOMEM));
+    memcpy(job->path, path, len);
+    pthread_mutex_init(&job->lock, NULL);
+    if (!pthread_create(&job->thread, NULL, load_thread, job))
+	job->threaded = 1;
+    else
+	// No thread to be had.  Do it now.
+	load_thread(job);
+    return 1;
+}
+
+LUAFN(load_ready)
+{
+    load_job *job = luaL_checkudata(L, 1, LOAD_META);
+
+    pthread_mutex_lock(&job->lock);
+    lua_pushboolean(L, job->done);
+    pthread_mutex_unlock(&job->lock);
+    return 1;
+}
+
+// Wait for the job and return its results.  The tables are built the
+// first time and handed back again after that.
+LUAFN(load_result)
+{
+    load_job *job = luaL_checkudata(L, 1, LOAD_META);
+
+    lua_settop(L, 1);
+    if (job->collected) {
+	lua_getfenv(L, 1);
+	lua_getfield(L, 2, "result");
+	lua_getfield(L, 2, "error");
+	return 2;
+    }
+    wait_for_load(job);
+    job->collected = 1;
+    int results = push_save(L, job);
+    free(job->image.data);
+    job->image.data = NULL;
+    lua_getfenv(L, 1);
+    lua_pushvalue(L, -2);
+    lua_setfield(L, -2, results == 1 ? "result" : "error");
+    lua_pop(L, 1);
+    return results;
+}
+
+LUAFN(load_gc)
+{
+    load_job *job = luaL_checkudata(L, 1, LOAD_META);
+
+    wait_for_load(job);
+    if (job->path) {
+	pthread_mutex_destroy(&job->lock);
+	free(job->image.data);
+	free(job->path);
+	job->path = NULL;
+    }
+    return 0;
+}
+
+// Read all of a small file, such as a dictionary.
+static char *slurp(const char *path, size_t *len)
+{
+    struct stat sb;
+    char *data = NULL;
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0)
+	return NULL;
+    if (!fstat(fd, &sb) && (data = malloc(sb.st_size + 1))) {
+	*len = 0;
+	while (*len < sb.st_size) {
+	    ssize_t actual = read(fd, data + *len, sb.st_size - *len);
+	    if (actual < 0 && errno == EINTR)
+		continue;
+	    if (actual <= 0) {
+		free(data);
+		data = NULL;
+		break;
+	    }
+	    *len += actual;
+	}
+    }
+    close(fd);
+    return data;
+}
+
+static int int_field(lua_State *L, int idx, const char *name, int fallback)
+{
+    lua_getfield(L, idx, name);
+    int value = lua_isnumber(L, -1) ? lua_tointeger(L, -1) : fallback;
+    lua_pop(L, 1);
+    return value;
+}
+
+// Adds the dictionary in path to c for reading, and for writing too if
+// asked.  Returns an error message or NULL.
+static const char *add_dictionary(zconfig *c, const char *path, int write)
+{
+    size_t len;
+    char *data = slurp(path, &len);
+
+    if (!data)
+	return "Can't read zstd dictionary";
+    ZSTD_DDict *ddict = ZSTD_createDDict(data, len);
+    ZSTD_DDict **bigger =
+	realloc(c->ddicts, (c->ddict_count + 1) * sizeof(ZSTD_DDict *));
+    if (bigger)
+	c->ddicts = bigger;
+    if (!ddict || !bigger) {
+	ZSTD_freeDDict(ddict);
+	free(data);
+	return strerror(ENOMEM);
+    }
+    c->ddicts[c->ddict_count++] = ddict;
+    if (write && !(c->cdict = ZSTD_createCDict(data, len, c->level))) {
+	free(data);
+	return "Bad zstd dictionary";
+    }
+    free(data);
+    return NULL;
+}
+
+// set_compression{level=, workers=, dictionary=, dictionaries=} sets
+// how save files are compressed from now on.  dictionary is the file
+// holding the dictionary to compress with, and dictionaries lists any
+// others needed to read older save files.  Returns true, or nil and
+// an error message, leaving the old settings in place.
+LUAFN(set_compression)
+{
+    luaL_checktype(L, 1, LUA_TTABLE);
+    zconfig *c = calloc(1, sizeof(zconfig));
+    const char *errmsg = NULL;
+
+    if (!c)
+	return luaL_error(L, "%s", strerror(ENOMEM));
+    c->refs = 1;
+    c->level = int_field(L, 1, "level", ZSTD_CLEVEL_DEFAULT);
+    if (c->level < ZSTD_minCLevel())
+	c->level = ZSTD_minCLevel();
+    if (c->level > ZSTD_maxCLevel())
+	c->level = ZSTD_maxCLevel();
+    c->workers = int_field(L, 1, "workers", 0);
+
+    lua_getfield(L, 1, "dictionary");
+    if (lua_isstring(L, -1))
+	errmsg = add_dictionary(c, lua_tostring(L, -1), 1);
+    lua_getfield(L, 1, "dictionaries");
+    int count = lua_istable(L, -1) ? lua_objlen(L, -1) : 0;
+    for (int i = 1; !errmsg && i <= count; i++) {
+	lua_rawgeti(L, -1, i);
+	if (lua_isstring(L, -1))
+	    errmsg = add_dictionary(c, lua_tostring(L, -1), 0);
+	lua_pop(L, 1);
+    }
+    if (errmsg) {
+	put_config(c);
+	lua_pushnil(L);
+	lua_pushstring(L, errmsg);
+	return 2;
+    }
+
+    pthread_mutex_lock(&config_lock);
+    zconfig *old = config;
+    config = c;
+    pthread_mutex_unlock(&config_lock);
+    put_config(old);
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+// train_dictionary(paths[, size]) trains a zstd dictionary of at most
+// size bytes on the contents of the save files listed.  Returns the
+// dictionary, its ID and the count of files used, or nil and an error
+// message.
+LUAFN(train_dictionary)
+{
+    luaL_checktype(L, 1, LUA_TTABLE);
+    size_t capacity = luaL_optinteger(L, 2, DICTIONARY_SIZE);
+    int count = lua_objlen(L, 1);
+    buffer samples = { .len = 0 };
+    size_t *sizes = malloc((count + 1) * sizeof(size_t));
+    unsigned used = 0;
+
+    if (!sizes)
+	return luaL_error(L, "%s", strerror(ENOMEM));
+    for (int i = 1; i <= count; i++) {
+	load_job job;
+	memset(&job, 0, sizeof(job));
+	lua_rawgeti(L, 1, i);
+	job.path = (char *)lua_tostring(L, -1);
+	if (job.path)
+	    read_save(&job);
+	// Old style save files aren't worth learning from.
+	if (job.path && !job.errmsg[0] && job.image.len >= 8 &&
+	    !memcmp(job.image.data, SAVE_MAGIC, 8) &&
+	    !buffer_add(&samples, job.image.data, job.image.len))
+	    sizes[used++] = job.image.len;
+	free(job.image.data);
+	lua_pop(L, 1);
+    }
+
+    const char *errmsg = NULL;
+    char *dictionary = NULL;
+    size_t len = 0;
+    // zstd wants samples of about a hundred times the dictionary size.
+    if (capacity > samples.len / 100)
+	capacity = samples.len / 100;
+    if (used < MIN_TRAINING_FILES || capacity < 1024)
+	errmsg = "Too few save files to train a dictionary";
+    else if (!(dictionary = malloc(capacity)))
+	errmsg = strerror(ENOMEM);
+    else {
+	len = ZDICT_trainFromBuffer(dictionary, capacity, samples.data,
+				    sizes, used);
+	if (ZDICT_isError(len))
+	    errmsg = ZDICT_getErrorName(len);
+    }
+    free(samples.data);
+    free(sizes);
+    if (errmsg) {
+	free(dictionary);
+	lua_pushnil(L);
+	lua_pushstring(L, errmsg);
+	return 2;
+    }
+    lua_pushlstring(L, dictionary, len);
+    lua_pushnumber(L, ZDICT_getDictID(dictionary, len));
+    lua_pushinteger(L, used);
+    free(dictionary);
+    return 3;
+}
+
+// recompress(path) rewrites a save file as one frame, compressed as
+// set_compression() last asked.  Returns the new size and the old, or
+// nil and an error message.
+LUAFN(recompress)
+{
+    load_job job;
+    const char *errmsg = NULL;
+
+    memset(&job, 0, sizeof(job));
+    job.path = (char *)luaL_checkstring(L, 1);
+    read_save(&job);
+    if (job.errmsg[0])
+	errmsg = job.errmsg;
+    else {
+	char *temp;
+	int fd = create_temp(job.path, &temp);
+	if (fd < 0)
+	    errmsg = strerror(errno);
+	else {
+	    zwriter w;
+	    if (zwriter_open(&w, fd))
+		errmsg = strerror(ENOMEM);
+	    else {
+		zwrite(&w, job.image.data, job.image.len, ZSTD_e_end);
+		errmsg = w.errmsg;
+		zwriter_close(&w);
+	    }
+	    off_t size = lseek(fd, 0, SEEK_END);
+	    if (!(errmsg = install_temp(fd, temp, job.path, errmsg))) {
+		free(job.image.data);
+		lua_pushnumber(L, size);
+		lua_pushnumber(L, job.size);
+		return 2;
+	    }
+	}
+    }
+    free(job.image.data);
+    lua_pushnil(L);
+    lua_pushstring(L, errmsg);
+    return 2;
+}
+
+/* A watcher follows a package tree with inotify: the top directory,
+ * each category directory under it, and ../isolinux for setpkg.  Its
+ * environment table maps each watch descriptor to the directory it
+ * watches.
+ */
+#define WATCH_MASK (IN_CREATE | IN_CLOSE_WRITE | IN_DELETE | \
+		    IN_MOVED_FROM | IN_MOVED_TO)
+
+typedef struct {
+    int fd, top;
+} watcher;
+
+static int add_watch(lua_State *L, watcher *w, int paths, const char *path)
+{
+    int wd = inotify_add_watch(w->fd, path, WATCH_MASK);
+
+    if (wd >= 0) {
+	lua_pushstring(L, path);
+	lua_rawseti(L, paths, wd);
+    }
+    return wd;
+}
+
+// Watch each directory in directory.
+static void add_subdirectory_watches(lua_State *L, watcher *w, int paths,
+				     const char *directory)
+{
+    DIR *dir = opendir(directory);
+    struct dirent *entry;
+    struct stat sb;
+
+    if (!dir)
+	return;
+    while ((entry = readdir(dir))) {
+	if (entry->d_name[0] == '.')
+	    continue;
+	lua_pushfstring(L, "%s/%s", directory, entry->d_name);
+	const char *path = lua_tostring(L, -1);
+	if (!stat(path, &sb) && S_ISDIR(sb.st_mode))
+	    add_watch(L, w, paths, path);
+	lua_pop(L, 1);
+    }
+    closedir(dir);
+}
+
+// watch(directory) starts watching a package tree.  Returns a watcher,
+// or nil and an error message.
+LUAFN(watch)
+{
+    const char *directory = luaL_checkstring(L, 1);
+    watcher *w = lua_newuserdata(L, sizeof(watcher));
+
+    w->fd = -1;
+    luaL_getmetatable(L, WATCH_META);
+    lua_setmetatable(L, -2);
+    lua_newtable(L);
+    int paths = lua_gettop(L);
+    lua_pushvalue(L, paths);
+    lua_setfenv(L, -3);
+
+    if ((w->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0 ||
+	(w->top = add_watch(L, w, paths, directory)) < 0) {
+	lua_pushnil(L);
+	lua_pushfstring(L, "Can't watch %s: %s", directory, strerror(errno));
+	return 2;
+    }
+    add_subdirectory_watches(L, w, paths, directory);
+    lua_pushfstring(L, "%s/../isolinux", directory);
+    add_watch(L, w, paths, lua_tostring(L, -1));
+    lua_pop(L, 2);
+    return 1;
+}
+
+static void push_change(lua_State *L, int changes, const char *path,
+			const char *kind, int directory)
+{
+    lua_createtable(L, 0, 3);
+    lua_pushstring(L, path);
+    lua_setfield(L, -2, "path");
+    lua_pushstring(L, kind);
+    lua_setfield(L, -2, "kind");
+    if (directory) {
+	lua_pushboolean(L, 1);
+	lua_setfield(L, -2, "directory");
+    }
+    lua_rawseti(L, changes, lua_objlen(L, changes) + 1);
+}
+
+// Returns an array of what has happened since the last call, each a
+// table of path, kind and directory.  The kind is "changed" for
+// anything created, written or moved in, "removed" for anything
+// deleted or moved out, and "overflow" if events were lost and the
+// whole tree has to be looked at again.  Never blocks.
+LUAFN(watcher_read)
+{
+    watcher *w = luaL_checkudata(L, 1, WATCH_META);
+    char events[4096]
+	__attribute__((aligned(__alignof__(struct inotify_event))));
+
+    if (w->fd < 0)
+	return luaL_error(L, "Watcher is closed");
+    lua_settop(L, 1);
+    lua_getfenv(L, 1);
+    lua_newtable(L);
+    for (;;) {
+	ssize_t len = read(w->fd, events, sizeof(events));
+	if (len < 0 && errno == EINTR)
+	    continue;
+	if (len < 0 && errno == EAGAIN)
+	    break;
+	if (len <= 0) {
+	    lua_pushnil(L);
+	    lua_pushstring(L, len < 0 ? strerror(errno) : "Watch ended");
+	    return 2;
+	}
+	for (char *at = events; at < events + len;) {
+	    const struct inotify_event *event = (void *)at;
+	    at += sizeof(struct inotify_event) + event->len;
+	    if (event->mask & IN_Q_OVERFLOW) {
+		push_change(L, 3, "", "overflow", 0);
+		continue;
+	    }
+	    lua_rawgeti(L, 2, event->wd);
+	    if (lua_isnil(L, -1)) {
+		lua_pop(L, 1);
+		continue;
+	    }
+	    if (event->mask & IN_IGNORED) {
+		lua_pushnil(L);
+		lua_rawseti(L, 2, event->wd);
+		lua_pop(L, 1);
+		continue;
+	    }
+	    if (event->len)
+		lua_pushfstring(L, "%s/%s", lua_tostring(L, -1), event->name);
+	    else
+		lua_pushvalue(L, -1);
+	    const char *path = lua_tostring(L, -1);
+	    int directory = (event->mask & IN_ISDIR) != 0;
+	    if (event->mask & (IN_DELETE | IN_MOVED_FROM))
+		push_change(L, 3, path, "removed", directory);
+	    else {
+		// A new category directory needs watching too.
+		if (directory && event->wd == w->top)
+		    add_watch(L, w, 2, path);
+		push_change(L, 3, path, "changed", directory);
+	    }
+	    lua_pop(L, 2);
+	}
+    }
+    return 1;
+}
+
+LUAFN(watcher_close)
+{
+    watcher *w = luaL_checkudata(L, 1, WATCH_META);
+
+    if (w->fd >= 0)
+	close(w->fd);
+    w->fd = -1;
+    return 0;
+}
+
+int luaopen_tagfns(lua_State *L)
+{
+    static const luaL_Reg funcptrs[] = {
+	FN_ENTRY(read_tagfiles),
+	FN_ENTRY(save),
+	FN_ENTRY(append),
+	FN_ENTRY(load),
+	FN_ENTRY(start_load),
+	FN_ENTRY(set_compression),
+	FN_ENTRY(train_dictionary),
+	FN_ENTRY(recompress),
+	FN_ENTRY(watch),
+	{ NULL, NULL }
+    };
+
+    static const luaL_Reg watcher_methods[] = {
+	{ "read", lua_fn_watcher_read },
+	{ "close", lua_fn_watcher_close },
+	{ NULL, NULL }
+    };
+
+    static const luaL_Reg load_methods[] = {
+	{ "ready", lua_fn_load_ready },
+	{ "result", lua_fn_load_result },
+	{ NULL, NULL }
+    };
+
+    luaL_newmetatable(L, LOAD_META);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, lua_fn_load_gc);
+    lua_setfield(L, -2, "__gc");
+    luaL_register(L, NULL, load_methods);
+    lua_pop(L, 1);
+
+    luaL_newmetatable(L, WATCH_META);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, lua_fn_watcher_close);
+    lua_setfield(L, -2, "__gc");
+    luaL_register(L, NULL, watcher_methods);
+    lua_pop(L, 1);
+
+    luaL_register(L, "tagfns", funcptrs);
+    return 1;
+}
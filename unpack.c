@@ -0,0 +1,291 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <zlib.h>
+#include <bzlib.h>
+#include <lzma.h>
+#include "unpack.h"
+
+// Compressed input is read in clumps of this size.
+#define INPUT_CLUMP (256 * 1024)
+
+enum format { PLAIN, GZIP, BZIP2, XZ, LZMA };
+
+struct unpack {
+    int fd;
+    enum format format;
+    int input_eof, output_eof;
+    const char *errmsg;
+    unsigned char *next_in;
+    size_t avail_in;
+    union {
+	z_stream gz;
+	bz_stream bz;
+	lzma_stream xz;
+    } u;
+    unsigned char input[INPUT_CLUMP];
+};
+
+static int refill(unpack *stream)
+{
+    ssize_t actual;
+
+    if (stream->avail_in > 0 || stream->input_eof)
+	return 0;
+    do
+	actual = read(stream->fd, stream->input, INPUT_CLUMP);
+    while (actual == -1 && errno == EINTR);
+    if (actual < 0) {
+	stream->errmsg = strerror(errno);
+	return -1;
+    }
+    if (actual == 0)
+	stream->input_eof = 1;
+    stream->next_in = stream->input;
+    stream->avail_in = actual;
+    return 0;
+}
+
+static int start_decoder(unpack *stream)
+{
+    memset(&stream->u, 0, sizeof(stream->u));
+    switch (stream->format) {
+    case GZIP:
+	// 15 + 32 selects gzip or zlib headers automatically.
+	if (inflateInit2(&stream->u.gz, 15 + 32) != Z_OK)
+	    return -1;
+	break;
+    case BZIP2:
+	if (BZ2_bzDecompressInit(&stream->u.bz, 0, 0) != BZ_OK)
+	    return -1;
+	break;
+    case XZ:
+	stream->u.xz = (lzma_stream)LZMA_STREAM_INIT;
+	if (lzma_stream_decoder(&stream->u.xz, UINT64_MAX,
+				LZMA_CONCATENATED) != LZMA_OK)
+	    return -1;
+	break;
+    case LZMA:
+	stream->u.xz = (lzma_stream)LZMA_STREAM_INIT;
+	if (lzma_alone_decoder(&stream->u.xz, UINT64_MAX) != LZMA_OK)
+	    return -1;
+	break;
+    case PLAIN:
+	break;
+    }
+    return 0;
+}
+
+static void end_decoder(unpack *stream)
+{
+    switch (stream->format) {
+    case GZIP:
+	inflateEnd(&stream->u.gz);
+	break;
+    case BZIP2:
+	BZ2_bzDecompressEnd(&stream->u.bz);
+	break;
+    case XZ:
+    case LZMA:
+	lzma_end(&stream->u.xz);
+	break;
+    case PLAIN:
+	break;
+    }
+}
+
+unpack *unpack_open(const char *path, const char **errmsg)
+{
+    unpack *stream = malloc(sizeof(unpack));
+
+    if (!stream) {
+	*errmsg = strerror(ENOMEM);
+	return NULL;
+    }
+    memset(stream, 0, offsetof(unpack, input));
+    if ((stream->fd = open(path, O_RDONLY)) < 0) {
+	*errmsg = strerror(errno);
+	free(stream);
+	return NULL;
+    }
+    if (refill(stream)) {
+	*errmsg = stream->errmsg;
+	close(stream->fd);
+	free(stream);
+	return NULL;
+    }
+
+    const unsigned char *magic = stream->next_in;
+    size_t len = stream->avail_in;
+    const char *ext = strrchr(path, '.');
+    if (len >= 2 && magic[0] == 0x1f && magic[1] == 0x8b)
+	stream->format = GZIP;
+    else if (len >= 3 && !memcmp(magic, "BZh", 3))
+	stream->format = BZIP2;
+    else if (len >= 6 && !memcmp(magic, "\xfd" "7zXZ\0", 6))
+	stream->format = XZ;
+    else if (ext && (!strcmp(ext, ".tlz") || !strcmp(ext, ".lzma")))
+	// The old lzma format has no magic worth speaking of.
+	stream->format = LZMA;
+    else
+	stream->format = PLAIN;
+
+    if (start_decoder(stream)) {
+	*errmsg = "Can't initialize decompressor";
+	close(stream->fd);
+	free(stream);
+	return NULL;
+    }
+    return stream;
+}
+
+// Decompress into buffer.  Returns bytes produced or -1.
+static ssize_t decode(unpack *stream, unsigned char *buffer, size_t len)
+{
+    int rc;
+    size_t produced;
+
+    switch (stream->format) {
+    case GZIP:
+	stream->u.gz.next_in = stream->next_in;
+	stream->u.gz.avail_in = stream->avail_in;
+	stream->u.gz.next_out = buffer;
+	stream->u.gz.avail_out = len;
+	rc = inflate(&stream->u.gz, Z_NO_FLUSH);
+	stream->next_in = stream->u.gz.next_in;
+	stream->avail_in = stream->u.gz.avail_in;
+	produced = len - stream->u.gz.avail_out;
+	if (rc == Z_STREAM_END) {
+	    // Concatenated gzip members are legal.  Anything else
+	    // following the first member is trailing junk.
+	    if (refill(stream))
+		return -1;
+	    if (stream->avail_in >= 2 &&
+		stream->next_in[0] == 0x1f && stream->next_in[1] == 0x8b)
+		inflateReset(&stream->u.gz);
+	    else
+		stream->output_eof = 1;
+	} else if (rc == Z_BUF_ERROR && stream->input_eof) {
+	    stream->errmsg = "Truncated gzip stream";
+	    return -1;
+	} else if (rc != Z_OK && rc != Z_BUF_ERROR) {
+	    stream->errmsg = stream->u.gz.msg ? stream->u.gz.msg :
+		"Corrupt gzip stream";
+	    return -1;
+	}
+	return produced;
+
+    case BZIP2:
+	stream->u.bz.next_in = (char *)stream->next_in;
+	stream->u.bz.avail_in = stream->avail_in;
+	stream->u.bz.next_out = (char *)buffer;
+	stream->u.bz.avail_out = len;
+	rc = BZ2_bzDecompress(&stream->u.bz);
+	stream->next_in = (unsigned char *)stream->u.bz.next_in;
+	stream->avail_in = stream->u.bz.avail_in;
+	produced = len - stream->u.bz.avail_out;
+	if (rc == BZ_STREAM_END) {
+	    if (refill(stream))
+		return -1;
+	    if (stream->avail_in >= 3 && !memcmp(stream->next_in, "BZh", 3)) {
+		BZ2_bzDecompressEnd(&stream->u.bz);
+		memset(&stream->u.bz, 0, sizeof(stream->u.bz));
+		if (BZ2_bzDecompressInit(&stream->u.bz, 0, 0) != BZ_OK) {
+		    stream->errmsg = "Can't initialize decompressor";
+		    return -1;
+		}
+	    } else
+		stream->output_eof = 1;
+	} else if (rc != BZ_OK) {
+	    stream->errmsg = "Corrupt bzip2 stream";
+	    return -1;
+	} else if (produced == 0 && stream->input_eof &&
+		   stream->avail_in == 0) {
+	    stream->errmsg = "Truncated bzip2 stream";
+	    return -1;
+	}
+	return produced;
+
+    case XZ:
+    case LZMA:
+	stream->u.xz.next_in = stream->next_in;
+	stream->u.xz.avail_in = stream->avail_in;
+	stream->u.xz.next_out = buffer;
+	stream->u.xz.avail_out = len;
+	rc = lzma_code(&stream->u.xz,
+		       stream->input_eof ? LZMA_FINISH : LZMA_RUN);
+	stream->next_in = (unsigned char *)stream->u.xz.next_in;
+	stream->avail_in = stream->u.xz.avail_in;
+	produced = len - stream->u.xz.avail_out;
+	if (rc == LZMA_STREAM_END)
+	    stream->output_eof = 1;
+	else if (rc == LZMA_BUF_ERROR && stream->input_eof) {
+	    stream->errmsg = "Truncated xz/lzma stream";
+	    return -1;
+	} else if (rc != LZMA_OK && rc != LZMA_BUF_ERROR) {
+	    stream->errmsg = rc == LZMA_MEM_ERROR ? strerror(ENOMEM) :
+		"Corrupt xz/lzma stream";
+	    return -1;
+	}
+	return produced;
+
+    case PLAIN:
+	produced = stream->avail_in < len ? stream->avail_in : len;
+	memcpy(buffer, stream->next_in, produced);
+	stream->next_in += produced;
+	stream->avail_in -= produced;
+	if (stream->input_eof)
+	    stream->output_eof = 1;
+	return produced;
+    }
+    return -1;
+}
+
+ssize_t unpack_read(unpack *stream, void *buffer, size_t len)
+{
+    size_t total = 0;
+
+    while (total < len && !stream->output_eof) {
+	if (refill(stream))
+	    return -1;
+	ssize_t actual = decode(stream, (unsigned char *)buffer + total,
+				len - total);
+	if (actual < 0)
+	    return -1;
+	total += actual;
+    }
+    return total;
+}
+
+int unpack_skip(unpack *stream, uint64_t len)
+{
+    unsigned char sink[16384];
+
+    while (len > 0) {
+	size_t want = len < sizeof(sink) ? len : sizeof(sink);
+	ssize_t actual = unpack_read(stream, sink, want);
+	if (actual < (ssize_t)want) {
+	    if (actual >= 0)
+		stream->errmsg = "Unexpected end of archive";
+	    return -1;
+	}
+	len -= actual;
+    }
+    return 0;
+}
+
+const char *unpack_error(unpack *stream)
+{
+    return stream->errmsg ? stream->errmsg : "Unexpected end of archive";
+}
+
+void unpack_close(unpack *stream)
+{
+    if (!stream)
+	return;
+    end_decoder(stream);
+    close(stream->fd);
+    free(stream);
+}
@@ -0,0 +1,25 @@
+#ifndef __UNPACK_H__
+#define __UNPACK_H__
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Streaming decompression of package archives.  The compression
+// format is sniffed from the leading bytes of the file, so .tgz, .tbz,
+// .tlz, .txz and plain tar all read alike.
+
+typedef struct unpack unpack;
+
+unpack *unpack_open(const char *path, const char **errmsg);
+
+// Returns the count of bytes read, 0 at end of stream or -1 on error.
+// Short reads happen only at the end of the stream.
+ssize_t unpack_read(unpack *stream, void *buffer, size_t len);
+
+// Read and discard len bytes.  Returns 0, or -1 on error or early end.
+int unpack_skip(unpack *stream, uint64_t len);
+
+const char *unpack_error(unpack *stream);
+
+void unpack_close(unpack *stream);
+#endif
@@ -1,5 +1,5 @@
-// Needed for clock_gettime() and friends.
-#define _POSIX_C_SOURCE 199309
+// Needed for clock_gettime(), pread() and friends.
+#define _POSIX_C_SOURCE 200809L
 
 #include <signal.h>
 #include <unistd.h>
@@ -18,6 +18,12 @@
 #include <sys/mman.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <lzma.h>
+#include <pthread.h>
+#include "unpack.h"
+#include "pool.h"
 
 // Where is this defined.
 char *realpath(const char *path, char *resolved_path);
@@ -148,28 +154,756 @@ LUAFN(stream_length)
     return 1;
 }
 
-LUAFN(xxhsum_file)
+// Decompression for formats without size metadata goes in these.
+#define DECODE_CLUMP (1024 * 1024)
+
+#define UNCOMPRESSED_SIZES "util.uncompressed_sizes"
+
+// Sum the sizes in the indexes of the xz streams, working back from
+// the end of the file.
+static int xz_size(int fd, off_t pos, uint64_t *result)
+{
+    uint64_t total = 0;
+
+    while (pos > 0) {
+	uint8_t footer[LZMA_STREAM_HEADER_SIZE];
+	if (pos < 2 * LZMA_STREAM_HEADER_SIZE ||
+	    pread(fd, footer, sizeof(footer), pos - sizeof(footer)) !=
+	    sizeof(footer))
+	    return -1;
+	// Stream padding comes in multiples of four nul bytes.
+	if (!memcmp(footer + sizeof(footer) - 4, "\0\0\0\0", 4)) {
+	    pos -= 4;
+	    continue;
+	}
+	lzma_stream_flags flags;
+	if (lzma_stream_footer_decode(&flags, footer) != LZMA_OK ||
+	    pos - 2 * LZMA_STREAM_HEADER_SIZE < flags.backward_size)
+	    return -1;
+	uint8_t *buffer = malloc(flags.backward_size);
+	if (!buffer)
+	    return -1;
+	lzma_index *index = NULL;
+	uint64_t memlimit = UINT64_MAX;
+	size_t in_pos = 0;
+	int ok = pread(fd, buffer, flags.backward_size,
+		       pos - sizeof(footer) - flags.backward_size) ==
+	    flags.backward_size &&
+	    lzma_index_buffer_decode(&index, &memlimit, NULL, buffer, &in_pos,
+				     flags.backward_size) == LZMA_OK;
+	free(buffer);
+	if (!ok)
+	    return -1;
+	total += lzma_index_uncompressed_size(index);
+	lzma_vli stream_size = lzma_index_stream_size(index);
+	lzma_index_end(index, NULL);
+	if (stream_size > pos)
+	    return -1;
+	pos -= stream_size;
+    }
+    *result = total;
+    return 0;
+}
+
+static int decoded_size(const char *path, uint64_t *result)
+{
+    const char *errmsg;
+    unpack *stream = unpack_open(path, &errmsg);
+    char *buffer = malloc(DECODE_CLUMP);
+    uint64_t total = 0;
+    ssize_t actual = -1;
+
+    if (stream && buffer)
+	while ((actual = unpack_read(stream, buffer, DECODE_CLUMP)) > 0)
+	    total += actual;
+    free(buffer);
+    unpack_close(stream);
+    *result = total;
+    return actual < 0 ? -1 : 0;
+}
+
+// Find the size of path once decompressed.  Gzip and xz say so in
+// their trailers, as old lzma may in its header.  Others are decoded.
+static int uncompressed_size(const char *path, int fd, off_t size,
+			     uint64_t *result)
+{
+    unsigned char header[13];
+    ssize_t len = pread(fd, header, sizeof(header), 0);
+
+    if (len >= 2 && header[0] == 0x1f && header[1] == 0x8b) {
+	// ISIZE is the size modulo 2^32 of the last member, which
+	// makepkg writes as the only one.  Nothing deflates to much
+	// more than its own size, so a small ISIZE means it wrapped,
+	// and then we count.
+	unsigned char trailer[4];
+	if (size >= 18 && pread(fd, trailer, 4, size - 4) == 4) {
+	    uint64_t isize = trailer[0] | trailer[1] << 8 |
+		trailer[2] << 16 | (uint64_t)trailer[3] << 24;
+	    if (isize + 18 + size / 1000 >= (uint64_t)size) {
+		*result = isize;
+		return 0;
+	    }
+	}
+    } else if (len >= 6 && !memcmp(header, "\xfd" "7zXZ\0", 6)) {
+	if (!xz_size(fd, size, result))
+	    return 0;
+    } else if (len == 13 && header[0] <= 225) {
+	const char *ext = strrchr(path, '.');
+	uint64_t stated = 0;
+	for (int i = 12; i >= 5; i--)
+	    stated = stated << 8 | header[i];
+	if (ext && (!strcmp(ext, ".tlz") || !strcmp(ext, ".lzma")) &&
+	    stated != UINT64_MAX) {
+	    *result = stated;
+	    return 0;
+	}
+    }
+    return decoded_size(path, result);
+}
+
+// Push the memo key for the file.
+static void push_size_key(lua_State *L, const struct stat *sb)
+{
+    lua_pushfstring(L, "%f:%f:%f:%f", (double)sb->st_dev, (double)sb->st_ino,
+		    (double)sb->st_mtime, (double)sb->st_size);
+}
+
+// Returns the size of a (possibly compressed) package once
+// uncompressed.  Results are remembered for as long as the file
+// looks unchanged.
+LUAFN(uncompressed_size)
 {
+    const char *path = luaL_checkstring(L, 1);
+    struct stat sb;
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0 || fstat(fd, &sb) < 0) {
+	if (fd >= 0)
+	    close(fd);
+	lua_pushnil(L);
+	lua_pushinteger(L, errno);
+	return 2;
+    }
+
+    lua_getfield(L, LUA_REGISTRYINDEX, UNCOMPRESSED_SIZES);
+    push_size_key(L, &sb);
+    lua_pushvalue(L, -1);
+    lua_rawget(L, -3);
+    if (!lua_isnil(L, -1)) {
+	close(fd);
+	return 1;
+    }
+    lua_pop(L, 1);
+
+    uint64_t result;
+    int rc = uncompressed_size(path, fd, sb.st_size, &result);
+    close(fd);
+    if (rc) {
+	lua_pushnil(L);
+	lua_pushfstring(L, "Can't decompress %s", path);
+	return 2;
+    }
+    lua_pushnumber(L, result);
+    lua_pushvalue(L, -1);
+    lua_insert(L, -3);
+    lua_rawset(L, -4);
+    return 1;
+}
+
+struct size_batch {
+    const char **paths;
+    struct stat *stats;
+    uint64_t *sizes;
+    int *status;
+};
+
+static void size_batch_item(void *context, size_t index)
+{
+    struct size_batch *batch = context;
+    const char *path = batch->paths[index];
     int fd;
+
+    if (batch->status[index])
+	return;
+    if ((fd = open(path, O_RDONLY)) < 0) {
+	batch->status[index] = -1;
+	return;
+    }
+    batch->status[index] = uncompressed_size(path, fd, batch->stats[index].st_size,
+					     &batch->sizes[index]) ? -1 : 1;
+    close(fd);
+}
+
+/* Like uncompressed_size, for a table of paths, with the decoding
+ * done on worker threads.  Returns a table of sizes keyed by path,
+ * leaving out the files that couldn't be read.  The second argument
+ * is a thread count, defaulting to one per CPU.
+ */
+LUAFN(uncompressed_sizes)
+{
+    luaL_checktype(L, 1, LUA_TTABLE);
+    int threads = luaL_optinteger(L, 2, 0);
+    size_t count = lua_objlen(L, 1);
+    struct size_batch batch;
+
+    batch.paths = malloc((count + 1) * sizeof(char *));
+    batch.stats = malloc((count + 1) * sizeof(struct stat));
+    batch.sizes = malloc((count + 1) * sizeof(uint64_t));
+    batch.status = calloc(count + 1, sizeof(int));
+    if (!batch.paths || !batch.stats || !batch.sizes || !batch.status) {
+	free(batch.paths);
+	free(batch.stats);
+	free(batch.sizes);
+	free(batch.status);
+	return luaL_error(L, "%s", strerror(ENOMEM));
+    }
+
+    lua_getfield(L, LUA_REGISTRYINDEX, UNCOMPRESSED_SIZES);
+    int memo = lua_gettop(L);
+    for (size_t i = 0; i < count; i++) {
+	// The path strings stay anchored by the argument table.
+	lua_rawgeti(L, 1, i + 1);
+	batch.paths[i] = lua_tostring(L, -1);
+	lua_pop(L, 1);
+	if (!batch.paths[i] || stat(batch.paths[i], &batch.stats[i]) < 0) {
+	    batch.status[i] = -1;
+	    continue;
+	}
+	push_size_key(L, &batch.stats[i]);
+	lua_rawget(L, memo);
+	if (lua_isnumber(L, -1)) {
+	    batch.sizes[i] = lua_tonumber(L, -1);
+	    batch.status[i] = 1;
+	}
+	lua_pop(L, 1);
+    }
+
+    int rc = pool_run(count, threads, size_batch_item, &batch);
+    lua_newtable(L);
+    for (size_t i = 0; !rc && i < count; i++) {
+	if (batch.status[i] <= 0)
+	    continue;
+	lua_pushnumber(L, batch.sizes[i]);
+	push_size_key(L, &batch.stats[i]);
+	lua_pushvalue(L, -2);
+	lua_rawset(L, memo);
+	lua_setfield(L, -2, batch.paths[i]);
+    }
+    free(batch.paths);
+    free(batch.stats);
+    free(batch.sizes);
+    free(batch.status);
+    if (rc) {
+	lua_pushnil(L);
+	lua_pushstring(L, "Can't start decoding threads");
+	return 2;
+    }
+    return 1;
+}
+
+/* Describing packages in the background.  For each description file,
+ * a worker reads it and finds the package archive beside it with its
+ * sizes, touching nothing of the Lua state, and the results are
+ * taken as they come.
+ */
+#define DESCRIBE_META "util.describe_job"
+
+typedef struct {
+    char *file;
+    char *text;			// NULL if it couldn't be read
+    size_t text_len;
+    char *package;		// The archive, if just one matches
+    size_t matches;
+    off_t compressed;
+    uint64_t uncompressed;
+    int compressed_ok, uncompressed_ok;
+    int done, taken;
+} package_facts;
+
+typedef struct {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    int threaded, cancel, threads, uncompressed;
+    size_t count, left;
+    package_facts *facts;
+} describe_job;
+
+static char *read_text(const char *path, size_t *len)
+{
+    int fd = open(path, O_RDONLY);
     struct stat sb;
-    if ((fd = open(luaL_checkstring(L, 1), O_RDONLY)) == -1 ||
-	fstat(fd, &sb) == -1) {
+    char *text = NULL;
+
+    if (fd < 0)
+	return NULL;
+    if (fstat(fd, &sb) == 0 && sb.st_size < 1024 * 1024 &&
+	(text = malloc(sb.st_size + 1))) {
+	ssize_t actual = read(fd, text, sb.st_size);
+	if (actual < 0) {
+	    free(text);
+	    text = NULL;
+	} else
+	    *len = actual;
+    }
+    close(fd);
+    return text;
+}
+
+static void describe_item(void *context, size_t index)
+{
+    describe_job *job = context;
+    package_facts *facts = &job->facts[index];
+
+    pthread_mutex_lock(&job->lock);
+    int cancel = job->cancel;
+    pthread_mutex_unlock(&job->lock);
+    if (cancel)
+	return;
+
+    facts->text = read_text(facts->file, &facts->text_len);
+    // The archive is the description file with a t?z extension.
+    size_t len = strlen(facts->file);
+    if (len > 3 && !strcmp(facts->file + len - 3, "txt")) {
+	char *pattern = strdup(facts->file);
+	glob_t matches;
+	if (pattern) {
+	    strcpy(pattern + len - 3, "t?z");
+	    // Without GLOB_TILDE, glob() keeps to its arguments.
+	    if (!glob(pattern, 0, NULL, &matches)) {
+		facts->matches = matches.gl_pathc;
+		if (matches.gl_pathc == 1)
+		    facts->package = strdup(matches.gl_pathv[0]);
+		globfree(&matches);
+	    }
+	    free(pattern);
+	}
+    }
+    if (facts->package) {
+	struct stat sb;
+	int fd = open(facts->package, O_RDONLY);
+	if (fd >= 0 && fstat(fd, &sb) == 0) {
+	    facts->compressed = sb.st_size;
+	    facts->compressed_ok = 1;
+	    if (job->uncompressed)
+		facts->uncompressed_ok =
+		    !uncompressed_size(facts->package, fd, sb.st_size,
+				       &facts->uncompressed);
+	}
+	if (fd >= 0)
+	    close(fd);
+    }
+    pthread_mutex_lock(&job->lock);
+    facts->done = 1;
+    job->left--;
+    pthread_mutex_unlock(&job->lock);
+}
+
+static void *describe_thread(void *arg)
+{
+    describe_job *job = arg;
+
+    if (pool_run(job->count, job->threads, describe_item, job))
+	// No workers to be had, so do it here.
+	for (size_t i = 0; i < job->count; i++)
+	    describe_item(job, i);
+    return NULL;
+}
+
+/* Start describing the packages whose description files are given, on
+ * worker threads.  Options: uncompressed, to find uncompressed sizes
+ * too, and threads.  Returns a job whose take() method gives what's
+ * been found since last asked.
+ */
+LUAFN(describe_packages)
+{
+    luaL_checktype(L, 1, LUA_TTABLE);
+    size_t count = lua_objlen(L, 1);
+    describe_job *job = lua_newuserdata(L, sizeof(describe_job));
+
+    memset(job, 0, sizeof(describe_job));
+    luaL_getmetatable(L, DESCRIBE_META);
+    lua_setmetatable(L, -2);
+    if (lua_istable(L, 2)) {
+	lua_getfield(L, 2, "threads");
+	job->threads = lua_tointeger(L, -1);
+	lua_getfield(L, 2, "uncompressed");
+	job->uncompressed = lua_toboolean(L, -1);
+	lua_pop(L, 2);
+    }
+    if (!(job->facts = calloc(count + 1, sizeof(package_facts))))
+	return luaL_error(L, "%s", strerror(ENOMEM));
+    job->count = job->left = count;
+    for (size_t i = 0; i < count; i++) {
+	lua_rawgeti(L, 1, i + 1);
+	const char *file = lua_tostring(L, -1);
+	lua_pop(L, 1);
+	if (!file)
+	    return luaL_argerror(L, 1, "file names must be strings");
+	if (!(job->facts[i].file = strdup(file)))
+	    return luaL_error(L, "%s", strerror(ENOMEM));
+    }
+    pthread_mutex_init(&job->lock, NULL);
+    if (!pthread_create(&job->thread, NULL, describe_thread, job))
+	job->threaded = 1;
+    else
+	describe_thread(job);
+    return 1;
+}
+
+static void wait_for_description(describe_job *job)
+{
+    if (job->threaded) {
+	pthread_join(job->thread, NULL);
+	job->threaded = 0;
+    }
+}
+
+/* job:take([wait]) returns a table, keyed by description file, of the
+ * packages described since last time, and whether all are done.  Each
+ * has the text of its description file, unless that couldn't be read,
+ * the package archive if just one matches, the count of those that
+ * do, and its compressed and uncompressed sizes as far as they're
+ * known.  With wait, it waits for them all.
+ */
+LUAFN(describe_take)
+{
+    describe_job *job = luaL_checkudata(L, 1, DESCRIBE_META);
+
+    if (lua_toboolean(L, 2))
+	wait_for_description(job);
+    lua_newtable(L);
+    lua_getfield(L, LUA_REGISTRYINDEX, UNCOMPRESSED_SIZES);
+    pthread_mutex_lock(&job->lock);
+    int finished = job->left == 0;
+    for (size_t i = 0; i < job->count; i++) {
+	package_facts *facts = &job->facts[i];
+	if (!facts->done || facts->taken)
+	    continue;
+	facts->taken = 1;
+	lua_newtable(L);
+	if (facts->text) {
+	    lua_pushlstring(L, facts->text, facts->text_len);
+	    lua_setfield(L, -2, "text");
+	}
+	if (facts->package) {
+	    lua_pushstring(L, facts->package);
+	    lua_setfield(L, -2, "package");
+	}
+	lua_pushnumber(L, facts->matches);
+	lua_setfield(L, -2, "matches");
+	if (facts->compressed_ok) {
+	    lua_pushnumber(L, facts->compressed);
+	    lua_setfield(L, -2, "compressed");
+	}
+	if (facts->uncompressed_ok) {
+	    lua_pushnumber(L, facts->uncompressed);
+	    lua_setfield(L, -2, "uncompressed");
+	    // Remember it as uncompressed_size would.
+	    struct stat sb;
+	    if (stat(facts->package, &sb) == 0 &&
+		sb.st_size == facts->compressed) {
+		push_size_key(L, &sb);
+		lua_pushnumber(L, facts->uncompressed);
+		lua_rawset(L, -4);
+	    }
+	}
+	lua_setfield(L, -3, facts->file);
+    }
+    pthread_mutex_unlock(&job->lock);
+    lua_pop(L, 1);
+    lua_pushboolean(L, finished);
+    return 2;
+}
+
+LUAFN(describe_gc)
+{
+    describe_job *job = luaL_checkudata(L, 1, DESCRIBE_META);
+
+    if (job->threaded) {
+	pthread_mutex_lock(&job->lock);
+	job->cancel = 1;
+	pthread_mutex_unlock(&job->lock);
+	wait_for_description(job);
+    }
+    if (job->facts) {
+	for (size_t i = 0; i < job->count; i++) {
+	    free(job->facts[i].file);
+	    free(job->facts[i].text);
+	    free(job->facts[i].package);
+	}
+	free(job->facts);
+	job->facts = NULL;
+	pthread_mutex_destroy(&job->lock);
+    }
+    return 0;
+}
+
+// Format a byte count as numfmt --to=iec does: whole numbers below
+// 1024, else one decimal below ten units, rounding away from zero.
+LUAFN(iec)
+{
+    static const char units[] = "KMGTPEZY";
+    long double n = floorl(luaL_checknumber(L, 1));
+    char outbuf[64];
+
+    if (!(n >= 0) || n > 1e30L) {
+	lua_pushnil(L);
+	return 1;
+    }
+    if (n < 1024) {
+	sprintf(outbuf, "%.0Lf", n);
+	lua_pushstring(L, outbuf);
+	return 1;
+    }
+    int unit = 0;
+    long double scale = 1024;
+    while (unit < 7 && n / scale >= 1024) {
+	scale *= 1024;
+	unit++;
+    }
+    // Tenths of a unit, rounded up.
+    long double tenths = ceill(n * 10 / scale);
+    if (tenths >= 100) {
+	long double whole = ceill(n / scale);
+	if (whole < 1024 || unit == 7) {
+	    sprintf(outbuf, "%.0Lf%c", whole, units[unit]);
+	    lua_pushstring(L, outbuf);
+	    return 1;
+	}
+	scale *= 1024;
+	unit++;
+	tenths = ceill(n * 10 / scale);
+    }
+    sprintf(outbuf, "%.1Lf%c", tenths / 10, units[unit]);
+    lua_pushstring(L, outbuf);
+    return 1;
+}
+
+// Files are hashed in pieces of this size, as cpiofns copies them.
+#define HASH_CLUMP (16 * 1024 * 1024)
+
+#define XXHSUMS "util.xxhsums"
+
+enum { XXH_64, XXH_3_64, XXH_3_128 };
+static const char *const hash_algos[] = {
+    "xxh64", "xxh3_64", "xxh3_128", NULL
+};
+
+// Hash the open file into outbuf as hex, reading it a clump at a time
+// so big files needn't be mapped whole.  Returns 0, or -1 on error.
+static int hash_fd(int fd, off_t size, int algo, char *outbuf)
+{
+    size_t clump = size < HASH_CLUMP ? size + 1 : HASH_CLUMP;
+    char *buffer = malloc(clump);
+    XXH64_state_t *state64 = algo == XXH_64 ? XXH64_createState() : NULL;
+    XXH3_state_t *state3 = algo != XXH_64 ? XXH3_createState() : NULL;
+    ssize_t actual;
+    int rc = -1;
+
+    if (!buffer || !state64 && !state3)
+	goto out;
+    if (state64)
+	XXH64_reset(state64, 0);
+    else if (algo == XXH_3_64)
+	XXH3_64bits_reset(state3);
+    else
+	XXH3_128bits_reset(state3);
+    while ((actual = read(fd, buffer, clump)) != 0) {
+	if (actual < 0) {
+	    if (errno == EINTR)
+		continue;
+	    goto out;
+	}
+	if (state64)
+	    XXH64_update(state64, buffer, actual);
+	else if (algo == XXH_3_64)
+	    XXH3_64bits_update(state3, buffer, actual);
+	else
+	    XXH3_128bits_update(state3, buffer, actual);
+    }
+    if (state64)
+	sprintf(outbuf, "%llX", (unsigned long long)XXH64_digest(state64));
+    else if (algo == XXH_3_64)
+	sprintf(outbuf, "%llX", (unsigned long long)XXH3_64bits_digest(state3));
+    else {
+	XXH128_hash_t hash = XXH3_128bits_digest(state3);
+	sprintf(outbuf, "%016llX%016llX", (unsigned long long)hash.high64,
+		(unsigned long long)hash.low64);
+    }
+    rc = 0;
+out:
+    free(buffer);
+    if (state64)
+	XXH64_freeState(state64);
+    if (state3)
+	XXH3_freeState(state3);
+    return rc;
+}
+
+// Push the memo key for the file and hash.
+static void push_hash_key(lua_State *L, const struct stat *sb, int algo)
+{
+    char key[128];
+    snprintf(key, sizeof(key), "%s:%llu:%llu:%llu:%lld.%09ld",
+	     hash_algos[algo], (unsigned long long)sb->st_dev,
+	     (unsigned long long)sb->st_ino, (unsigned long long)sb->st_size,
+	     (long long)sb->st_mtim.tv_sec, (long)sb->st_mtim.tv_nsec);
+    lua_pushstring(L, key);
+}
+
+// Returns the hash of a file as hex, or "X" if it can't be read.  The
+// optional second argument picks the hash: xxh64 (the default),
+// xxh3_64 or xxh3_128.  Hashes are remembered for as long as the file
+// looks unchanged.
+LUAFN(xxhsum_file)
+{
+    const char *path = luaL_checkstring(L, 1);
+    int algo = luaL_checkoption(L, 2, "xxh64", hash_algos);
+    struct stat sb;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY)) == -1 || fstat(fd, &sb) == -1) {
+	if (fd >= 0)
+	    close(fd);
 	lua_pushstring(L, "X");
 	return 1;
     }
-    
-    void *map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-    if (map == MAP_FAILED) {
+
+    lua_getfield(L, LUA_REGISTRYINDEX, XXHSUMS);
+    push_hash_key(L, &sb, algo);
+    lua_pushvalue(L, -1);
+    lua_rawget(L, -3);
+    if (!lua_isnil(L, -1)) {
 	close(fd);
-	lua_pushstring(L, "X");
 	return 1;
     }
+    lua_pop(L, 1);
+
+    char outbuf[40];
+    int rc = hash_fd(fd, sb.st_size, algo, outbuf);
     close(fd);
-    uint64_t result = XXH64(map, sb.st_size, 0);
-    munmap(map, sb.st_size);
-    char outbuf[24];
-    sprintf(outbuf, "%llX", (unsigned long long)result);
+    if (rc) {
+	lua_pushstring(L, "X");
+	return 1;
+    }
     lua_pushstring(L, outbuf);
+    lua_pushvalue(L, -1);
+    lua_insert(L, -3);
+    lua_rawset(L, -4);
+    return 1;
+}
+
+struct hash_batch {
+    const char **paths;
+    struct stat *stats;
+    char (*sums)[40];
+    int *status;
+    int algo;
+};
+
+static void hash_batch_item(void *context, size_t index)
+{
+    struct hash_batch *batch = context;
+    int fd;
+
+    if (batch->status[index])
+	return;
+    if ((fd = open(batch->paths[index], O_RDONLY)) < 0) {
+	batch->status[index] = -1;
+	return;
+    }
+    batch->status[index] = hash_fd(fd, batch->stats[index].st_size,
+				   batch->algo, batch->sums[index]) ? -1 : 1;
+    close(fd);
+}
+
+/* Hash a table of paths on worker threads, sharing xxhsum_file's
+ * memo.  Returns a table of hashes keyed by path, with "X" for those
+ * that couldn't be read.  Options: threads (defaults to one per CPU),
+ * algo, as for xxhsum_file, and memo, a table to remember hashes in
+ * instead, so that they may be kept between sessions.
+ */
+LUAFN(xxhsum_many)
+{
+    luaL_checktype(L, 1, LUA_TTABLE);
+    int threads = 0, algo = XXH_64;
+    if (lua_istable(L, 2)) {
+	lua_getfield(L, 2, "threads");
+	threads = lua_tointeger(L, -1);
+	lua_getfield(L, 2, "algo");
+	algo = luaL_checkoption(L, -1, "xxh64", hash_algos);
+	lua_pop(L, 2);
+    }
+    size_t count = lua_objlen(L, 1);
+    struct hash_batch batch = { .algo = algo };
+
+    batch.paths = malloc((count + 1) * sizeof(char *));
+    batch.stats = malloc((count + 1) * sizeof(struct stat));
+    batch.sums = malloc((count + 1) * sizeof(*batch.sums));
+    batch.status = calloc(count + 1, sizeof(int));
+    if (!batch.paths || !batch.stats || !batch.sums || !batch.status) {
+	free(batch.paths);
+	free(batch.stats);
+	free(batch.sums);
+	free(batch.status);
+	return luaL_error(L, "%s", strerror(ENOMEM));
+    }
+
+    lua_settop(L, 2);
+    if (lua_istable(L, 2))
+	lua_getfield(L, 2, "memo");
+    if (!lua_istable(L, -1))
+	lua_getfield(L, LUA_REGISTRYINDEX, XXHSUMS);
+    int memo = lua_gettop(L);
+    for (size_t i = 0; i < count; i++) {
+	// The path strings stay anchored by the argument table.
+	lua_rawgeti(L, 1, i + 1);
+	batch.paths[i] = lua_tostring(L, -1);
+	lua_pop(L, 1);
+	if (!batch.paths[i]) {
+	    batch.status[i] = -2;
+	    continue;
+	}
+	if (stat(batch.paths[i], &batch.stats[i]) < 0) {
+	    batch.status[i] = -1;
+	    continue;
+	}
+	push_hash_key(L, &batch.stats[i], algo);
+	lua_rawget(L, memo);
+	const char *known = lua_tostring(L, -1);
+	if (known) {
+	    snprintf(batch.sums[i], sizeof(batch.sums[i]), "%s", known);
+	    batch.status[i] = 2;
+	}
+	lua_pop(L, 1);
+    }
+
+    int rc = pool_run(count, threads, hash_batch_item, &batch);
+    lua_newtable(L);
+    for (size_t i = 0; !rc && i < count; i++) {
+	if (batch.status[i] == -2)
+	    continue;
+	if (batch.status[i] < 0)
+	    lua_pushstring(L, "X");
+	else {
+	    lua_pushstring(L, batch.sums[i]);
+	    if (batch.status[i] == 1) {
+		push_hash_key(L, &batch.stats[i], algo);
+		lua_pushvalue(L, -2);
+		lua_rawset(L, memo);
+	    }
+	}
+	lua_setfield(L, -2, batch.paths[i]);
+    }
+    free(batch.paths);
+    free(batch.stats);
+    free(batch.sums);
+    free(batch.status);
+    if (rc) {
+	lua_pushnil(L);
+	lua_pushstring(L, "Can't start hashing threads");
+	return 2;
+    }
     return 1;
 }
 
@@ -202,10 +936,30 @@ LUALIB_API int luaopen_util(lua_State *L)
 	FN_ENTRY(glob),
 	FN_ENTRY(file_size),
 	FN_ENTRY(stream_length),
+	FN_ENTRY(uncompressed_size),
+	FN_ENTRY(uncompressed_sizes),
+	FN_ENTRY(describe_packages),
+	FN_ENTRY(iec),
 	FN_ENTRY(xxhsum_file),
+	FN_ENTRY(xxhsum_many),
 	FN_ENTRY(lib_exists),
 	{ NULL, NULL }
     };
+    static const luaL_Reg describe_methods[] = {
+	{ "take", lua_fn_describe_take },
+	{ NULL, NULL }
+    };
+    lua_newtable(L);
+    lua_setfield(L, LUA_REGISTRYINDEX, UNCOMPRESSED_SIZES);
+    lua_newtable(L);
+    lua_setfield(L, LUA_REGISTRYINDEX, XXHSUMS);
+    luaL_newmetatable(L, DESCRIBE_META);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, lua_fn_describe_gc);
+    lua_setfield(L, -2, "__gc");
+    luaL_register(L, NULL, describe_methods);
+    lua_pop(L, 1);
     luaL_register(L, "util", funcptrs);
     
     return 1;
@@ -15,3 +15,28 @@ function getch(prompt, pattern, default)
    until not pattern or ch:match(pattern)
    return ch == '\n' and default or ch
 end
+
+-- A word for the shell which is just s, whatever it holds.
+function shell_quote(s)
+   return "'"..s:gsub("'", "'\\''").."'"
+end
+
+-- Per-user directory for caches shared between sessions.
+function cache_directory()
+   local directory = (os.getenv 'XDG_CACHE_HOME' or
+		      (os.getenv 'HOME' or '')..'/.cache')..'/tft'
+   if not util.readable(directory) then
+      os.execute('mkdir -p '..shell_quote(directory)..' 2>&-')
+   end
+   return directory
+end
+
+-- Per-user directory for data that, unlike a cache, can't be rebuilt.
+function data_directory()
+   local directory = (os.getenv 'XDG_DATA_HOME' or
+		      (os.getenv 'HOME' or '')..'/.local/share')..'/tft'
+   if not util.readable(directory) then
+      os.execute('mkdir -p '..shell_quote(directory)..' 2>&-')
+   end
+   return directory
+end